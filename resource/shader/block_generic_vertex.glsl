@@ -14,16 +14,22 @@ uniform mat4 mat_transform;
 // Camera Position
 uniform vec3 camera;
 
+// Mesh vertices are relative to chunk origin, constant for single
+// draws, per instance from indirect command for multi-draws
+layout(location = 3) in vec3 chunk_offset;
+
 // For fog mixing
 uniform float fog_distance;
 out float fog_factor;
 
 void main() {
-    gl_Position = mat_transform * vec4(vertex_position, 1);
+    vec3 world_position = vertex_position + chunk_offset;
+
+    gl_Position = mat_transform * vec4(world_position, 1);
 
     uv = vertex_uv;
 
     // Fog
-    float camera_distance = distance(camera, vertex_position);
+    float camera_distance = distance(camera, world_position);
     fog_factor = pow(clamp(camera_distance / fog_distance, 0.0, 1.0), 4.0);
 }
\ No newline at end of file
@@ -0,0 +1,11 @@
+#version 330 core
+
+layout(location = 0) in vec3 vertex_position;
+
+uniform vec3 box_min;
+uniform vec3 box_size;
+uniform mat4 mat_transform;
+
+void main() {
+    gl_Position = mat_transform * vec4(box_min + vertex_position * box_size, 1);
+}
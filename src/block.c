@@ -324,6 +324,7 @@ int block_attr_init(void)
         block_attr **list = block_attr_list;
 
         for (i = 0, p = list[i]; p != NULL; i++, p = list[i]) {
+                p->idx = i;
                 block_texel_init(&p->texel);
         }
 
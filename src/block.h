@@ -86,6 +86,7 @@ typedef struct block_texel {
 
 typedef struct block_attr {
         const char              *name;
+        block_attr_idx          idx;
 
         dimension               size;         // Volume considers in world
         dimension               size_model;   // Actual volume displays
@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <memory.h>
 #include <errno.h>
+#include <time.h>
+#include <math.h>
 #include <pthread.h>
 
 #include <GL/glew.h>
@@ -137,193 +140,449 @@ int block_deinit(block *b)
         return 0;
 }
 
-int chunk_init(chunk *c, ivec3 origin_chunk)
+/**
+ * Chunk Blocks
+ */
+
+static chunk_blocks *chunk_blocks_alloc(size_t capacity)
 {
-        if (!c)
-                return -EINVAL;
+        chunk_blocks *v;
 
-        memzero(c, sizeof(chunk));
+        v = memalloc(sizeof(chunk_blocks) + sizeof(block) * capacity);
+        if (!v) {
+                pr_err_alloc();
+                return NULL;
+        }
 
-        memcpy(c->origin_l, origin_chunk, sizeof(ivec3));
+        v->capacity = capacity;
 
-        linklist_alloc(&c->blocks);
-        linklist_init(c->blocks, sizeof(block));
+        return v;
+}
 
-        c->state = CHUNK_INITED;
+static void chunk_blocks_free(epoch_head *h)
+{
+        chunk_blocks *v = (chunk_blocks *)h;
 
-        pthread_rwlock_init(&c->rwlock, NULL);
-        pthread_rwlock_init(&c->rwlock_gl, NULL);
+        memfree((void **)&v);
+}
 
-        return 0;
+// Readers must be in epoch read section, writers hold chunk rwlock
+static inline chunk_blocks *chunk_blocks_get(chunk *c)
+{
+        return atomic_load(&c->blocks);
 }
 
-int chunk_deinit(chunk *c)
+static inline size_t chunk_blocks_count(chunk_blocks *v)
 {
-        linklist_node *pos;
+        if (!v)
+                return 0;
 
-        if (!c)
-                return -EINVAL;
+        return atomic_load_explicit(&v->count, memory_order_acquire);
+}
 
-        pthread_rwlock_wrlock(&c->rwlock);
-        pthread_rwlock_wrlock(&c->rwlock_gl);
+static inline block *chunk_blocks_find(chunk_blocks *v, ivec3 origin_b)
+{
+        size_t count = chunk_blocks_count(v);
 
-        linklist_for_each_node(pos, c->blocks->head) {
-                block_deinit(pos->data);
+        for (size_t i = 0; i < count; ++i) {
+                if (ivec3_equal(v->blocks[i].origin_l, origin_b))
+                        return &v->blocks[i];
         }
 
-        gl_attr_buffer_delete(&c->glattr);
+        return NULL;
+}
 
-        if (!gl_vbo_is_empty(&c->glvbo)) {
-                gl_vbo_deinit(&c->glvbo);
-        }
+/**
+ * chunk_blocks_publish() - replace blocks version of chunk
+ *
+ * Old version is freed once readers which may walk it are gone.
+ *
+ * @param c: pointer to chunk, write locked
+ * @param v: new version
+ */
+static void chunk_blocks_publish(chunk *c, chunk_blocks *v)
+{
+        chunk_blocks *old = atomic_exchange(&c->blocks, v);
 
-        linklist_deinit(c->blocks);
-        linklist_free(&c->blocks);
+        if (old)
+                epoch_retire(&old->retire, chunk_blocks_free);
+}
 
-        seqlist_deinit(c->vertices);
-        seqlist_free(&c->vertices);
+/**
+ * chunk_blocks_reserve() - make room to append blocks in place
+ *
+ * @param c: pointer to chunk, write locked
+ * @param extra: blocks going to be appended
+ * @return current version with enough capacity, NULL on failure
+ */
+static chunk_blocks *chunk_blocks_reserve(chunk *c, size_t extra)
+{
+        chunk_blocks *old = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(old);
+        size_t capacity = CHUNK_BLOCKS_MIN;
+        chunk_blocks *v;
 
-        c->state = CHUNK_DEINITED;
+        if (old && count + extra <= old->capacity)
+                return old;
 
-        pthread_rwlock_unlock(&c->rwlock_gl);
-        pthread_rwlock_unlock(&c->rwlock);
+        if (old && old->capacity > capacity)
+                capacity = old->capacity * 2;
 
-        pthread_rwlock_destroy(&c->rwlock);
-        pthread_rwlock_destroy(&c->rwlock_gl);
+        while (capacity < count + extra)
+                capacity *= 2;
 
-        memzero(c, sizeof(chunk));
+        v = chunk_blocks_alloc(capacity);
+        if (!v)
+                return NULL;
 
-        return 0;
+        if (count)
+                memcpy(v->blocks, old->blocks, sizeof(block) * count);
+
+        atomic_store_explicit(&v->count, count, memory_order_relaxed);
+
+        chunk_blocks_publish(c, v);
+
+        return v;
 }
 
-int chunk_is_empty(chunk *c)
+// Slot past count is invisible to readers until count is bumped
+static inline block *chunk_blocks_append(chunk_blocks *v, block *b)
 {
-        if (!c)
-                return 1;
+        size_t count = atomic_load_explicit(&v->count, memory_order_relaxed);
 
-        if (linklist_is_empty(c->blocks))
-                return 1;
+        memcpy(&v->blocks[count], b, sizeof(block));
+        atomic_store_explicit(&v->count, count + 1, memory_order_release);
 
-        return 0;
+        return &v->blocks[count];
 }
 
-static inline int chunk_state_get(chunk *c, int wait)
+/**
+ * chunk_blocks_remove() - publish copy without blocks inside a box
+ *
+ * @param c: pointer to chunk, write locked
+ * @param min: box min corner, inclusive
+ * @param max: box max corner, inclusive
+ * @return removed blocks count, negative on error
+ */
+static int chunk_blocks_remove(chunk *c, ivec3 min, ivec3 max)
 {
-        int state = CHUNK_UNKNOWN;
+        chunk_blocks *old = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(old);
+        size_t kept = 0;
+        chunk_blocks *v;
 
-        if (!c)
-                return state;
+        if (!count)
+                return 0;
 
-        if (wait == L_WAIT) {
-                pthread_rwlock_rdlock(&c->rwlock);
-        } else {
-                if (pthread_rwlock_tryrdlock(&c->rwlock))
-                        return state;
+        v = chunk_blocks_alloc(old->capacity);
+        if (!v)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < count; ++i) {
+                block *b = &old->blocks[i];
+                int inside = 1;
+
+                for (int k = 0; k < NR_VEC3_ATTR; ++k) {
+                        if (b->origin_l[k] < min[k] || b->origin_l[k] > max[k])
+                                inside = 0;
+                }
+
+                if (!inside)
+                        memcpy(&v->blocks[kept++], b, sizeof(block));
         }
 
-        state = c->state;
+        if (kept == count) {
+                chunk_blocks_free(&v->retire);
+                return 0;
+        }
 
-        pthread_rwlock_unlock(&c->rwlock);
+        atomic_store_explicit(&v->count, kept, memory_order_relaxed);
+
+        chunk_blocks_publish(c, v);
 
-        return state;
+        return (int)(count - kept);
 }
 
-static inline int chunk_state_ready(chunk *c, int lock)
-{
-        chunk_state ready[] = {
-                CHUNK_INITED,
-                CHUNK_FLUSHED,
-                CHUNK_NEED_FLUSH,
-        };
+/**
+ * Chunk State
+ *
+ * State moves only by compare-and-swap along chunk_state_next[], so it
+ * is checked and changed without chunk lock. Waiters sleep on a wait
+ * queue hashed by chunk address.
+ */
 
-        int ret = 0;
+#define S(s)    CHUNK_STATE_BIT(CHUNK_##s)
+
+static const uint32_t chunk_state_next[NR_CHUNK_STATES] = {
+        [CHUNK_UNKNOWN]         = S(INITED),
+        [CHUNK_INITED]          = S(NEED_UPDATE) | S(DEINITED),
+        [CHUNK_DEINITED]        = 0,
+        [CHUNK_UPDATING]        = S(NEED_FLUSH) | S(NEED_UPDATE),
+        [CHUNK_FLUSHED]         = S(NEED_UPDATE) | S(DEINITED),
+        [CHUNK_FLUSHING]        = S(FLUSHED) | S(NEED_FLUSH) | S(NEED_UPDATE),
+        [CHUNK_NEED_FLUSH]      = S(FLUSHING) | S(NEED_UPDATE) | S(DEINITED),
+        [CHUNK_NEED_UPDATE]     = S(SCHED_UPDATE) | S(UPDATING) | S(DEINITED),
+        [CHUNK_SCHED_UPDATE]    = S(UPDATING) | S(NEED_UPDATE) | S(DEINITED),
+};
 
-        if (!c)
-                return ret;
+// Blocks were read already or not at all, chunk needs another rebuild
+static const uint32_t chunk_states_stale = S(INITED) | S(UPDATING) | S(FLUSHED) |
+                                           S(FLUSHING) | S(NEED_FLUSH);
 
-        if (lock)
-             pthread_rwlock_rdlock(&c->rwlock);
+// No thread is working on chunk
+static const uint32_t chunk_states_idle = S(INITED) | S(FLUSHED) | S(NEED_FLUSH) |
+                                          S(NEED_UPDATE) | S(SCHED_UPDATE);
 
-        for (uint32_t i = 0; i < ARRAY_SIZE(ready); ++i) {
-                if (c->state == ready[i]) {
-                        ret = 1;
-                        break;
-                }
+#undef S
+
+typedef struct chunk_state_waitq {
+        atomic_int              waiters;
+        pthread_mutex_t         lock;
+        pthread_cond_t          cond;
+} chunk_state_waitq;
+
+static chunk_state_waitq chunk_state_waitqs[CHUNK_STATE_WAITQ_BUCKETS];
+static pthread_once_t chunk_state_waitq_once = PTHREAD_ONCE_INIT;
+
+static void chunk_state_waitq_init(void)
+{
+        for (int i = 0; i < CHUNK_STATE_WAITQ_BUCKETS; ++i) {
+                pthread_mutex_init(&chunk_state_waitqs[i].lock, NULL);
+                pthread_cond_init(&chunk_state_waitqs[i].cond, NULL);
         }
+}
 
-        if (lock)
-                pthread_rwlock_unlock(&c->rwlock);
+static chunk_state_waitq *chunk_state_waitq_get(chunk *c)
+{
+        uintptr_t h = (uintptr_t)c;
 
-        return ret;
+        pthread_once(&chunk_state_waitq_once, chunk_state_waitq_init);
+
+        // Chunks are large, low bits hardly differ
+        h = (h >> 6) ^ (h >> 14);
+
+        return &chunk_state_waitqs[h & (CHUNK_STATE_WAITQ_BUCKETS - 1)];
 }
 
-static inline linklist_node *chunk_get_block_node(chunk *c, ivec3 origin_b)
+static inline chunk_state chunk_state_get(chunk *c)
 {
-        linklist_node *pos;
-        linklist_node *ret = NULL;
+        return atomic_load_explicit(&c->state, memory_order_acquire);
+}
 
-        if (!c)
-                return ret;
+/**
+ * chunk_state_cas() - move chunk from one state to another
+ *
+ * @param c: pointer to chunk
+ * @param from: expected state
+ * @param to: new state, must be allowed by chunk_state_next[]
+ * @return 1 if moved, 0 if chunk was not in state from
+ */
+static int chunk_state_cas(chunk *c, chunk_state from, chunk_state to)
+{
+        chunk_state_waitq *wq;
+        int expect = from;
+
+        if (!(chunk_state_next[from] & CHUNK_STATE_BIT(to))) {
+                pr_err_func("invalid chunk state transition %d -> %d\n", from, to);
+                return 0;
+        }
 
-        linklist_for_each_node(pos, c->blocks->head) {
-                block *b = pos->data;
+        if (!atomic_compare_exchange_strong(&c->state, &expect, to))
+                return 0;
 
-                if (ivec3_equal(b->origin_l, origin_b)) {
-                        ret = pos;
-                        break;
-                }
+        // Pairs with waiter count taken before it checks state
+        wq = chunk_state_waitq_get(c);
+        if (atomic_load(&wq->waiters)) {
+                pthread_mutex_lock(&wq->lock);
+                pthread_cond_broadcast(&wq->cond);
+                pthread_mutex_unlock(&wq->lock);
         }
 
-        return ret;
+        return 1;
 }
 
-static inline block *__chunk_get_block(chunk *c, ivec3 origin_block)
+/**
+ * chunk_state_move() - move chunk to state from any state of a set
+ *
+ * @param c: pointer to chunk
+ * @param from: CHUNK_STATE_BIT() mask of expected states
+ * @param to: new state
+ * @return 1 if moved, 0 if chunk was in none of states from
+ */
+static int chunk_state_move(chunk *c, uint32_t from, chunk_state to)
 {
-        linklist_node *node;
-        block *ret = NULL;
+        chunk_state cur = chunk_state_get(c);
 
-        if (linklist_is_empty(c->blocks))
-                return ret;
+        while (from & CHUNK_STATE_BIT(cur)) {
+                if (chunk_state_cas(c, cur, to))
+                        return 1;
 
-        node = chunk_get_block_node(c, origin_block);
-        if (node)
-                ret = node->data;
+                cur = chunk_state_get(c);
+        }
 
-        return ret;
+        return 0;
 }
 
-block *chunk_get_block(chunk *c, ivec3 origin_block, int wait)
+/**
+ * chunk_state_wait() - sleep until chunk is in any state of a set
+ *
+ * @param c: pointer to chunk
+ * @param mask: CHUNK_STATE_BIT() mask of states to wait for
+ * @return state chunk was seen in
+ */
+static chunk_state chunk_state_wait(chunk *c, uint32_t mask)
 {
-        block *ret = NULL;
+        chunk_state_waitq *wq;
+        chunk_state cur;
 
-        if (wait == L_WAIT) {
-                pthread_rwlock_rdlock(&c->rwlock);
-        } else {
-                if (pthread_rwlock_tryrdlock(&c->rwlock))
-                        return ret;
-        }
+        cur = chunk_state_get(c);
+        if (mask & CHUNK_STATE_BIT(cur))
+                return cur;
+
+        wq = chunk_state_waitq_get(c);
+
+        atomic_fetch_add(&wq->waiters, 1);
+        pthread_mutex_lock(&wq->lock);
+
+        while (!(mask & CHUNK_STATE_BIT(cur = atomic_load(&c->state))))
+                pthread_cond_wait(&wq->cond, &wq->lock);
+
+        pthread_mutex_unlock(&wq->lock);
+        atomic_fetch_sub(&wq->waiters, 1);
+
+        return cur;
+}
+
+/**
+ * chunk_state_mark() - chunk blocks changed, it needs a rebuild
+ *
+ * Bumps content generation, so rebuild in flight gives up. Scheduled
+ * rebuild has not read blocks yet, it is left as it is.
+ *
+ * @param c: pointer to chunk
+ * @return 1 if chunk needs to be queued
+ */
+static int chunk_state_mark(chunk *c)
+{
+        atomic_fetch_add(&c->gen, 1);
+
+        if (chunk_state_get(c) == CHUNK_NEED_UPDATE)
+                return 1;
+
+        return chunk_state_move(c, chunk_states_stale, CHUNK_NEED_UPDATE);
+}
+
+int chunk_init(chunk *c, ivec3 origin_chunk)
+{
+        if (!c)
+                return -EINVAL;
+
+        memzero(c, sizeof(chunk));
+
+        memcpy(c->origin_l, origin_chunk, sizeof(ivec3));
+
+        atomic_init(&c->blocks, NULL);
+        atomic_init(&c->mesh_pending, NULL);
+        atomic_init(&c->mesh_upload, NULL);
+        atomic_init(&c->state, CHUNK_INITED);
+        atomic_init(&c->gen, 0);
+        atomic_init(&c->mesh_pending_gen, 0);
+        atomic_init(&c->links_pending, CHUNK_LINKS_ALL);
+        atomic_init(&c->ready_time, 0.0);
+        c->links = CHUNK_LINKS_ALL;
+
+        pthread_rwlock_init(&c->rwlock, NULL);
+        pthread_rwlock_init(&c->rwlock_gl, NULL);
+
+        return 0;
+}
+
+/**
+ * chunk_deinit() - free chunk, no reader may access it any more
+ */
+int chunk_deinit(chunk *c)
+{
+        chunk_blocks *v;
+
+        if (!c)
+                return -EINVAL;
+
+        // Rebuild or flush still running must finish first
+        while (!chunk_state_move(c, chunk_states_idle, CHUNK_DEINITED))
+                chunk_state_wait(c, chunk_states_idle);
+
+        pthread_rwlock_wrlock(&c->rwlock);
+        pthread_rwlock_wrlock(&c->rwlock_gl);
 
-        ret = __chunk_get_block(c, origin_block);
+        v = atomic_exchange(&c->blocks, NULL);
+        if (v)
+                chunk_blocks_free(&v->retire);
 
+        pthread_rwlock_unlock(&c->rwlock_gl);
         pthread_rwlock_unlock(&c->rwlock);
 
+        pthread_rwlock_destroy(&c->rwlock);
+        pthread_rwlock_destroy(&c->rwlock_gl);
+
+        memzero(c, sizeof(chunk));
+
+        return 0;
+}
+
+int chunk_is_empty(chunk *c)
+{
+        size_t count;
+
+        if (!c)
+                return 1;
+
+        epoch_read_lock();
+        count = chunk_blocks_count(chunk_blocks_get(c));
+        epoch_read_unlock();
+
+        return count == 0;
+}
+
+/**
+ * chunk_get_block() - look up block without lock
+ *
+ * Lookup never waits for writers. Returned block stays valid only while
+ * caller holds its own epoch_read_lock() section.
+ *
+ * @param c: pointer to chunk
+ * @param origin_block: block origin
+ * @return pointer to block, NULL if not found
+ */
+block *chunk_get_block(chunk *c, ivec3 origin_block)
+{
+        block *ret;
+
+        if (!c)
+                return NULL;
+
+        epoch_read_lock();
+        ret = chunk_blocks_find(chunk_blocks_get(c), origin_block);
+        epoch_read_unlock();
+
         return ret;
 }
 
 block *chunk_add_block(chunk *c, block *b)
 {
-        block *ret;
+        chunk_blocks *v;
+        block *ret = NULL;
 
         if (!c)
                 return NULL;
 
         pthread_rwlock_wrlock(&c->rwlock);
 
-        ret = linklist_append(c->blocks, b);
-        if (ret == NULL)
-                pr_err_func("linklist_append() failed\n");
-        else
-                c->state = CHUNK_NEED_UPDATE;
+        v = chunk_blocks_reserve(c, 1);
+        if (v == NULL) {
+                pr_err_func("chunk_blocks_reserve() failed\n");
+        } else {
+                ret = chunk_blocks_append(v, b);
+        }
 
         pthread_rwlock_unlock(&c->rwlock);
 
@@ -339,7 +598,6 @@ block *chunk_add_block(chunk *c, block *b)
  */
 int chunk_del_block(chunk *c, ivec3 origin_block)
 {
-        linklist_node *node;
         int ret = 0;
 
         if (!c)
@@ -347,8 +605,11 @@ int chunk_del_block(chunk *c, ivec3 origin_block)
 
         pthread_rwlock_wrlock(&c->rwlock);
 
-        node = chunk_get_block_node(c, origin_block);
-        if (node == NULL) {
+        ret = chunk_blocks_remove(c, origin_block, origin_block);
+        if (ret < 0)
+                goto out;
+
+        if (ret == 0) {
                 pr_err_func("block (%d, %d, %d) not found in chunk (%d, %d, %d)\n",
                             origin_block[X], origin_block[Y], origin_block[Z],
                             c->origin_l[X], c->origin_l[Y], c->origin_l[Z]);
@@ -356,10 +617,7 @@ int chunk_del_block(chunk *c, ivec3 origin_block)
                 goto out;
         }
 
-        block_deinit(node->data);
-        linklist_delete(c->blocks, node);
-
-        c->state = CHUNK_NEED_UPDATE;
+        ret = 0;
 
 out:
         pthread_rwlock_unlock(&c->rwlock);
@@ -402,11 +660,10 @@ out:
         return ret;
 }
 
-static inline block *__world_get_block(world *w, ivec3 origin_block, int wait, int nolock)
+static inline block *__world_get_block(world *w, ivec3 origin_block)
 {
         ivec3 origin_chunk = { 0 };
         chunk *c;
-        block *b;
 
         if (!w)
                 return NULL;
@@ -420,28 +677,103 @@ static inline block *__world_get_block(world *w, ivec3 origin_block, int wait, i
         if (!c)
                 return NULL;
 
-        if (nolock)
-                b = __chunk_get_block(c, origin_block);
-        else
-                b = chunk_get_block(c, origin_block, wait);
+        return chunk_blocks_find(chunk_blocks_get(c), origin_block);
+}
+
+/**
+ * world_get_block() - look up block without lock
+ *
+ * Returned block stays valid only while caller holds its own
+ * epoch_read_lock() section, callers only testing existence need none.
+ *
+ * @param w: pointer to world
+ * @param origin_block: block origin
+ * @return pointer to block, NULL if not found
+ */
+block *world_get_block(world *w, ivec3 origin_block)
+{
+        block *ret;
+
+        epoch_read_lock();
+        ret = __world_get_block(w, origin_block);
+        epoch_read_unlock();
+
+        return ret;
+}
+
+/**
+ * world_queue_push() - queue chunk once on given world queue
+ *
+ * Lock-free push onto world stack, safe from any thread. Queued bit
+ * dedups chunks already waiting, link is only written by its winner.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param q: queue index
+ * @return 1 if queued now, 0 if it was waiting already
+ */
+static inline int world_queue_push(world *w, chunk *c, chunk_queue_idx q)
+{
+        chunk *head;
+
+        if (atomic_exchange_explicit(&c->queued[q], 1, memory_order_acq_rel))
+                return 0;
+
+        head = atomic_load_explicit(&w->queues[q], memory_order_relaxed);
+        do {
+                c->queue_next[q] = head;
+        } while (!atomic_compare_exchange_weak_explicit(&w->queues[q], &head, c,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
 
-        return b;
+        return 1;
 }
 
-block *world_get_block(world *w, ivec3 origin_block, int wait)
+/**
+ * world_queue_take() - detach all chunks of given world queue
+ *
+ * Whole stack is taken at once, so there is no ABA on pop. Queued bit
+ * is cleared per chunk by consumer once its link was read.
+ *
+ * @param w: pointer to world
+ * @param q: queue index
+ * @return list linked by queue_next[q], NULL if empty
+ */
+static inline chunk *world_queue_take(world *w, chunk_queue_idx q)
 {
-        return __world_get_block(w, origin_block, wait, 0);
+        return atomic_exchange_explicit(&w->queues[q], NULL, memory_order_acquire);
 }
 
-static inline void chunk_mark_update(chunk *c)
+/**
+ * world_upload_kick() - queue chunk for upload thread and wake it up
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk, mesh left in c->mesh_upload
+ */
+static inline void world_upload_kick(world *w, chunk *c)
 {
-        pthread_rwlock_wrlock(&c->rwlock);
+        if (!world_queue_push(w, c, CHUNK_QUEUE_UPLOAD))
+                return;
 
-        // FIXME: This is not good, we should implement a queue
-        if (c->state != CHUNK_SCHED_UPDATE)
-                c->state = CHUNK_NEED_UPDATE;
+        // Upload thread checks queue under lock, signal can not be lost
+        pthread_mutex_lock(&w->upload_mutex);
+        pthread_cond_signal(&w->upload_cond);
+        pthread_mutex_unlock(&w->upload_mutex);
+}
 
-        pthread_rwlock_unlock(&c->rwlock);
+/**
+ * world_chunk_mark_update() - mark chunk dirty and queue it for rebuild
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ */
+void world_chunk_mark_update(world *w, chunk *c)
+{
+        if (!w || !c)
+                return;
+
+        if (chunk_state_mark(c))
+                world_queue_push(w, c, CHUNK_QUEUE_DIRTY);
 }
 
 void world_near_chunks_mark_update(world *w, ivec3 origin_b)
@@ -470,7 +802,7 @@ void world_near_chunks_mark_update(world *w, ivec3 origin_b)
                 if (!c)
                         continue;
 
-                chunk_mark_update(c);
+                world_chunk_mark_update(w, c);
         }
 }
 
@@ -494,7 +826,7 @@ int world_add_block(world *w, block *b, int update)
         if (c == NULL) {
                 c = world_add_chunk(w, origin_chunk);
         } else {
-                if (chunk_get_block(c, b->origin_l, L_WAIT)) {
+                if (chunk_get_block(c, b->origin_l)) {
                         pr_err_func("block (%d %d %d) already exists\n",
                                     b->origin_l[X],
                                     b->origin_l[Y],
@@ -508,14 +840,116 @@ int world_add_block(world *w, block *b, int update)
         if (update) {
                 world_near_chunks_mark_update(w, b->origin_l);
                 world_update_trigger(w);
+        } else {
+                world_chunk_mark_update(w, c);
         }
 
         return 0;
 }
 
-int world_del_block(world *w, ivec3 origin_block)
-{
-        ivec3 origin_chunk = { 0 };
+/**
+ * chunk_block_range() - blocks range of chunk along one axis
+ *
+ * Mirrors block_in_chunk(), which truncates toward zero, so chunk 0
+ * spans both sides of origin.
+ */
+static inline void chunk_block_range(int origin_c, int stride, int *lo, int *hi)
+{
+        if (origin_c > 0) {
+                *lo = origin_c * stride;
+                *hi = origin_c * stride + stride - 1;
+        } else if (origin_c < 0) {
+                *lo = origin_c * stride - stride + 1;
+                *hi = origin_c * stride;
+        } else {
+                *lo = -(stride - 1);
+                *hi = stride - 1;
+        }
+}
+
+/**
+ * chunk_fill_blocks() - fill or clear blocks of one chunk inside a box
+ *
+ * Only touches given chunk, so chunks can be filled concurrently. Does
+ * not queue chunk for rebuild.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param min: box min corner, inclusive
+ * @param max: box max corner, inclusive
+ * @param type: block type, BLOCK_AIR to delete blocks
+ * @return changed blocks count, negative on error
+ */
+int chunk_fill_blocks(world *w, chunk *c, ivec3 min, ivec3 max, block_attr_idx type)
+{
+        int stride;
+        block_attr *attr = NULL;
+        ivec3 lo, hi;
+        int changed = 0;
+
+        if (!w || !c)
+                return -EINVAL;
+
+        stride = w->chunk_length / (int)BLOCK_EDGE_LEN_GLUNIT;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                chunk_block_range(c->origin_l[i], stride, &lo[i], &hi[i]);
+
+                if (lo[i] < min[i])
+                        lo[i] = min[i];
+
+                if (hi[i] > max[i])
+                        hi[i] = max[i];
+
+                if (lo[i] > hi[i])
+                        return 0;
+        }
+
+        if (type != BLOCK_AIR)
+                attr = block_attr_get(type);
+
+        // Removal publishes one version, readers never see half a box
+        pthread_rwlock_wrlock(&c->rwlock);
+
+        if (!attr) {
+                changed = chunk_blocks_remove(c, lo, hi);
+                goto out;
+        }
+
+        for (int y = lo[Y]; y <= hi[Y]; ++y) {
+                for (int x = lo[X]; x <= hi[X]; ++x) {
+                        for (int z = lo[Z]; z <= hi[Z]; ++z) {
+                                ivec3 origin_b = { [X] = x, [Y] = y, [Z] = z };
+                                chunk_blocks *v;
+                                block b;
+
+                                if (chunk_blocks_find(chunk_blocks_get(c), origin_b))
+                                        continue;
+
+                                v = chunk_blocks_reserve(c, 1);
+                                if (!v) {
+                                        if (!changed)
+                                                changed = -ENOMEM;
+
+                                        goto out;
+                                }
+
+                                block_init(&b, attr, origin_b);
+                                chunk_blocks_append(v, &b);
+                                changed++;
+                        }
+                }
+        }
+
+out:
+        pthread_rwlock_unlock(&c->rwlock);
+
+        return changed;
+}
+
+int world_del_block(world *w, ivec3 origin_block)
+{
+        ivec3 origin_chunk = { 0 };
         chunk *c;
 
         if (!w)
@@ -537,446 +971,3274 @@ int world_del_block(world *w, ivec3 origin_block)
         return 0;
 }
 
-static inline void chunk_vertices_alloc(chunk *c)
+static inline void chunk_origin_gl_base(chunk *c, int chunk_length, vec3 base)
 {
-        seqlist_alloc(&c->vertices);
-        seqlist_init(c->vertices, sizeof(vertex_attr), 128);
+        base[X] = (float)(c->origin_l[X] * chunk_length);
+        base[Y] = (float)(c->origin_l[Y] * chunk_length);
+        base[Z] = (float)(c->origin_l[Z] * chunk_length);
 }
 
-static inline void chunk_vertices_free(chunk *c)
+/**
+ * chunk_mesh_key() - compute mesh content key of culled chunk
+ *
+ * Visible faces already encode neighbour borders, so key covers chunk
+ * block content plus whatever neighbours hide.
+ *
+ * @param c: pointer to chunk, locked
+ * @param chunk_length: chunk edge length
+ * @param key: output key
+ * @param face_count: output visible faces count of each face direction
+ */
+void chunk_mesh_key(chunk *c, int chunk_length, mesh_key *key,
+                    size_t face_count[NR_CUBE_FACES])
 {
-        seqlist_deinit(c->vertices);
-        seqlist_free(&c->vertices);
+        int stride = (chunk_length / BLOCK_EDGE_LEN_GLUNIT);
+        chunk_blocks *v = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(v);
+
+        memzero(key, sizeof(mesh_key));
+        memzero(face_count, sizeof(size_t) * NR_CUBE_FACES);
+
+        for (size_t n = 0; n < count; ++n) {
+                block *b = &v->blocks[n];
+                uint32_t face_mask = 0;
+                ivec3 origin_rel;
+
+                for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
+                        if (b->model.faces[i].visible) {
+                                face_mask |= (1U << i);
+                                face_count[i]++;
+                        }
+                }
+
+                origin_rel[X] = b->origin_l[X] - c->origin_l[X] * stride;
+                origin_rel[Y] = b->origin_l[Y] - c->origin_l[Y] * stride;
+                origin_rel[Z] = b->origin_l[Z] - c->origin_l[Z] * stride;
+
+                mesh_key_block_add(key, origin_rel, b->blk_attr, face_mask);
+        }
+
+        // Block range of chunk 0 and negative chunks is not 0..stride-1,
+        // coarser levels clamp cells to it, so it is part of content
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                int sign = (c->origin_l[i] > 0) - (c->origin_l[i] < 0);
+
+                key->range |= (uint32_t)(sign + 1) << (i * 2);
+        }
 }
 
-int chunk_vertices_pack(chunk *c)
+// Two triangles of a quad, in quad_corner order
+static const uint32_t quad_indices[VERTICES_TRIANGULATE_QUAD] = {
+        QUAD_UL, QUAD_UR, QUAD_LL, QUAD_UR, QUAD_LR, QUAD_LL,
+};
+
+/**
+ * chunk_mesh_build() - write chunk mesh straight in upload layout
+ *
+ * Visible faces are gathered into batch arrays in scratch arena, then
+ * corners of all faces are emitted by block_face_batch_generate() at
+ * once into mesh staging buffer, which is handed to GL as it is.
+ *
+ * Positions are relative to chunk origin, so identical chunks can share
+ * one mesh, chunk offset is applied in shader.
+ *
+ * Faces are grouped by direction, one contiguous index range per
+ * cube_face_idx, so a whole direction can be skipped when drawing.
+ *
+ * @param c: pointer to chunk, locked
+ * @param chunk_length: chunk edge length
+ * @param face_count: visible faces count of each direction
+ * @param scratch: scratch arena for batch arrays
+ * @param m: pointer to mesh to fill
+ * @return 0 on success
+ */
+static int chunk_mesh_build(chunk *c, int chunk_length,
+                            size_t face_count[NR_CUBE_FACES],
+                            mem_arena *scratch, chunk_mesh *m)
 {
-        linklist_node *pos;
+        size_t cursor[NR_CUBE_FACES];
+        size_t nr_faces = 0;
+        chunk_blocks *v = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(v);
+        uint32_t *indices;
+        vec4 *origins;
+        uint8_t *faces;
+        uint8_t *slots;
+        vec3 base;
+        int ret;
 
-        if (!c)
-                return 0;
+        for (int i = 0; i < NR_CUBE_FACES; ++i) {
+                cursor[i] = nr_faces;
+
+                m->face_first[i] = (GLsizei)(nr_faces * VERTICES_TRIANGULATE_QUAD);
+                m->face_count[i] = (GLsizei)(face_count[i] * VERTICES_TRIANGULATE_QUAD);
 
-        linklist_for_each_node(pos, c->blocks->head) {
-                block *b = pos->data;
+                nr_faces += face_count[i];
+        }
+
+        ret = gl_vbo_alloc(&m->glvbo, nr_faces * VERTICES_QUAD,
+                           nr_faces * VERTICES_TRIANGULATE_QUAD);
+        if (ret || !nr_faces)
+                return ret;
+
+        origins = mem_arena_alloc(scratch, sizeof(vec4) * nr_faces);
+        faces = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_faces);
+        slots = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_faces);
+        if (!origins || !faces || !slots)
+                return -ENOMEM;
+
+        chunk_origin_gl_base(c, chunk_length, base);
+
+        for (size_t k = 0; k < count; ++k) {
+                block *b = &v->blocks[k];
 
                 for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
-                        block_face *f = &(b->model.faces[i]);
+                        size_t n;
 
-                        if (!f->visible)
+                        if (!b->model.faces[i].visible)
                                 continue;
 
-                        for (int j = 0; j < VERTICES_TRIANGULATE_QUAD; ++j) {
-                                seqlist_append(c->vertices, &(f->vertices[j]));
+                        n = cursor[i]++;
+
+                        glm_vec_sub(b->model.origin_gl, base, origins[n]);
+                        origins[n][3] = 0.0f;
+                        faces[n] = (uint8_t)i;
+                        slots[n] = (uint8_t)b->blk_attr->idx;
+                }
+        }
+
+        block_face_batch_generate(gl_vbo_vertices(&m->glvbo), origins,
+                                  faces, slots, nr_faces);
+
+        indices = gl_vbo_indices(&m->glvbo);
+
+        for (size_t n = 0; n < nr_faces; ++n) {
+                uint32_t *idx = &indices[n * VERTICES_TRIANGULATE_QUAD];
+
+                for (int k = 0; k < VERTICES_TRIANGULATE_QUAD; ++k)
+                        idx[k] = (uint32_t)(n * VERTICES_QUAD) + quad_indices[k];
+        }
+
+        gl_vbo_staged(&m->glvbo);
+
+        return 0;
+}
+
+/**
+ * chunk_lod_cell_face() - check face of downsampled cell is drawn
+ *
+ * Faces toward an empty cell are drawn. Faces on chunk border are drawn
+ * for every surface cell whatever the neighbour holds, these skirts hide
+ * cracks against a neighbour meshed at another level.
+ */
+static inline int chunk_lod_cell_face(const uint8_t *cells, const uint8_t *surface,
+                                      const int dim[NR_VEC3_ATTR],
+                                      const int p[NR_VEC3_ATTR], int f)
+{
+        int q[NR_VEC3_ATTR];
+
+        for (int k = 0; k < NR_VEC3_ATTR; ++k) {
+                q[k] = p[k] + block_normals[f][k];
+
+                if (q[k] < 0 || q[k] >= dim[k])
+                        return surface[(p[Y] * dim[Z] + p[Z]) * dim[X] + p[X]];
+        }
+
+        return !cells[(q[Y] * dim[Z] + q[Z]) * dim[X] + q[X]];
+}
+
+static inline int chunk_lod_cell_idx(int offset, int cell)
+{
+        // Floor division, chunk 0 and negative chunks hold negative offsets
+        return offset >= 0 ? offset / cell : -((-offset + cell - 1) / cell);
+}
+
+/**
+ * chunk_mesh_lod_build() - mesh chunk downsampled by 2^level
+ *
+ * Each cell of 2^level blocks per edge is solid if any block in it is,
+ * and takes type of its highest block, so surface keeps its look. Cells
+ * are aligned on chunk origin like mesh key offsets, so chunks sharing a
+ * key share levels too. Cells never exceed chunk range, chunk 0 and
+ * negative chunks just get thinner border cells.
+ *
+ * @param c: pointer to chunk, locked and culled
+ * @param chunk_length: chunk edge length
+ * @param level: level, 1 for 2x2x2 blocks per cell
+ * @param scratch: scratch arena for grid and batch arrays
+ * @param m: pointer to mesh to fill
+ * @return 0 on success
+ */
+static int chunk_mesh_lod_build(chunk *c, int chunk_length, int level,
+                                mem_arena *scratch, chunk_mesh *m)
+{
+        int stride = chunk_length / (int)BLOCK_EDGE_LEN_GLUNIT;
+        int lo[NR_VEC3_ATTR], hi[NR_VEC3_ATTR], dim[NR_VEC3_ATTR];
+        int first[NR_VEC3_ATTR], base_l[NR_VEC3_ATTR];
+        chunk_blocks *v = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(v);
+        size_t face_count[NR_CUBE_FACES] = { 0 };
+        size_t cursor[NR_CUBE_FACES];
+        size_t nr_cells, nr_faces = 0;
+        int cell = 1 << level;
+        vertex_attr *vertices;
+        uint32_t *indices;
+        uint8_t *cells, *surface;
+        int *tops;
+        vec4 *origins, *extents;
+        uint8_t *faces, *slots;
+        vec3 base;
+        int ret;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                chunk_block_range(c->origin_l[i], stride, &lo[i], &hi[i]);
+
+                base_l[i] = c->origin_l[i] * stride;
+                first[i] = chunk_lod_cell_idx(lo[i] - base_l[i], cell);
+                dim[i] = chunk_lod_cell_idx(hi[i] - base_l[i], cell) - first[i] + 1;
+        }
+
+        nr_cells = (size_t)dim[X] * (size_t)dim[Y] * (size_t)dim[Z];
+
+        cells = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_cells);
+        surface = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_cells);
+        tops = mem_arena_alloc(scratch, sizeof(int) * nr_cells);
+        if (!cells || !surface || !tops)
+                return -ENOMEM;
+
+        memzero(cells, sizeof(uint8_t) * nr_cells);
+        memzero(surface, sizeof(uint8_t) * nr_cells);
+
+        for (size_t n = 0; n < count; ++n) {
+                block *b = &v->blocks[n];
+                int p[NR_VEC3_ATTR];
+                size_t k;
+
+                if (!b->blk_attr->visible)
+                        continue;
+
+                for (int i = 0; i < NR_VEC3_ATTR; ++i)
+                        p[i] = chunk_lod_cell_idx(b->origin_l[i] - base_l[i], cell) - first[i];
+
+                k = ((size_t)p[Y] * dim[Z] + p[Z]) * dim[X] + p[X];
+
+                // Block type 0 is air, so 0 stays empty cell
+                if (!cells[k] || b->origin_l[Y] > tops[k]) {
+                        cells[k] = (uint8_t)b->blk_attr->idx;
+                        tops[k] = b->origin_l[Y];
+                }
+
+                for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
+                        if (b->model.faces[i].visible)
+                                surface[k] = 1;
+                }
+        }
+
+        for (int y = 0; y < dim[Y]; ++y) {
+                for (int z = 0; z < dim[Z]; ++z) {
+                        for (int x = 0; x < dim[X]; ++x) {
+                                int p[NR_VEC3_ATTR] = { x, y, z };
+
+                                if (!cells[((size_t)y * dim[Z] + z) * dim[X] + x])
+                                        continue;
+
+                                for (int i = 0; i < CUBE_QUAD_FACES; ++i)
+                                        face_count[i] += chunk_lod_cell_face(cells, surface,
+                                                                             dim, p, i);
+                        }
+                }
+        }
+
+        for (int i = 0; i < NR_CUBE_FACES; ++i) {
+                cursor[i] = nr_faces;
+
+                m->face_first[i] = (GLsizei)(nr_faces * VERTICES_TRIANGULATE_QUAD);
+                m->face_count[i] = (GLsizei)(face_count[i] * VERTICES_TRIANGULATE_QUAD);
+
+                nr_faces += face_count[i];
+        }
+
+        ret = gl_vbo_alloc(&m->glvbo, nr_faces * VERTICES_QUAD,
+                           nr_faces * VERTICES_TRIANGULATE_QUAD);
+        if (ret || !nr_faces)
+                return ret;
+
+        origins = mem_arena_alloc(scratch, sizeof(vec4) * nr_faces);
+        extents = mem_arena_alloc(scratch, sizeof(vec4) * nr_faces);
+        faces = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_faces);
+        slots = mem_arena_alloc(scratch, sizeof(uint8_t) * nr_faces);
+        if (!origins || !extents || !faces || !slots)
+                return -ENOMEM;
+
+        chunk_origin_gl_base(c, chunk_length, base);
+
+        for (int y = 0; y < dim[Y]; ++y) {
+                for (int z = 0; z < dim[Z]; ++z) {
+                        for (int x = 0; x < dim[X]; ++x) {
+                                int p[NR_VEC3_ATTR] = { x, y, z };
+                                size_t k = ((size_t)y * dim[Z] + z) * dim[X] + x;
+
+                                if (!cells[k])
+                                        continue;
+
+                                for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
+                                        size_t n;
+
+                                        if (!chunk_lod_cell_face(cells, surface, dim, p, i))
+                                                continue;
+
+                                        n = cursor[i]++;
+
+                                        for (int j = 0; j < NR_VEC3_ATTR; ++j) {
+                                                int a = base_l[j] + (first[j] + p[j]) * cell;
+                                                int e = a + cell - 1;
+
+                                                if (a < lo[j])
+                                                        a = lo[j];
+
+                                                if (e > hi[j])
+                                                        e = hi[j];
+
+                                                // Cell spans blocks a..e inclusive
+                                                origins[n][j] = (float)(a + e + 1) / 2.0f *
+                                                                BLOCK_EDGE_LEN_GLUNIT - base[j];
+                                                extents[n][j] = (float)(e - a + 1);
+                                        }
+
+                                        origins[n][3] = 0.0f;
+                                        faces[n] = (uint8_t)i;
+                                        slots[n] = cells[k];
+                                }
                         }
                 }
         }
 
-        seqlist_shrink(c->vertices);
+        vertices = gl_vbo_vertices(&m->glvbo);
+
+        for (size_t n = 0; n < nr_faces; ++n) {
+                vec4 zero = { 0.0f };
+
+                // Unit block corners around origin, scaled to cell size
+                block_face_batch_generate(&vertices[n * VERTICES_QUAD], &zero,
+                                          &faces[n], &slots[n], 1);
+
+                for (int k = 0; k < VERTICES_QUAD; ++k) {
+                        float *pos = vertices[n * VERTICES_QUAD + k].position;
+
+                        for (int j = 0; j < NR_VEC3_ATTR; ++j)
+                                pos[j] = origins[n][j] + pos[j] * extents[n][j];
+                }
+        }
+
+        indices = gl_vbo_indices(&m->glvbo);
+
+        for (size_t n = 0; n < nr_faces; ++n) {
+                uint32_t *idx = &indices[n * VERTICES_TRIANGULATE_QUAD];
+
+                for (int k = 0; k < VERTICES_TRIANGULATE_QUAD; ++k)
+                        idx[k] = (uint32_t)(n * VERTICES_QUAD) + quad_indices[k];
+        }
+
+        gl_vbo_staged(&m->glvbo);
 
         return 0;
 }
 
-int chunk_update(chunk *c)
+/**
+ * chunk_mesh_lods_build() - build coarser levels of freshly built mesh
+ *
+ * A level failing to build is left out, drawing falls back to finer one.
+ *
+ * @param c: pointer to chunk, locked and culled
+ * @param chunk_length: chunk edge length
+ * @param scratch: scratch arena
+ * @param m: pointer to full resolution mesh
+ */
+static void chunk_mesh_lods_build(chunk *c, int chunk_length, mem_arena *scratch,
+                                  chunk_mesh *m)
+{
+        for (int i = 0; i < MESH_LODS - 1; ++i) {
+                chunk_mesh *lod = chunk_mesh_alloc(NULL);
+
+                if (!lod)
+                        return;
+
+                if (chunk_mesh_lod_build(c, chunk_length, i + 1, scratch, lod)) {
+                        chunk_mesh_free(&lod);
+                        return;
+                }
+
+                m->lods[i] = lod;
+        }
+}
+
+/**
+ * chunk_links_compute() - find chunk faces which see each other through air
+ *
+ * Air cells are flood filled, each air region links all chunk faces it
+ * touches. Cave culling only walks from one chunk to the next across
+ * linked faces.
+ *
+ * @param c: pointer to chunk, locked
+ * @param chunk_length: chunk edge length
+ * @param scratch: scratch arena for fill
+ * @return CHUNK_LINK() bits, CHUNK_LINKS_ALL if out of memory
+ */
+static uint64_t chunk_links_compute(chunk *c, int chunk_length, mem_arena *scratch)
 {
-        if (!c)
+        int stride = chunk_length / (int)BLOCK_EDGE_LEN_GLUNIT;
+        int lo[NR_VEC3_ATTR], dim[NR_VEC3_ATTR];
+        chunk_blocks *v = chunk_blocks_get(c);
+        size_t count = chunk_blocks_count(v);
+        uint64_t links = 0;
+        uint32_t *stack;
+        uint8_t *seen;
+        size_t cells;
+
+        if (!count)
+                return CHUNK_LINKS_ALL;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                int hi;
+
+                chunk_block_range(c->origin_l[i], stride, &lo[i], &hi);
+                dim[i] = hi - lo[i] + 1;
+        }
+
+        cells = (size_t)dim[X] * (size_t)dim[Y] * (size_t)dim[Z];
+
+        seen = mem_arena_alloc(scratch, cells);
+        stack = mem_arena_alloc(scratch, sizeof(uint32_t) * cells);
+        if (!seen || !stack)
+                return CHUNK_LINKS_ALL;
+
+        memzero(seen, cells);
+
+        // Blocks are solid, never filled
+        for (size_t n = 0; n < count; ++n) {
+                int *o = v->blocks[n].origin_l;
+
+                seen[(o[X] - lo[X]) + dim[X] * ((o[Y] - lo[Y]) + dim[Y] * (o[Z] - lo[Z]))] = 1;
+        }
+
+        for (size_t s = 0; s < cells; ++s) {
+                uint32_t faces = 0;
+                size_t top = 0;
+
+                if (seen[s])
+                        continue;
+
+                seen[s] = 1;
+                stack[top++] = (uint32_t)s;
+
+                while (top) {
+                        uint32_t i = stack[--top];
+                        int p[NR_VEC3_ATTR] = {
+                                (int)(i % (uint32_t)dim[X]),
+                                (int)(i / (uint32_t)dim[X] % (uint32_t)dim[Y]),
+                                (int)(i / (uint32_t)(dim[X] * dim[Y])),
+                        };
+
+                        for (int f = 0; f < NR_CUBE_FACES; ++f) {
+                                int q[NR_VEC3_ATTR];
+                                int out = 0;
+                                size_t j;
+
+                                for (int k = 0; k < NR_VEC3_ATTR; ++k) {
+                                        q[k] = p[k] + block_normals[f][k];
+                                        out |= q[k] < 0 || q[k] >= dim[k];
+                                }
+
+                                // Region reaches chunk face f
+                                if (out) {
+                                        faces |= 1U << f;
+                                        continue;
+                                }
+
+                                j = (size_t)q[X] + (size_t)dim[X] *
+                                    ((size_t)q[Y] + (size_t)dim[Y] * (size_t)q[Z]);
+                                if (seen[j])
+                                        continue;
+
+                                seen[j] = 1;
+                                stack[top++] = (uint32_t)j;
+                        }
+                }
+
+                for (int a = 0; a < NR_CUBE_FACES; ++a) {
+                        if (!(faces & (1U << a)))
+                                continue;
+
+                        for (int b = 0; b < NR_CUBE_FACES; ++b) {
+                                if (faces & (1U << b))
+                                        links |= CHUNK_LINK(a, b);
+                        }
+                }
+        }
+
+        return links;
+}
+
+/**
+ * chunk_rebuild_stale() - chunk was marked since its rebuild started
+ *
+ * Marker has queued chunk again, so rebuild in flight can just stop.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk, rebuild running
+ * @return 1 if rebuild should be aborted
+ */
+static inline int chunk_rebuild_stale(world *w, chunk *c)
+{
+        if (atomic_load_explicit(&c->gen, memory_order_relaxed) == c->build_gen)
+                return 0;
+
+        atomic_fetch_add_explicit(&w->rebuilds_aborted, 1, memory_order_relaxed);
+
+        return 1;
+}
+
+static inline void chunk_mesh_pending_set(world *w, chunk *c, chunk_mesh *m)
+{
+        chunk_mesh *old = atomic_exchange(&c->mesh_pending, m);
+
+        // Result not flushed yet is outdated now
+        if (old)
+                mesh_cache_put(&w->meshes, old);
+}
+
+/**
+ * chunk_mesh_upload_set() - leave mesh to upload thread
+ *
+ * Upload thread holds own reference, render thread may drop pending
+ * result meanwhile. A newer mesh replaces one not taken yet.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param m: referenced mesh or NULL
+ */
+static inline void chunk_mesh_upload_set(world *w, chunk *c, chunk_mesh *m)
+{
+        chunk_mesh *old;
+
+        if (m)
+                mesh_cache_ref(&w->meshes, m);
+
+        old = atomic_exchange(&c->mesh_upload, m);
+        if (old)
+                mesh_cache_put(&w->meshes, old);
+}
+
+/**
+ * chunk_update() - mesh culled chunk
+ *
+ * Only builds chunk its cull stage moved to CHUNK_UPDATING. Result is
+ * tagged with generation it was built from, if chunk is marked again
+ * meanwhile, build is aborted or its result dropped by uploader.
+ *
+ * @param c: pointer to chunk
+ * @param w: pointer to world
+ * @return 0 on success
+ */
+int chunk_update(chunk *c, world *w)
+{
+        mem_arena *scratch = thread_scratch_arena();
+        size_t face_count[NR_CUBE_FACES];
+        chunk_mesh *m;
+        mesh_key key;
+        uint64_t links;
+
+        if (!c || !w || !scratch)
                 return -EINVAL;
 
+        // Everything bumped in last job is dead now
+        mem_arena_reset(scratch);
+
         pthread_rwlock_wrlock(&c->rwlock);
 
-        if (c->state != CHUNK_NEED_UPDATE &&
-            c->state != CHUNK_SCHED_UPDATE)
+        if (chunk_state_get(c) != CHUNK_UPDATING || chunk_rebuild_stale(w, c))
                 goto unlock;
 
-        c->state = CHUNK_UPDATING;
+        // Not part of mesh key, chunk 0 is larger than the others
+        links = chunk_links_compute(c, w->chunk_length, scratch);
+
+        chunk_mesh_key(c, w->chunk_length, &key, face_count);
+
+        m = mesh_cache_get(&w->meshes, &key);
+        if (m)
+                goto done;
+
+        m = chunk_mesh_alloc(&key);
+        if (!m)
+                goto retry;
+
+        if (chunk_mesh_build(c, w->chunk_length, face_count, scratch, m)) {
+                chunk_mesh_free(&m);
+                goto retry;
+        }
+
+        if (w->lod_distance > 0.0f)
+                chunk_mesh_lods_build(c, w->chunk_length, scratch, m);
+
+        // Not cached yet, nobody else wants it
+        if (chunk_rebuild_stale(w, c)) {
+                chunk_mesh_free(&m);
+                goto unlock;
+        }
+
+        m = mesh_cache_add(&w->meshes, m);
+
+done:
+        if (w->upload_window && !atomic_load(&m->uploaded))
+                chunk_mesh_upload_set(w, c, m);
+
+        atomic_store(&c->links_pending, links);
+        atomic_store(&c->mesh_pending_gen, c->build_gen);
+        chunk_mesh_pending_set(w, c, m);
+        chunk_state_cas(c, CHUNK_UPDATING, CHUNK_NEED_FLUSH);
+
+unlock:
+        pthread_rwlock_unlock(&c->rwlock);
+
+        return 0;
+
+retry:
+        chunk_state_cas(c, CHUNK_UPDATING, CHUNK_NEED_UPDATE);
+        pthread_rwlock_unlock(&c->rwlock);
+
+        // Picked up again on next trigger
+        world_queue_push(w, c, CHUNK_QUEUE_DIRTY);
+
+        return -ENOMEM;
+}
+
+static inline void block_near_origin_get(block *b, int f, ivec3 origin_near)
+{
+        if (!b)
+                return;
+
+        // XXX: if BLOCK_EDGE_LEN_GLUNIT != 1, this will be incorrect
+        origin_near[X] += b->origin_l[X] + block_normals[f][X];
+        origin_near[Y] += b->origin_l[Y] + block_normals[f][Y];
+        origin_near[Z] += b->origin_l[Z] + block_normals[f][Z];
+}
+
+/**
+ * chunk_cull_blocks() - update visible faces of chunk blocks
+ *
+ * Moves chunk needing rebuild to CHUNK_UPDATING, which is done under
+ * lock, so a mesher sees either no cull or a finished one. Neighbour
+ * blocks are read without lock. Faces are not changed in place,
+ * readers may be walking them, a copy is published on change.
+ *
+ * @param c: pointer to chunk
+ * @param w: pointer to world
+ * @return 0 on success
+ */
+int chunk_cull_blocks(chunk *c, world *w)
+{
+        chunk_blocks *old, *v = NULL;
+        size_t count;
+        int ret = 0;
+
+        if (!c)
+                return -EINVAL;
+
+        pthread_rwlock_wrlock(&c->rwlock);
+
+        // Rebuilt already by another pipeline
+        if (!chunk_state_move(c, CHUNK_STATE_BIT(CHUNK_NEED_UPDATE) |
+                                 CHUNK_STATE_BIT(CHUNK_SCHED_UPDATE),
+                              CHUNK_UPDATING)) {
+                pthread_rwlock_unlock(&c->rwlock);
+                return 0;
+        }
+
+        c->build_gen = atomic_load(&c->gen);
+
+        epoch_read_lock();
+
+        old = chunk_blocks_get(c);
+        count = chunk_blocks_count(old);
+
+        for (size_t n = 0; n < count; ++n) {
+                block *b = &old->blocks[n];
+
+                // Partial copy is dropped, next cull starts over
+                if (n % CHUNK_CULL_ABORT_CHECK == 0 && chunk_rebuild_stale(w, c)) {
+                        if (v)
+                                chunk_blocks_free(&v->retire);
+
+                        goto unlock;
+                }
+
+                for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
+                        ivec3 o_near = { 0 };
+                        block_face *f;
+                        int visible;
+
+                        block_near_origin_get(b, i, o_near);
+                        visible = !__world_get_block(w, o_near);
+
+                        if (visible == !!b->model.faces[i].visible)
+                                continue;
+
+                        if (!v) {
+                                v = chunk_blocks_alloc(old->capacity);
+                                if (!v) {
+                                        ret = -ENOMEM;
+                                        goto unlock;
+                                }
+
+                                memcpy(v->blocks, old->blocks, sizeof(block) * count);
+                                atomic_store_explicit(&v->count, count, memory_order_relaxed);
+                        }
+
+                        // Vertices are generated in batch by mesher
+                        f = &v->blocks[n].model.faces[i];
+                        f->visible = visible;
+
+                        if (visible)
+                                block_model_face_normal(f, i);
+                }
+        }
+
+        if (v)
+                chunk_blocks_publish(c, v);
+
+unlock:
+        epoch_read_unlock();
+        pthread_rwlock_unlock(&c->rwlock);
+
+        return ret;
+}
+
+/**
+ * Rebuild Ordering
+ */
+
+typedef struct chunk_view {
+        vec3                    camera;
+        vec4                    planes[6];
+        uint32_t                seq;
+} chunk_view;
+
+/**
+ * world_view_update() - snapshot camera for chunk rebuild ordering
+ *
+ * Called by render thread every frame, snapshot sequence only moves on
+ * when camera did, so pending rebuilds are reprioritized on movement.
+ *
+ * @param w: pointer to world
+ * @param camera: camera position
+ * @param trans: perspective transform matrix
+ */
+void world_view_update(world *w, vec3 camera, mat4 trans)
+{
+        if (!w)
+                return;
+
+        pthread_mutex_lock(&w->view_lock);
+
+        if (w->view_seq && glm_vec_eqv(w->view_camera, camera) &&
+            !memcmp(w->view_trans, trans, sizeof(mat4)))
+                goto unlock;
+
+        glm_vec_copy(camera, w->view_camera);
+        glm_mat4_copy(trans, w->view_trans);
+        glm_frustum_planes(trans, w->view_planes);
+
+        w->view_seq++;
+        if (!w->view_seq)
+                w->view_seq = 1;
+
+unlock:
+        pthread_mutex_unlock(&w->view_lock);
+}
+
+static inline void world_view_get(world *w, chunk_view *v)
+{
+        pthread_mutex_lock(&w->view_lock);
+
+        glm_vec_copy(w->view_camera, v->camera);
+        memcpy(v->planes, w->view_planes, sizeof(v->planes));
+        v->seq = w->view_seq;
+
+        pthread_mutex_unlock(&w->view_lock);
+}
+
+static inline void chunk_aabb_gl(const ivec3 origin_c, int chunk_length, vec3 box[2])
+{
+        int edge = (int)BLOCK_EDGE_LEN_GLUNIT;
+        int stride = chunk_length / edge;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                int lo, hi;
+
+                chunk_block_range(origin_c[i], stride, &lo, &hi);
+
+                box[0][i] = (float)(lo * edge);
+                box[1][i] = (float)((hi + 1) * edge);
+        }
+}
+
+/**
+ * chunk_aabb_dist2() - squared distance from point to nearest box point
+ *
+ * @param box: chunk AABB
+ * @param pos: point, zero distance inside box
+ * @return squared distance
+ */
+static float chunk_aabb_dist2(vec3 box[2], const vec3 pos)
+{
+        float dist = 0.0f;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                float d = 0.0f;
+
+                if (pos[i] < box[0][i])
+                        d = box[0][i] - pos[i];
+                else if (pos[i] > box[1][i])
+                        d = pos[i] - box[1][i];
+
+                dist += d * d;
+        }
+
+        return dist;
+}
+
+static void chunk_prio_compute(world *w, const chunk_view *v, chunk_prio *p)
+{
+        vec3 box[2];
+
+        chunk_aabb_gl(p->c->origin_l, w->chunk_length, box);
+
+        p->dist = chunk_aabb_dist2(box, v->camera);
+        p->outside = !glm_aabb_frustum(box, (vec4 *)v->planes);
+}
+
+static inline int chunk_prio_before(const chunk_prio *a, const chunk_prio *b)
+{
+        if (a->outside != b->outside)
+                return a->outside < b->outside;
+
+        return a->dist < b->dist;
+}
+
+static void chunk_heap_sift_down(chunk_prio *heap, size_t count, size_t i)
+{
+        chunk_prio t = heap[i];
+
+        while (1) {
+                size_t child = 2 * i + 1;
+
+                if (child >= count)
+                        break;
+
+                if (child + 1 < count &&
+                    chunk_prio_before(&heap[child + 1], &heap[child]))
+                        child++;
+
+                if (!chunk_prio_before(&heap[child], &t))
+                        break;
+
+                heap[i] = heap[child];
+                i = child;
+        }
+
+        heap[i] = t;
+}
+
+static void chunk_heap_build(chunk_prio *heap, size_t count)
+{
+        for (size_t i = count / 2; i-- > 0; )
+                chunk_heap_sift_down(heap, count, i);
+}
+
+static chunk *chunk_heap_pop(chunk_prio *heap, size_t *count)
+{
+        chunk *c = heap[0].c;
+
+        (*count)--;
+        if (*count) {
+                heap[0] = heap[*count];
+                chunk_heap_sift_down(heap, *count, 0);
+        }
+
+        return c;
+}
+
+/**
+ * Chunk Job Graph
+ */
+
+static const char *chunk_stage_names[] = {
+        [CHUNK_STAGE_GENERATE]  = "generate",
+        [CHUNK_STAGE_BARRIER]   = "barrier",
+        [CHUNK_STAGE_CULL]      = "cull",
+        [CHUNK_STAGE_MESH]      = "mesh",
+        [CHUNK_STAGE_UPLOAD]    = "upload",
+};
+
+typedef struct chunk_graph_ctx {
+        world                   *w;
+        chunk_generate_func     gen;
+        void                    *data;
+} chunk_graph_ctx;
+
+static void chunk_generate_node(void *ctx, void *arg)
+{
+        chunk_graph_ctx *x = ctx;
+
+        x->gen(x->w, arg, x->data);
+
+        // Rebuilt by this graph, not queued
+        chunk_state_mark(arg);
+}
+
+static void chunk_cull_node(void *ctx, void *arg)
+{
+        chunk_graph_ctx *x = ctx;
+
+        chunk_cull_blocks(arg, x->w);
+}
+
+static void chunk_mesh_node(void *ctx, void *arg)
+{
+        chunk_graph_ctx *x = ctx;
+        chunk *c = arg;
+
+        pr_info_func("chunk (%d, %d, %d)\n",
+                     c->origin_l[X], c->origin_l[Y], c->origin_l[Z]);
+
+        chunk_update(c, x->w);
+}
+
+/**
+ * chunk_upload_node() - hand built chunk over to render thread
+ *
+ * Deferred node, upload itself runs in world_flush_chunks() under frame
+ * budget, its latency is accounted there. With upload thread, chunk
+ * goes there first, render thread only gets it once buffers are done.
+ */
+static void chunk_upload_node(void *ctx, void *arg)
+{
+        chunk_graph_ctx *x = ctx;
+        chunk *c = arg;
+        double now = glfwGetTime();
+
+        // Earlier push still waiting, keep its time. Stored before push
+        // publishes chunk, flush may read it as soon as bit is cleared.
+        if (!atomic_load_explicit(&c->queued[CHUNK_QUEUE_READY], memory_order_relaxed))
+                atomic_store_explicit(&c->ready_time, now, memory_order_relaxed);
+
+        if (atomic_load(&c->mesh_upload)) {
+                world_upload_kick(x->w, c);
+                return;
+        }
+
+        world_queue_push(x->w, c, CHUNK_QUEUE_READY);
+}
+
+/**
+ * chunk_graph_add() - add cull, mesh and upload stages of one chunk
+ *
+ * On failure graph is left as it was, nodes already added are dropped.
+ *
+ * @param g: pointer to graph
+ * @param c: pointer to chunk
+ * @param barrier: also add a barrier node in front of cull
+ * @return index of first node added, negative on error
+ */
+static int chunk_graph_add(job_graph *g, chunk *c, int barrier)
+{
+        uint32_t nr_nodes = g->nr_nodes;
+        uint32_t nr_edges = g->nr_edges;
+        int first = -1, cull, mesh, upload;
+
+        if (barrier) {
+                first = job_graph_add(g, NULL, c, CHUNK_STAGE_BARRIER, 0);
+                if (first < 0)
+                        return first;
+        }
+
+        cull = job_graph_add(g, chunk_cull_node, c, CHUNK_STAGE_CULL, 0);
+        mesh = job_graph_add(g, chunk_mesh_node, c, CHUNK_STAGE_MESH, 0);
+        upload = job_graph_add(g, chunk_upload_node, c, CHUNK_STAGE_UPLOAD,
+                               JOB_NODE_DEFER);
+        if (cull < 0 || mesh < 0 || upload < 0)
+                goto unwind;
+
+        if ((barrier && job_graph_depend(g, first, cull)) ||
+            job_graph_depend(g, cull, mesh) ||
+            job_graph_depend(g, mesh, upload))
+                goto unwind;
+
+        return barrier ? first : cull;
+
+unwind:
+        // Added last, no other node or edge refers to them yet
+        g->nr_nodes = nr_nodes;
+        g->nr_edges = nr_edges;
+
+        return -ENOMEM;
+}
+
+static void world_stage_stats_merge(world *w, const job_stage_stats *stats)
+{
+        pthread_mutex_lock(&w->stage_lock);
+        job_stage_stats_merge(w->stage_stats, stats, NR_CHUNK_STAGES);
+        pthread_mutex_unlock(&w->stage_lock);
+}
+
+/**
+ * world_generate_chunks() - generate and mesh a box of chunks
+ *
+ * Runs generate, neighbour barrier, cull, mesh and upload stages as one
+ * job graph. A chunk is culled only after itself and its neighbours are
+ * generated, so its borders are final. Must not be called from a job.
+ *
+ * @param w: pointer to world
+ * @param chunk_min: min chunk origin, inclusive
+ * @param chunk_max: max chunk origin, inclusive
+ * @param gen: fills blocks of one chunk
+ * @param data: last argument of gen
+ * @return 0 on success
+ */
+int world_generate_chunks(world *w, ivec3 chunk_min, ivec3 chunk_max,
+                          chunk_generate_func gen, void *data)
+{
+        chunk_graph_ctx ctx = { .w = w, .gen = gen, .data = data };
+        ivec3 dim;
+        size_t count;
+        int *gen_idx = NULL;
+        int *entry_idx = NULL;
+        job_graph g;
+        int ret = 0;
+
+        if (!w || !gen)
+                return -EINVAL;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                dim[i] = chunk_max[i] - chunk_min[i] + 1;
+                if (dim[i] <= 0)
+                        return -EINVAL;
+        }
+
+        count = (size_t)dim[X] * dim[Y] * dim[Z];
+
+        gen_idx = memalloc(sizeof(int) * count);
+        entry_idx = memalloc(sizeof(int) * count);
+        if (!gen_idx || !entry_idx) {
+                pr_err_alloc();
+                ret = -ENOMEM;
+                goto free;
+        }
+
+        job_graph_init(&g, &w->sched, &ctx);
+
+        // World chunk list is not safe for concurrent append
+        for (size_t i = 0; i < count; ++i) {
+                ivec3 origin_c = {
+                        [X] = chunk_min[X] + (int)(i % dim[X]),
+                        [Z] = chunk_min[Z] + (int)((i / dim[X]) % dim[Z]),
+                        [Y] = chunk_min[Y] + (int)(i / ((size_t)dim[X] * dim[Z])),
+                };
+                chunk *c = world_get_chunk(w, origin_c);
+
+                if (!c)
+                        c = world_add_chunk(w, origin_c);
+
+                if (!c) {
+                        ret = -ENOMEM;
+                        goto deinit;
+                }
+
+                gen_idx[i] = job_graph_add(&g, chunk_generate_node, c,
+                                           CHUNK_STAGE_GENERATE, 0);
+                entry_idx[i] = chunk_graph_add(&g, c, 1);
+
+                if (gen_idx[i] < 0 || entry_idx[i] < 0) {
+                        ret = -ENOMEM;
+                        goto deinit;
+                }
+        }
+
+        // Barrier waits for chunk itself and its face neighbours
+        for (size_t i = 0; i < count; ++i) {
+                ivec3 p = {
+                        [X] = (int)(i % dim[X]),
+                        [Z] = (int)((i / dim[X]) % dim[Z]),
+                        [Y] = (int)(i / ((size_t)dim[X] * dim[Z])),
+                };
+
+                ret = job_graph_depend(&g, gen_idx[i], entry_idx[i]);
+
+                for (int f = 0; !ret && f < NR_CUBE_FACES; ++f) {
+                        ivec3 n;
+                        size_t j;
+
+                        ivec3_add(p, block_normals[f], n);
+
+                        if (n[X] < 0 || n[X] >= dim[X] ||
+                            n[Y] < 0 || n[Y] >= dim[Y] ||
+                            n[Z] < 0 || n[Z] >= dim[Z])
+                                continue;
+
+                        j = (size_t)n[X] + (size_t)n[Z] * dim[X] +
+                            (size_t)n[Y] * dim[X] * dim[Z];
+
+                        ret = job_graph_depend(&g, gen_idx[j], entry_idx[i]);
+                }
+
+                if (ret)
+                        goto deinit;
+        }
+
+        ret = job_graph_run(&g);
+
+        world_stage_stats_merge(w, g.stats);
+
+deinit:
+        job_graph_deinit(&g);
+
+free:
+        if (gen_idx)
+                memfree((void **)&gen_idx);
+
+        if (entry_idx)
+                memfree((void **)&entry_idx);
+
+        return ret;
+}
+
+/**
+ * world_update_chunks() - rebuild dirty chunks through job graph
+ *
+ * Only chunks taken from dirty queue are touched. They are kept in a
+ * heap, visible chunks first then nearest to camera, and rebuilt in
+ * small batches of cull, mesh and upload stages. Heap is rebuilt between
+ * batches once camera moved. Must not be called from a job.
+ *
+ * @param w: pointer to world
+ * @return 0 on success
+ */
+int world_update_chunks(world *w)
+{
+        chunk_graph_ctx ctx = { .w = w };
+        chunk *dirty, *c, *next;
+        chunk_prio *heap;
+        chunk_view view;
+        size_t nr_dirty = 0;
+        size_t batch_max;
+        size_t count = 0;
+        uint32_t seq = 0;
+        job_graph g;
+
+        if (!w)
+                return -EINVAL;
+
+        dirty = world_queue_take(w, CHUNK_QUEUE_DIRTY);
+
+        for (c = dirty; c; c = c->queue_next[CHUNK_QUEUE_DIRTY])
+                nr_dirty++;
+
+        if (!nr_dirty)
+                return 0;
+
+        heap = memalloc(sizeof(chunk_prio) * nr_dirty);
+        if (!heap) {
+                pr_err_alloc();
+                goto requeue;
+        }
+
+        batch_max = CHUNK_UPDATE_BATCH * (size_t)(w->sched.nr_workers > 0 ?
+                                                  w->sched.nr_workers : 1);
+
+        for (c = dirty; c; c = next) {
+                // Link is reusable by producers once queued is cleared
+                next = c->queue_next[CHUNK_QUEUE_DIRTY];
+                atomic_store_explicit(&c->queued[CHUNK_QUEUE_DIRTY], 0,
+                                      memory_order_release);
+
+                if (!chunk_state_cas(c, CHUNK_NEED_UPDATE, CHUNK_SCHED_UPDATE))
+                        continue;
+
+                // No camera yet, keep queue order
+                heap[count].c = c;
+                heap[count].outside = 0;
+                heap[count].dist = (float)count;
+                count++;
+        }
+
+        job_graph_init(&g, &w->sched, &ctx);
+
+        while (count) {
+                size_t batch = 0;
+
+                world_view_get(w, &view);
+
+                if (view.seq != seq) {
+                        for (size_t i = 0; i < count; ++i)
+                                chunk_prio_compute(w, &view, &heap[i]);
+
+                        chunk_heap_build(heap, count);
+                        seq = view.seq;
+                }
+
+                job_graph_reset(&g);
+
+                // Neighbours exist already, no barrier needed
+                while (count && batch < batch_max) {
+                        c = chunk_heap_pop(heap, &count);
+                        batch++;
+
+                        if (chunk_graph_add(&g, c, 0) < 0) {
+                                if (chunk_state_cas(c, CHUNK_SCHED_UPDATE,
+                                                    CHUNK_NEED_UPDATE))
+                                        world_queue_push(w, c, CHUNK_QUEUE_DIRTY);
+
+                                continue;
+                        }
+                }
+
+                job_graph_run(&g);
+        }
+
+        world_stage_stats_merge(w, g.stats);
+        job_graph_deinit(&g);
+
+        memfree((void **)&heap);
+
+        return 0;
+
+requeue:
+        for (c = dirty; c; c = next) {
+                next = c->queue_next[CHUNK_QUEUE_DIRTY];
+                atomic_store_explicit(&c->queued[CHUNK_QUEUE_DIRTY], 0,
+                                      memory_order_release);
+                world_queue_push(w, c, CHUNK_QUEUE_DIRTY);
+        }
+
+        return -ENOMEM;
+}
+
+/**
+ * world_update_wait() - sleep until rebuild window of a trigger closes
+ *
+ * Edits landing meanwhile only count their trigger, so one pass covers
+ * them all. Window is cut short once render thread ends its frame.
+ *
+ * @param w: pointer to world, update_mutex held
+ */
+static void world_update_wait(world *w)
+{
+        while (!w->update_stop && !w->update_frame_end && w->update_window_us) {
+                double left = w->update_first +
+                              (double)w->update_window_us / SEC_TO_US(1.0) -
+                              glfwGetTime();
+                struct timespec ts;
+                long ns;
+
+                if (left <= 0.0)
+                        break;
+
+                // update_cond runs on monotonic clock
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+
+                ns = ts.tv_nsec + (long)(left * 1e9);
+                ts.tv_sec += ns / 1000000000L;
+                ts.tv_nsec = ns % 1000000000L;
+
+                pthread_cond_timedwait(&w->update_cond, &w->update_mutex, &ts);
+        }
+}
+
+void *world_chunks_worker(void *data)
+{
+        world *w = data;
+
+        while (1) {
+                pthread_mutex_lock(&w->update_mutex);
+
+                // Predicate is rechecked under lock, no wakeup is lost
+                while (!w->update_pending && !w->update_stop)
+                        pthread_cond_wait(&w->update_cond, &w->update_mutex);
+
+                world_update_wait(w);
+
+                if (w->update_stop) {
+                        pthread_mutex_unlock(&w->update_mutex);
+                        break;
+                }
+
+                w->update_pending = 0;
+                w->update_stats.passes++;
+
+                pthread_mutex_unlock(&w->update_mutex);
+
+                world_update_chunks(w);
+        }
+
+        pthread_exit(NULL);
+
+        return NULL;
+}
+
+/**
+ * world_update_trigger() - wake up chunk update thread
+ *
+ * Triggers while update thread is busy collapse into one more pass.
+ *
+ * @param w: pointer to world
+ * @return 0 on success
+ */
+int world_update_trigger(world *w)
+{
+        if (!w)
+                return -EINVAL;
+
+        pthread_mutex_lock(&w->update_mutex);
+
+        w->update_stats.triggers++;
+
+        // Later triggers join window opened by first one
+        if (!w->update_pending) {
+                w->update_pending = 1;
+                w->update_frame_end = 0;
+                w->update_first = glfwGetTime();
+                pthread_cond_signal(&w->update_cond);
+        }
+
+        pthread_mutex_unlock(&w->update_mutex);
+
+        return 0;
+}
+
+/**
+ * world_update_frame_end() - close rebuild window at end of frame
+ *
+ * Edits of this frame are all in, no need to wait for more. Without
+ * update thread, pass runs right here on render thread.
+ *
+ * @param w: pointer to world
+ */
+static void world_update_frame_end(world *w)
+{
+        int run = 0;
+
+        pthread_mutex_lock(&w->update_mutex);
+
+        if (w->update_inline) {
+                run = w->update_pending;
+                w->update_pending = 0;
+                w->update_stats.passes += (uint64_t)run;
+        } else if (w->update_pending && !w->update_frame_end) {
+                w->update_frame_end = 1;
+                pthread_cond_signal(&w->update_cond);
+        }
+
+        pthread_mutex_unlock(&w->update_mutex);
+
+        if (run)
+                world_update_chunks(w);
+}
+
+int chunk_gl_attr_generate(gl_attr *glattr, block_attr *blk_dummy)
+{
+        int ret;
+
+        if (!glattr)
+                return -EINVAL;
+
+        glattr->program = block_shader_get(blk_dummy->shader);
+        ret  = glIsProgram(glattr->program);
+        if (ret == GL_FALSE) {
+                pr_err_func("invalid shader program\n");
+                return -EFAULT;
+        }
+
+        ret = glIsTexture(blk_dummy->texel.texel);
+        if (ret == GL_FALSE) {
+                pr_err_func("invalid texture object\n");
+                return -EFAULT;
+        } else {
+                glattr->texel = blk_dummy->texel.texel;
+        }
+
+        glattr->camera = glGetUniformLocation(glattr->program, "camera");
+        glattr->sampler = glGetUniformLocation(glattr->program, "sampler");
+        glattr->mat_transform = glGetUniformLocation(glattr->program, "mat_transform");
+        glattr->uniform_1 = glGetUniformLocation(glattr->program, "fog_distance");
+        glattr->uniform_2 = glGetUniformLocation(glattr->program, "fog_color");
+
+        return 0;
+}
+
+/**
+ * chunk_mesh_level_buffers_create() - create GL buffers of one mesh level
+ *
+ * Staging copy is freed once buffers exist, so calling it again on the
+ * same mesh creates nothing twice. Data goes into world mesh arena, own
+ * buffers are only made once arena is full.
+ *
+ * @param w: pointer to world
+ * @param m: pointer to mesh
+ * @param stream: stage through stream ring, render thread only
+ * @return 0 on success
+ */
+static int chunk_mesh_level_buffers_create(world *w, chunk_mesh *m, int stream)
+{
+        int ret;
+
+        ret = chunk_gl_attr_generate(&m->glattr, block_attr_get(BLOCK_DUMMY));
+        if (ret)
+                return ret;
+
+        // Empty meshes succeed too, without taking arena space
+        if (!mesh_arena_upload(&w->arena, m, stream)) {
+                // Shared by chunks, CPU copy is useless now
+                gl_vbo_deinit(&m->glvbo);
+                return 0;
+        }
+
+        if (m->glvbo.staging) {
+                atomic_fetch_add(&w->arena.fallbacks, 1);
+
+                ret = gl_vbo_buffer_create(&m->glvbo, &m->glattr);
+                if (ret == GL_FALSE) {
+                        pr_err_func("failed to generate chunk VBO\n");
+                        return -EFAULT;
+                }
+        }
+
+        // Shared by chunks, CPU copy is useless now
+        gl_vbo_deinit(&m->glvbo);
+
+        return 0;
+}
+
+/**
+ * chunk_mesh_buffers_create() - create GL buffers of mesh not uploaded
+ *
+ * Coarser levels are created along and marked uploaded here, they are
+ * only looked at once caller marks the full mesh uploaded.
+ *
+ * @param w: pointer to world
+ * @param m: pointer to mesh
+ * @param stream: stage through stream ring, render thread only
+ * @return 0 on success
+ */
+static int chunk_mesh_buffers_create(world *w, chunk_mesh *m, int stream)
+{
+        int ret;
+
+        ret = chunk_mesh_level_buffers_create(w, m, stream);
+        if (ret)
+                return ret;
+
+        for (int i = 0; i < MESH_LODS - 1; ++i) {
+                chunk_mesh *lod = m->lods[i];
+
+                if (!lod || atomic_load(&lod->uploaded))
+                        continue;
+
+                // Drawing falls back to finer level
+                if (chunk_mesh_level_buffers_create(w, lod, stream))
+                        continue;
+
+                atomic_store(&lod->uploaded, 1);
+        }
+
+        return 0;
+}
+
+int chunk_mesh_upload(world *w, chunk_mesh *m)
+{
+        int ret;
+
+        if (atomic_load(&m->uploaded))
+                return 0;
+
+        ret = chunk_mesh_buffers_create(w, m, 1);
+        if (ret)
+                return ret;
+
+        atomic_store(&m->uploaded, 1);
+
+        return 0;
+}
+
+/**
+ * chunk_mesh_vao_create() - record mesh vertex layout into its own VAO
+ *
+ * VAOs are not shared between contexts, so this is done on render thread
+ * even if buffers came from upload thread. Leaves the new VAO bound.
+ * Arena meshes use the arena VAO instead.
+ *
+ * @param m: pointer to uploaded mesh
+ */
+static void chunk_mesh_vao_create(chunk_mesh *m)
+{
+        for (int i = 0; i < MESH_LODS - 1; ++i) {
+                chunk_mesh *lod = m->lods[i];
+
+                if (lod && atomic_load(&lod->uploaded))
+                        chunk_mesh_vao_create(lod);
+        }
+
+        if (m->vao || m->arena)
+                return;
+
+        m->vao = vertex_array_create();
+        gl_vbo_attrib_bind(&m->glattr);
+}
+
+static inline GLuint chunk_mesh_vao(chunk_mesh *m)
+{
+        return m->arena ? m->arena->vao : m->vao;
+}
+
+/**
+ * chunk_mesh_lod() - get mesh of detail level to draw
+ *
+ * Falls back to next finer level if a coarser one is missing or its
+ * upload failed, so the full mesh is always the last resort.
+ *
+ * @param m: pointer to uploaded full mesh
+ * @param level: wanted level, 0 is full detail, updated to level returned
+ * @return mesh to draw
+ */
+static chunk_mesh *chunk_mesh_lod(chunk_mesh *m, int *level)
+{
+        for (; *level > 0; --(*level)) {
+                chunk_mesh *lod = m->lods[*level - 1];
+
+                if (lod && atomic_load(&lod->uploaded))
+                        return lod;
+        }
+
+        return m;
+}
+
+static inline size_t chunk_mesh_bytes(chunk_mesh *m)
+{
+        size_t bytes;
+
+        if (!m || atomic_load(&m->uploaded))
+                return 0;
+
+        bytes = m->glvbo.vertex_count * sizeof(vertex_attr) +
+                m->glvbo.index_count * sizeof(uint32_t);
+
+        for (int i = 0; i < MESH_LODS - 1; ++i)
+                bytes += chunk_mesh_bytes(m->lods[i]);
+
+        return bytes;
+}
+
+/**
+ * chunk_flush() - upload built mesh of ready chunk
+ *
+ * Ready queued bit is cleared before state is checked, so a rebuild
+ * finishing meanwhile is either flushed here or queued again. Chunk
+ * lock is not needed, pending mesh is taken atomically. With upload
+ * thread, meshes arrive uploaded and only handles are swapped here,
+ * unless upload thread gave a mesh up. Mesh which fails to upload is
+ * put back and chunk is queued again.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param bytes: output uploaded bytes
+ * @return 0 on success
+ */
+int chunk_flush(world *w, chunk *c, size_t *bytes)
+{
+        chunk_mesh *m;
+        size_t n;
+
+        if (unlikely(!c))
+                return -EINVAL;
+
+        *bytes = 0;
+
+        atomic_store(&c->queued[CHUNK_QUEUE_READY], 0);
+
+        // Upload thread still busy on it, it queues chunk again once done.
+        // Meshes are only freed by this thread, peeking one is safe.
+        if (w->upload_window) {
+                m = atomic_load(&c->mesh_pending);
+                if (m && !atomic_load(&m->uploaded) && !atomic_load(&m->upload_failed))
+                        return 0;
+        }
+
+        // Rebuilding again or flushed already
+        if (!chunk_state_cas(c, CHUNK_NEED_FLUSH, CHUNK_FLUSHING))
+                return 0;
+
+        pr_info_func("chunk (%d, %d, %d)\n",
+                     c->origin_l[X], c->origin_l[Y], c->origin_l[Z]);
+
+        // Empty if an earlier flush took a newer result already
+        m = atomic_exchange(&c->mesh_pending, NULL);
+
+        // Built before latest edit, chunk is queued for rebuild again
+        if (m && atomic_load(&c->mesh_pending_gen) != atomic_load(&c->gen)) {
+                mesh_cache_put(&w->meshes, m);
+                w->upload_stats.stale++;
+                m = NULL;
+        }
+
+        // Rebuilt since peek, newer mesh is not ours to upload
+        if (m && w->upload_window && !atomic_load(&m->uploaded) &&
+            !atomic_load(&m->upload_failed)) {
+                chunk_mesh *expect = NULL;
+
+                if (!atomic_compare_exchange_strong(&c->mesh_pending, &expect, m))
+                        mesh_cache_put(&w->meshes, m);
+
+                m = NULL;
+        }
+
+        // Identical chunks may have uploaded it already
+        n = chunk_mesh_bytes(m);
+
+        // No buffers to record a VAO over, retry on a later frame
+        if (m && chunk_mesh_upload(w, m)) {
+                chunk_mesh *expect = NULL;
+
+                pr_err_func("failed to upload chunk mesh\n");
+
+                // Rebuilt meanwhile, newer mesh wins
+                if (!atomic_compare_exchange_strong(&c->mesh_pending, &expect, m))
+                        mesh_cache_put(&w->meshes, m);
+
+                if (chunk_state_cas(c, CHUNK_FLUSHING, CHUNK_NEED_FLUSH))
+                        world_queue_push(w, c, CHUNK_QUEUE_READY);
+
+                return -EFAULT;
+        }
+
+        if (m) {
+                *bytes = n;
+
+                chunk_mesh_vao_create(m);
+
+                // Since we gonna call draw call in the same thread
+                // There is no point to grab rwlock_gl
+                if (c->mesh)
+                        mesh_cache_put(&w->meshes, c->mesh);
+
+                c->mesh = m;
+                c->links = atomic_load(&c->links_pending);
+        }
+
+        // Marked again meanwhile, stays dirty
+        chunk_state_cas(c, CHUNK_FLUSHING, CHUNK_FLUSHED);
+
+        return 0;
+}
+
+static inline int world_upload_budget_spent(world *w, size_t bytes, double start)
+{
+        if (w->upload_budget_bytes && bytes >= w->upload_budget_bytes)
+                return 1;
+
+        if (w->upload_budget_us &&
+            SEC_TO_US(glfwGetTime() - start) >= (double)w->upload_budget_us)
+                return 1;
+
+        return 0;
+}
+
+/**
+ * world_flush_chunks() - upload ready chunks within frame budget
+ *
+ * Ready chunks are flushed nearest visible first, what exceeds budget
+ * is deferred to next frames. At least one chunk is flushed per frame,
+ * so a single large mesh can not stall the queue.
+ *
+ * @param w: pointer to world
+ */
+void world_flush_chunks(world *w)
+{
+        job_stage_stats stats[NR_CHUNK_STAGES] = { 0 };
+        seqlist *q = &w->flush_heap;
+        double start = glfwGetTime();
+        size_t bytes = 0;
+        int flushed = 0;
+        chunk_prio *heap;
+        chunk_view view;
+        chunk *c, *next;
+
+        // Queued bit stays set while chunk waits in heap
+        for (c = world_queue_take(w, CHUNK_QUEUE_READY); c; c = next) {
+                chunk_prio p = { .c = c };
+
+                next = c->queue_next[CHUNK_QUEUE_READY];
+                seqlist_append(q, &p);
+        }
+
+        if (!q->count_utilized)
+                return;
+
+        // Camera moves every frame, pending set is small, just rekey
+        world_view_get(w, &view);
+
+        heap = q->data;
+        for (size_t i = 0; i < q->count_utilized; ++i)
+                chunk_prio_compute(w, &view, &heap[i]);
+
+        chunk_heap_build(heap, q->count_utilized);
+
+        while (q->count_utilized) {
+                chunk_prio p = heap[0];
+                double ready, t0, t1;
+                size_t n;
+
+                if (flushed && world_upload_budget_spent(w, bytes, start)) {
+                        w->upload_stats.frames_deferred++;
+                        break;
+                }
+
+                chunk_heap_pop(heap, &q->count_utilized);
+
+                // Before flush clears queued bit, a new push may store again
+                ready = atomic_load_explicit(&p.c->ready_time, memory_order_relaxed);
+
+                t0 = glfwGetTime();
+
+                chunk_flush(w, p.c, &n);
+
+                t1 = glfwGetTime();
+                job_stage_stats_add(&stats[CHUNK_STAGE_UPLOAD],
+                                    t0 - ready, t1 - t0);
+
+                bytes += n;
+                flushed++;
+        }
+
+        w->upload_stats.flushes += (uint64_t)flushed;
+        w->upload_stats.bytes += bytes;
+
+        if (flushed)
+                world_stage_stats_merge(w, stats);
+}
+
+/**
+ * Upload Thread
+ *
+ * Optional thread with its own GL context, sharing objects with render
+ * context. It creates mesh buffers and waits on a fence, render thread
+ * gets chunk once GPU copy is complete.
+ */
+
+typedef struct world_upload_item {
+        chunk                   *c;
+        chunk_mesh              *m;
+} world_upload_item;
+
+/**
+ * world_upload_batch() - upload meshes of queued chunks under one fence
+ *
+ * @param w: pointer to world
+ * @param batch: chunks taken from upload queue
+ * @param items: scratch list of world_upload_item
+ */
+static void world_upload_batch(world *w, chunk *batch, seqlist *items)
+{
+        world_upload_item *it;
+        chunk *c, *next;
+        size_t bytes = 0;
+        double t0;
+        GLsync fence;
+        GLenum ret;
+
+        items->count_utilized = 0;
+
+        for (c = batch; c; c = next) {
+                world_upload_item item = { .c = c };
+
+                next = c->queue_next[CHUNK_QUEUE_UPLOAD];
+                atomic_store_explicit(&c->queued[CHUNK_QUEUE_UPLOAD], 0,
+                                      memory_order_release);
+
+                // Taken by an earlier batch already
+                item.m = atomic_exchange(&c->mesh_upload, NULL);
+                if (!item.m)
+                        continue;
+
+                // Cached mesh queued by another chunk too, done by earlier
+                // batch. Render thread may draw it, leave glattr alone.
+                if (!atomic_load(&item.m->uploaded) &&
+                    !atomic_load(&item.m->upload_failed)) {
+                        bytes += chunk_mesh_bytes(item.m);
+
+                        // Stream ring belongs to render context
+                        if (chunk_mesh_buffers_create(w, item.m, 0)) {
+                                pr_err_func("failed to upload chunk mesh\n");
+                                atomic_store(&item.m->upload_failed, 1);
+                        }
+                }
+
+                // Render thread owns it now, retries upload on flush
+                if (atomic_load(&item.m->upload_failed)) {
+                        mesh_cache_put(&w->meshes, item.m);
+                        world_queue_push(w, c, CHUNK_QUEUE_READY);
+                        continue;
+                }
+
+                seqlist_append(items, &item);
+        }
+
+        if (!items->count_utilized)
+                return;
+
+        t0 = glfwGetTime();
+
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        do {
+                ret = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                       WORLD_UPLOAD_FENCE_WAIT_NS);
+        } while (ret == GL_TIMEOUT_EXPIRED);
+
+        if (ret == GL_WAIT_FAILED) {
+                pr_err_func("failed to wait upload fence\n");
+                glFinish();
+        }
+
+        glDeleteSync(fence);
+
+        it = items->data;
+        for (size_t i = 0; i < items->count_utilized; ++i) {
+                // Pairs with chunk_flush(), buffers are complete now
+                atomic_store(&it[i].m->uploaded, 1);
+
+                mesh_cache_put(&w->meshes, it[i].m);
+
+                world_queue_push(w, it[i].c, CHUNK_QUEUE_READY);
+        }
+
+        pthread_mutex_lock(&w->upload_mutex);
+        w->async_stats.batches++;
+        w->async_stats.meshes += items->count_utilized;
+        w->async_stats.bytes += bytes;
+        w->async_stats.fence_wait += glfwGetTime() - t0;
+        pthread_mutex_unlock(&w->upload_mutex);
+}
+
+static void *world_upload_worker(void *data)
+{
+        world *w = data;
+        seqlist items;
+        GLuint vao;
+
+        glfwMakeContextCurrent(w->upload_window);
+
+        // Vertex arrays are not shared, core profile wants one bound
+        vao = vertex_array_create();
+
+        seqlist_init(&items, sizeof(world_upload_item), 64);
+
+        while (1) {
+                chunk *batch;
+
+                pthread_mutex_lock(&w->upload_mutex);
+
+                while (!atomic_load(&w->queues[CHUNK_QUEUE_UPLOAD]) && !w->upload_stop)
+                        pthread_cond_wait(&w->upload_cond, &w->upload_mutex);
+
+                if (w->upload_stop) {
+                        pthread_mutex_unlock(&w->upload_mutex);
+                        break;
+                }
+
+                pthread_mutex_unlock(&w->upload_mutex);
+
+                batch = world_queue_take(w, CHUNK_QUEUE_UPLOAD);
+                if (batch)
+                        world_upload_batch(w, batch, &items);
+        }
+
+        seqlist_deinit(&items);
+        vertex_array_delete(&vao);
+
+        glfwMakeContextCurrent(NULL);
+
+        pthread_exit(NULL);
+
+        return NULL;
+}
+
+/**
+ * world_upload_budget_set() - set per frame chunk upload budget
+ *
+ * @param w: pointer to world
+ * @param bytes: mesh bytes per frame, 0 for unlimited
+ * @param us: upload time per frame in microseconds, 0 for unlimited
+ */
+void world_upload_budget_set(world *w, size_t bytes, uint32_t us)
+{
+        if (!w)
+                return;
+
+        w->upload_budget_bytes = bytes;
+        w->upload_budget_us = us;
+}
+
+/**
+ * world_draw_order_set() - choose chunk order within same GL state
+ *
+ * @param w: pointer to world
+ * @param front_to_back: sort by camera distance, else state order only
+ */
+void world_draw_order_set(world *w, int front_to_back)
+{
+        if (!w)
+                return;
+
+        w->draw_unsorted = !front_to_back;
+}
+
+/**
+ * world_multi_draw_set() - toggle indirect multi-draw of arena chunks
+ *
+ * Needs ARB_multi_draw_indirect for the draw and ARB_base_instance for
+ * per draw offsets, chunks are drawn one by one without.
+ *
+ * @param w: pointer to world
+ * @param enable: 1 to batch arena chunks, 0 to draw one by one
+ * @return 0 on success, -ENOTSUP if GL lacks support
+ */
+int world_multi_draw_set(world *w, int enable)
+{
+        if (!w)
+                return -EINVAL;
+
+        if (enable && !(GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance)) {
+                pr_info("multi-draw not supported, drawing chunk by chunk\n");
+                w->multi_draw = 0;
+                return -ENOTSUP;
+        }
+
+        w->multi_draw = enable;
+
+        return 0;
+}
+
+/**
+ * world_lod_distance_set() - set distance coarser chunk meshes start at
+ *
+ * Levels are built along with meshes, so set it before chunks are built,
+ * chunks built earlier keep drawing full detail.
+ *
+ * @param w: pointer to world
+ * @param distance: distance of first coarser level, 0 to disable
+ */
+void world_lod_distance_set(world *w, float distance)
+{
+        if (!w)
+                return;
+
+        w->lod_distance = distance > 0.0f ? distance : 0.0f;
+}
+
+/**
+ * world_overdraw_set() - toggle samples passed measurement
+ *
+ * Counts samples of opaque chunk draws passing depth test, render thread
+ * only. Fewer samples per pixel means less overdraw.
+ *
+ * @param w: pointer to world
+ * @param enable: 1 to start measuring, 0 to stop
+ * @return 0 on success
+ */
+int world_overdraw_set(world *w, int enable)
+{
+        if (!w)
+                return -EINVAL;
+
+        if (enable && !w->overdraw_query[0]) {
+                glGenQueries(2, w->overdraw_query);
+                w->overdraw_pending[0] = 0;
+                w->overdraw_pending[1] = 0;
+                w->overdraw_frame = 0;
+        } else if (!enable && w->overdraw_query[0]) {
+                glDeleteQueries(2, w->overdraw_query);
+                w->overdraw_query[0] = 0;
+                w->overdraw_query[1] = 0;
+        }
+
+        return 0;
+}
+
+/**
+ * world_occlusion_box_init() - load box program and unit cube buffer
+ *
+ * @param w: pointer to world
+ * @return 0 on success
+ */
+static int world_occlusion_box_init(world *w)
+{
+        // Cube corners by bits, x = 1, y = 2, z = 4
+        static const uint8_t quads[NR_CUBE_FACES][4] = {
+                { 0, 2, 6, 4 }, { 1, 5, 7, 3 },
+                { 0, 4, 5, 1 }, { 2, 3, 7, 6 },
+                { 0, 1, 3, 2 }, { 4, 6, 7, 5 },
+        };
+        static const uint8_t tris[VERTICES_TRIANGULATE_QUAD] = { 0, 1, 2, 0, 2, 3 };
+        vec3 cube[NR_CUBE_FACES * VERTICES_TRIANGULATE_QUAD];
+        gl_attr *glattr = &w->occl_attr;
+        GLint vao_prev;
+        size_t n = 0;
+
+        glattr->program = program_create(SHADER_FILE("occlusion_box_vertex"),
+                                         SHADER_FILE("occlusion_box_fragment"));
+        if (!glIsProgram(glattr->program)) {
+                pr_err_func("failed to load occlusion box shaders\n");
+                return -EINVAL;
+        }
+
+        glattr->mat_transform = glGetUniformLocation(glattr->program, "mat_transform");
+        glattr->uniform_1 = glGetUniformLocation(glattr->program, "box_min");
+        glattr->uniform_2 = glGetUniformLocation(glattr->program, "box_size");
+
+        for (int i = 0; i < NR_CUBE_FACES; ++i) {
+                for (int k = 0; k < VERTICES_TRIANGULATE_QUAD; ++k, ++n) {
+                        uint8_t corner = quads[i][tris[k]];
+
+                        cube[n][X] = (float)((corner >> 0) & 1);
+                        cube[n][Y] = (float)((corner >> 1) & 1);
+                        cube[n][Z] = (float)((corner >> 2) & 1);
+                }
+        }
+
+        glattr->vertex_count = (GLsizei)n;
+        glattr->vertex = buffer_create(cube, sizeof(cube));
+
+        // Other renderers bind attributes into the shared VAO
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao_prev);
+
+        w->occl_vao = vertex_array_create();
+
+        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+        glBindBuffer(GL_ARRAY_BUFFER, GL_BUFFER_NONE);
+
+        glBindVertexArray((GLuint)vao_prev);
+
+        return 0;
+}
+
+/**
+ * world_occlusion_set() - toggle chunk AABB occlusion queries
+ *
+ * Chunks passing frustum and cave culling get their box tested against
+ * depth of drawn chunks. Results are read frames later without waiting,
+ * render thread only.
+ *
+ * @param w: pointer to world
+ * @param enable: 1 to start querying, 0 to stop
+ * @return 0 on success
+ */
+int world_occlusion_set(world *w, int enable)
+{
+        linklist_node *pos;
+
+        if (!w)
+                return -EINVAL;
+
+        if (enable && !w->occlusion) {
+                if (world_occlusion_box_init(w)) {
+                        program_delete(&w->occl_attr.program);
+                        return -EINVAL;
+                }
+
+                w->occlusion = 1;
+        } else if (!enable && w->occlusion) {
+                linklist_for_each_node(pos, w->chunks->head) {
+                        chunk *c = pos->data;
+
+                        if (c->occl_query)
+                                glDeleteQueries(1, &c->occl_query);
+
+                        c->occl_query = 0;
+                        c->occl_pending = 0;
+                        c->occl_hidden = 0;
+                }
+
+                vertex_array_delete(&w->occl_vao);
+                program_delete(&w->occl_attr.program);
+                gl_attr_buffer_delete(&w->occl_attr);
+
+                w->occl_list.count_utilized = 0;
+                w->occlusion = 0;
+        }
+
+        return 0;
+}
+
+/**
+ * world_update_window_set() - set window coalescing rebuild triggers
+ *
+ * @param w: pointer to world
+ * @param us: window in microseconds, 0 to rebuild on every trigger
+ */
+void world_update_window_set(world *w, uint32_t us)
+{
+        if (!w)
+                return;
+
+        pthread_mutex_lock(&w->update_mutex);
+        w->update_window_us = us;
+        pthread_mutex_unlock(&w->update_mutex);
+}
+
+/**
+ * Cave Culling
+ *
+ * Chunks are walked breadth first from camera chunk, only across faces
+ * its air links to face it was entered through, only forward and only
+ * into view frustum. Chunks walk never reaches are hidden behind solid
+ * ones. Space without chunk is air.
+ */
+
+static inline int cube_face_opposite(int f)
+{
+        // Faces are paired in cube_face_idx order
+        return f ^ 1;
+}
+
+static inline ssize_t chunk_grid_index(chunk_grid *g, const ivec3 o)
+{
+        ssize_t idx = 0;
+
+        for (int i = NR_VEC3_ATTR - 1; i >= 0; --i) {
+                int d = o[i] - g->dom_min[i];
+
+                if (d < 0 || d >= g->dom_dim[i])
+                        return -1;
+
+                idx = idx * g->dom_dim[i] + d;
+        }
+
+        return idx;
+}
+
+static void chunk_grid_deinit(chunk_grid *g)
+{
+        if (g->chunks)
+                memfree((void **)&g->chunks);
+
+        if (g->visit)
+                memfree((void **)&g->visit);
+
+        if (g->queue)
+                memfree((void **)&g->queue);
+
+        memzero(g, sizeof(chunk_grid));
+}
+
+/**
+ * chunk_grid_update() - reindex chunks if world or domain changed
+ *
+ * Chunks are only added while world runs, count tells bounds changed.
+ *
+ * @param w: pointer to world
+ * @param cam_c: camera chunk origin
+ * @return 0 on success
+ */
+static int chunk_grid_update(world *w, const ivec3 cam_c)
+{
+        chunk_grid *g = &w->grid;
+        ivec3 dom_min, dom_max, dom_dim;
+        linklist_node *pos;
+        size_t cells = 1;
+
+        if (g->nr_chunks != w->chunks->element_count) {
+                g->nr_chunks = 0;
+
+                linklist_for_each_node(pos, w->chunks->head) {
+                        chunk *c = pos->data;
+
+                        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                                if (!g->nr_chunks || c->origin_l[i] < g->min[i])
+                                        g->min[i] = c->origin_l[i];
+
+                                if (!g->nr_chunks || c->origin_l[i] > g->max[i])
+                                        g->max[i] = c->origin_l[i];
+                        }
+
+                        g->nr_chunks++;
+                }
+
+                // Force reindex below
+                g->dom_cells = 0;
+        }
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i) {
+                dom_min[i] = g->min[i] - 1;
+                dom_max[i] = g->max[i] + 1;
+
+                if (cam_c[i] < dom_min[i])
+                        dom_min[i] = cam_c[i];
+
+                if (cam_c[i] > dom_max[i])
+                        dom_max[i] = cam_c[i];
+
+                dom_dim[i] = dom_max[i] - dom_min[i] + 1;
+
+                cells *= (size_t)dom_dim[i];
+        }
+
+        if (g->dom_cells && ivec3_equal(dom_min, g->dom_min) &&
+            ivec3_equal(dom_dim, g->dom_dim))
+                return 0;
+
+        if (cells > CHUNK_GRID_CELLS_MAX)
+                return -E2BIG;
+
+        if (g->chunks)
+                memfree((void **)&g->chunks);
+
+        if (g->visit)
+                memfree((void **)&g->visit);
+
+        if (g->queue)
+                memfree((void **)&g->queue);
+
+        g->dom_cells = 0;
+        g->chunks = memalloc(sizeof(chunk *) * cells);
+        g->visit = memalloc(sizeof(uint32_t) * cells);
+        g->queue = memalloc(sizeof(chunk_visit) * cells);
+        if (!g->chunks || !g->visit || !g->queue) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        memcpy(g->dom_min, dom_min, sizeof(ivec3));
+        memcpy(g->dom_dim, dom_dim, sizeof(ivec3));
+        g->dom_cells = cells;
+        g->stamp = 0;
+
+        linklist_for_each_node(pos, w->chunks->head) {
+                chunk *c = pos->data;
+
+                g->chunks[chunk_grid_index(g, c->origin_l)] = c;
+        }
+
+        return 0;
+}
+
+static inline uint64_t chunk_grid_links(chunk_grid *g, ssize_t idx)
+{
+        chunk *c = g->chunks[idx];
+
+        // Missing or not built yet, see through it
+        if (!c || !c->mesh)
+                return CHUNK_LINKS_ALL;
+
+        return c->links;
+}
+
+/**
+ * world_cave_walk() - mark chunks camera may see through air
+ *
+ * Walk is skipped if grid can not cover camera, every chunk counts as
+ * reached then.
+ *
+ * @param w: pointer to world
+ * @param camera: camera position
+ * @param planes: view frustum planes
+ */
+static void world_cave_walk(world *w, vec3 camera, vec4 planes[6])
+{
+        chunk_grid *g = &w->grid;
+        size_t head = 0, tail = 0;
+        ivec3 cam_b, cam_c;
+        ssize_t idx;
+
+        g->walked = 0;
+
+        for (int i = 0; i < NR_VEC3_ATTR; ++i)
+                cam_b[i] = (int)floorf(camera[i] / (float)BLOCK_EDGE_LEN_GLUNIT);
+
+        block_in_chunk(cam_b, w->chunk_length, cam_c);
+
+        if (linklist_is_empty(w->chunks) || chunk_grid_update(w, cam_c))
+                return;
+
+        if (++g->stamp == 1)
+                memzero(g->visit, sizeof(uint32_t) * g->dom_cells);
+
+        idx = chunk_grid_index(g, cam_c);
+        g->visit[idx] = g->stamp;
+        g->queue[tail++] = (chunk_visit){
+                .origin = { cam_c[X], cam_c[Y], cam_c[Z] },
+                .from = NR_CUBE_FACES,
+        };
+
+        while (head < tail) {
+                chunk_visit *cur = &g->queue[head++];
+                uint64_t links;
+
+                links = chunk_grid_links(g, chunk_grid_index(g, cur->origin));
+
+                for (int f = 0; f < NR_CUBE_FACES; ++f) {
+                        chunk_visit *next;
+                        vec3 box[2];
+                        ivec3 o;
+
+                        // Never step back against a direction taken already
+                        if (cur->dirs & (1U << cube_face_opposite(f)))
+                                continue;
+
+                        if (cur->from != NR_CUBE_FACES &&
+                            !(links & CHUNK_LINK(cur->from, f)))
+                                continue;
+
+                        for (int i = 0; i < NR_VEC3_ATTR; ++i)
+                                o[i] = cur->origin[i] + block_normals[f][i];
+
+                        idx = chunk_grid_index(g, o);
+                        if (idx < 0 || g->visit[idx] == g->stamp)
+                                continue;
+
+                        chunk_aabb_gl(o, w->chunk_length, box);
+                        if (!glm_aabb_frustum(box, planes))
+                                continue;
+
+                        g->visit[idx] = g->stamp;
+
+                        next = &g->queue[tail++];
+                        memcpy(next->origin, o, sizeof(ivec3));
+                        next->from = (uint8_t)cube_face_opposite(f);
+                        next->dirs = cur->dirs | (uint8_t)(1U << f);
+                }
+        }
+
+        g->walked = 1;
+}
+
+static inline int world_cave_reached(world *w, chunk *c)
+{
+        chunk_grid *g = &w->grid;
+
+        if (!g->walked)
+                return 1;
+
+        return g->visit[chunk_grid_index(g, c->origin_l)] == g->stamp;
+}
+
+/**
+ * chunk_mesh_ranges_visible() - collect face direction ranges to draw
+ *
+ * A face direction is rejected as a whole, if chunk AABB corner nearest
+ * along its normal is already a back face to camera, then every face of
+ * that direction inside chunk is back face too.
+ *
+ * @param m: pointer to uploaded mesh
+ * @param box: chunk AABB from chunk_aabb_gl(), chunk 0 is larger
+ * @param camera: camera position
+ * @param counts: output index counts
+ * @param offsets: output index byte offsets
+ * @return ranges count, adjacent ranges are merged
+ */
+static GLsizei chunk_mesh_ranges_visible(chunk_mesh *m, vec3 box[2], vec3 camera,
+                                         GLsizei *counts, void **offsets)
+{
+        GLsizei n = 0;
+        GLsizei next = -1;
+
+        for (int i = 0; i < NR_CUBE_FACES; ++i) {
+                vec3 normal = { 0 };
+                vec3 corner = { 0 };
+
+                if (!m->face_count[i])
+                        continue;
+
+                for (int j = 0; j < NR_VEC3_ATTR; ++j) {
+                        normal[j] = (float)block_normals[i][j];
+
+                        // Corner minimizing dot(corner, normal)
+                        corner[j] = block_normals[i][j] < 0 ? box[1][j] : box[0][j];
+                }
+
+                if (face_is_back_face(corner, normal, camera))
+                        continue;
+
+                if (n > 0 && next == m->face_first[i]) {
+                        counts[n - 1] += m->face_count[i];
+                } else {
+                        counts[n] = m->face_count[i];
+                        offsets[n] = (void *)(sizeof(uint32_t) * m->face_first[i]);
+                        n++;
+                }
+
+                next = m->face_first[i] + m->face_count[i];
+        }
+
+        return n;
+}
+
+/**
+ * chunk_draw() - submit draw call of one chunk
+ *
+ * Program, frame uniforms and texture are bound by caller already, only
+ * mesh VAO and chunk offset change here. Offset attribute is disabled
+ * in mesh VAOs outside multi-draws, so its constant value is read.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param m: mesh of chunk to draw, full one or a coarser level
+ * @param camera: position of camera
+ * @param vao: VAO currently bound, updated
+ * @return 0 on success
+ */
+static int chunk_draw(world *w, chunk *c, chunk_mesh *m, vec3 camera, GLuint *vao)
+{
+        GLsizei counts[NR_CUBE_FACES];
+        void *offsets[NR_CUBE_FACES];
+        GLint base[NR_CUBE_FACES];
+        GLsizei nr_ranges;
+        GLuint m_vao;
+        vec3 offset;
+        vec3 box[2];
+
+        if (pthread_rwlock_tryrdlock(&c->rwlock_gl))
+                return 0;
+
+        chunk_origin_gl_base(c, w->chunk_length, offset);
+        chunk_aabb_gl(c->origin_l, w->chunk_length, box);
+
+        nr_ranges = chunk_mesh_ranges_visible(m, box, camera, counts, offsets);
+        if (!nr_ranges)
+                goto unlock;
+
+        // Arena meshes index from their own range start
+        for (GLsizei i = 0; i < nr_ranges; ++i) {
+                offsets[i] = (uint8_t *)offsets[i] +
+                             sizeof(uint32_t) * m->index_range.first;
+                base[i] = (GLint)m->vertex_range.first;
+        }
+
+        m_vao = chunk_mesh_vao(m);
+        if (*vao != m_vao) {
+                glBindVertexArray(m_vao);
+                *vao = m_vao;
+                w->draw_stats.vao_binds++;
+        }
+
+        glVertexAttrib3fv(GL_VBO_OFFSET_ATTR, &offset[0]);
+
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, counts, GL_UNSIGNED_INT,
+                                      (const void *const *)offsets,
+                                      nr_ranges, base);
+
+        w->draw_stats.draw_calls++;
+        w->draw_stats.drawn++;
+
+unlock:
+        pthread_rwlock_unlock(&c->rwlock_gl);
+
+        return 0;
+}
+
+/**
+ * chunk_draw_cmds() - queue indirect draws of one arena chunk
+ *
+ * One command per visible face range, issued later with other chunks
+ * of same program and texel by world_draw_cmds_flush().
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param m: arena mesh of chunk to draw, full one or a coarser level
+ * @param camera: position of camera
+ * @return 0 on success
+ */
+static int chunk_draw_cmds(world *w, chunk *c, chunk_mesh *m, vec3 camera)
+{
+        GLsizei counts[NR_CUBE_FACES];
+        void *offsets[NR_CUBE_FACES];
+        GLsizei nr_ranges;
+        gl_draw_cmd cmd = { .instance_count = 1 };
+        vec3 box[2];
+
+        if (pthread_rwlock_tryrdlock(&c->rwlock_gl))
+                return 0;
+
+        chunk_origin_gl_base(c, w->chunk_length, cmd.offset);
+        chunk_aabb_gl(c->origin_l, w->chunk_length, box);
+
+        nr_ranges = chunk_mesh_ranges_visible(m, box, camera, counts, offsets);
+        if (!nr_ranges)
+                goto unlock;
+
+        for (GLsizei i = 0; i < nr_ranges; ++i) {
+                cmd.count = (GLuint)counts[i];
+                cmd.first_index = (GLuint)(m->index_range.first +
+                                           (uintptr_t)offsets[i] / sizeof(uint32_t));
+                cmd.base_vertex = (GLint)m->vertex_range.first;
+
+                seqlist_append(&w->draw_cmds, &cmd);
+        }
+
+        w->draw_stats.drawn++;
+        w->draw_stats.multi_drawn++;
+
+unlock:
+        pthread_rwlock_unlock(&c->rwlock_gl);
+
+        return 0;
+}
+
+/**
+ * world_draw_cmds_inline() - issue queued commands one by one
+ *
+ * Fallback if commands could not be streamed, offsets are set as
+ * constant attribute value like chunk_draw() does.
+ *
+ * @param w: pointer to world
+ * @param cmds: commands to issue
+ * @param n: commands count
+ */
+static void world_draw_cmds_inline(world *w, gl_draw_cmd *cmds, size_t n)
+{
+        for (size_t i = 0; i < n; ++i) {
+                glVertexAttrib3fv(GL_VBO_OFFSET_ATTR, &cmds[i].offset[0]);
+                glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)cmds[i].count,
+                                         GL_UNSIGNED_INT,
+                                         (void *)(sizeof(uint32_t) *
+                                                  (uintptr_t)cmds[i].first_index),
+                                         cmds[i].base_vertex);
+
+                w->draw_stats.draw_calls++;
+        }
+}
+
+/**
+ * world_draw_cmds_flush() - issue queued arena chunk draws
+ *
+ * Commands go through stream ring in slices of WORLD_DRAW_CMDS_MAX,
+ * each slice is one multi-draw. Same buffer feeds chunk offsets to the
+ * arena VAO as instanced attribute, which is disabled again afterwards
+ * for chunk_draw().
+ *
+ * @param w: pointer to world
+ * @param vao: VAO currently bound, updated
+ */
+static void world_draw_cmds_flush(world *w, GLuint *vao)
+{
+        gl_draw_cmd *cmds = w->draw_cmds.data;
+        size_t n = w->draw_cmds.count_utilized;
+        GLuint buffer = gl_stream_buffer();
+
+        if (!n)
+                return;
+
+        if (*vao != w->arena.vao) {
+                glBindVertexArray(w->arena.vao);
+                *vao = w->arena.vao;
+                w->draw_stats.vao_binds++;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+        glEnableVertexAttribArray(GL_VBO_OFFSET_ATTR);
+        glVertexAttribDivisor(GL_VBO_OFFSET_ATTR, 1);
+
+        for (size_t i = 0; i < n; i += WORLD_DRAW_CMDS_MAX) {
+                size_t k = n - i < WORLD_DRAW_CMDS_MAX ? n - i : WORLD_DRAW_CMDS_MAX;
+                GLintptr offset;
+
+                for (size_t j = 0; j < k; ++j)
+                        cmds[i + j].base_instance = (GLuint)j;
+
+                if (gl_stream_write(&cmds[i], k * sizeof(gl_draw_cmd), &offset)) {
+                        pr_err_func("failed to stream draw commands\n");
+
+                        glDisableVertexAttribArray(GL_VBO_OFFSET_ATTR);
+                        world_draw_cmds_inline(w, &cmds[i], n - i);
+                        goto out;
+                }
+
+                glVertexAttribPointer(GL_VBO_OFFSET_ATTR, 3, GL_FLOAT, GL_FALSE,
+                                      sizeof(gl_draw_cmd),
+                                      (void *)(offset + offsetof(gl_draw_cmd, offset)));
+
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                            (void *)offset, (GLsizei)k,
+                                            sizeof(gl_draw_cmd));
+
+                w->draw_stats.draw_calls++;
+                w->draw_stats.multi_draws++;
+        }
+
+        glDisableVertexAttribArray(GL_VBO_OFFSET_ATTR);
+
+out:
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, GL_BUFFER_NONE);
+        glBindBuffer(GL_ARRAY_BUFFER, GL_BUFFER_NONE);
+
+        w->draw_cmds.count_utilized = 0;
+}
+
+static int chunk_draw_cmp(const void *a, const void *b)
+{
+        const chunk_draw_item *ia = a;
+        const chunk_draw_item *ib = b;
+        const gl_attr *x = &ia->m->glattr;
+        const gl_attr *y = &ib->m->glattr;
+        GLuint vx = chunk_mesh_vao(ia->m);
+        GLuint vy = chunk_mesh_vao(ib->m);
+
+        if (x->program != y->program)
+                return x->program < y->program ? -1 : 1;
+
+        if (x->texel != y->texel)
+                return x->texel < y->texel ? -1 : 1;
+
+        // Front to back, near chunks fill depth first for early Z
+        if (ia->dist != ib->dist)
+                return ia->dist < ib->dist ? -1 : 1;
+
+        if (vx != vy)
+                return vx < vy ? -1 : 1;
+
+        return 0;
+}
+
+/**
+ * world_overdraw_begin() - count samples passed by chunk draws
+ *
+ * Result of the query issued two frames ago is collected first, it is
+ * ready by then on most drivers, so measuring barely stalls.
+ *
+ * @param w: pointer to world
+ */
+static void world_overdraw_begin(world *w)
+{
+        world_draw_stats *st = &w->draw_stats;
+        int slot = w->overdraw_frame & 1;
+        GLint viewport[4];
+        GLint samples;
+
+        if (w->overdraw_pending[slot]) {
+                GLuint64 passed;
+
+                glGetQueryObjectui64v(w->overdraw_query[slot], GL_QUERY_RESULT,
+                                      &passed);
+
+                st->overdraw_frames++;
+                st->overdraw_samples += passed;
+                st->overdraw_pixels += w->overdraw_pixels[slot];
+        }
+
+        // Multisampled target counts every covered sample
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_SAMPLES, &samples);
+
+        w->overdraw_pixels[slot] = (uint64_t)viewport[2] * (uint64_t)viewport[3] *
+                                   (uint64_t)(samples > 0 ? samples : 1);
+
+        glBeginQuery(GL_SAMPLES_PASSED, w->overdraw_query[slot]);
+}
+
+static void world_overdraw_end(world *w)
+{
+        glEndQuery(GL_SAMPLES_PASSED);
+
+        w->overdraw_pending[w->overdraw_frame & 1] = 1;
+        w->overdraw_frame++;
+}
+
+/**
+ * chunk_occlusion_test() - check chunk was found hidden by its query
+ *
+ * Finished results are read without waiting. Chunk whose query is still
+ * in flight is drawn on it by conditional render, GPU skips the draw if
+ * result is ready and hidden by then. Hidden chunks are queried again
+ * every frame, visible ones every WORLD_OCCLUSION_RETEST frames. Chunk
+ * which was culled earlier missed its retests, result older than that
+ * is dropped, chunk is drawn and queried again.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk passing frustum and cave culling
+ * @param dist2: squared distance from camera to chunk AABB
+ * @param cond: output query to draw on, 0 for unconditional draw
+ * @return 1 if chunk is hidden, 0 to draw it
+ */
+static int chunk_occlusion_test(world *w, chunk *c, float dist2, GLuint *cond)
+{
+        world_draw_stats *st = &w->draw_stats;
+        uint32_t phase;
+        int stale;
+
+        *cond = 0;
+
+        stale = (c->occl_query && st->frames - c->occl_frame > WORLD_OCCLUSION_RETEST);
+        if (stale) {
+                c->occl_pending = 0;
+                c->occl_hidden = 0;
+        }
+
+        if (c->occl_pending) {
+                GLuint ready = 0;
+                GLuint passed = 0;
+
+                glGetQueryObjectuiv(c->occl_query, GL_QUERY_RESULT_AVAILABLE, &ready);
+                if (ready) {
+                        glGetQueryObjectuiv(c->occl_query, GL_QUERY_RESULT, &passed);
+                        c->occl_pending = 0;
+                        c->occl_hidden = !passed;
+                }
+        }
 
-        chunk_vertices_alloc(c);
-        chunk_vertices_pack(c);
+        if (dist2 < WORLD_OCCLUSION_NEAR * WORLD_OCCLUSION_NEAR) {
+                c->occl_hidden = 0;
+                return 0;
+        }
 
-        gl_vbo_init(&c->glvbo);
-        gl_vbo_index(&c->glvbo, c->vertices->data,
-                     (uint32_t)c->vertices->count_utilized);
+        // Visible chunks retest in different frames by position
+        phase = (uint32_t)(c->origin_l[X] + 2 * c->origin_l[Y] + 3 * c->origin_l[Z]);
 
-        chunk_vertices_free(c);
+        if (!c->occl_pending &&
+            (!c->occl_query || stale || c->occl_hidden ||
+             (st->frames + phase) % WORLD_OCCLUSION_RETEST == 0))
+                seqlist_append(&w->occl_list, &c);
 
-        c->state = CHUNK_NEED_FLUSH;
+        if (c->occl_pending) {
+                *cond = c->occl_query;
+                st->occl_conditional++;
+                return 0;
+        }
 
-unlock:
-        pthread_rwlock_unlock(&c->rwlock);
+        if (c->occl_hidden) {
+                st->occl_skipped++;
+                return 1;
+        }
 
         return 0;
 }
 
-static inline void block_near_origin_get(block *b, int f, ivec3 origin_near)
+/**
+ * world_occlusion_query() - issue box queries of chunks listed this frame
+ *
+ * Runs once chunks are drawn, boxes are tested against depth of this
+ * frame. Color and depth writes are off, boxes only count samples.
+ *
+ * @param w: pointer to world
+ * @param trans: perspective transform matrix
+ */
+static void world_occlusion_query(world *w, mat4 trans)
 {
-        if (!b)
-                return;
+        world_draw_stats *st = &w->draw_stats;
+        chunk **list = w->occl_list.data;
+        size_t n = w->occl_list.count_utilized;
+        gl_attr *glattr = &w->occl_attr;
 
-        // XXX: if BLOCK_EDGE_LEN_GLUNIT != 1, this will be incorrect
-        origin_near[X] += b->origin_l[X] + block_normals[f][X];
-        origin_near[Y] += b->origin_l[Y] + block_normals[f][Y];
-        origin_near[Z] += b->origin_l[Z] + block_normals[f][Z];
-}
+        if (!n)
+                return;
 
-int chunk_cull_blocks(chunk *c, world *w)
-{
-        linklist_node *pos;
+        glUseProgram(glattr->program);
+        glUniformMatrix4fv(glattr->mat_transform, 1, GL_FALSE, &trans[0][0]);
 
-        if (!c)
-                return -EINVAL;
+        glBindVertexArray(w->occl_vao);
 
-        pthread_rwlock_rdlock(&c->rwlock);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
 
-        linklist_for_each_node(pos, c->blocks->head) {
-                block *b = pos->data;
+        for (size_t i = 0; i < n; ++i) {
+                chunk *c = list[i];
+                vec3 box[2];
+                vec3 size;
 
-                for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
-                        block_face *f = &(b->model.faces[i]);
-                        block_model *m = &b->model;
-                        ivec3 o_near = { 0 };
-                        block *b_near;
+                if (!c->occl_query)
+                        glGenQueries(1, &c->occl_query);
 
-                        block_near_origin_get(b, i, o_near);
-                        b_near = __world_get_block(w, o_near, L_NOWAIT, 1);
+                chunk_aabb_gl(c->origin_l, w->chunk_length, box);
 
-                        if (!b_near) {
-                                if (!f->visible) {
-                                        f->visible = 1;
-                                        block_model_face_init(f);
-                                        block_model_face_generate(f, m, b->blk_attr, 1.0, i);
-                                }
-                        } else {
-                                if (f->visible) {
-                                        f->visible = 0;
-                                        block_model_face_deinit(f);
-                                }
-                        }
+                for (int j = 0; j < NR_VEC3_ATTR; ++j) {
+                        box[0][j] -= WORLD_OCCLUSION_MARGIN;
+                        size[j] = box[1][j] - box[0][j] + WORLD_OCCLUSION_MARGIN;
                 }
+
+                glUniform3fv(glattr->uniform_1, 1, &box[0][0]);
+                glUniform3fv(glattr->uniform_2, 1, &size[0]);
+
+                glBeginQuery(GL_ANY_SAMPLES_PASSED, c->occl_query);
+                glDrawArrays(GL_TRIANGLES, 0, glattr->vertex_count);
+                glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+                c->occl_pending = 1;
+                c->occl_frame = st->frames;
+                st->occl_queries++;
         }
 
-        pthread_rwlock_unlock(&c->rwlock);
+        glDepthMask(GL_TRUE);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
-        return 0;
+        glUseProgram(GL_PROGRAM_NONE);
+
+        w->occl_list.count_utilized = 0;
 }
 
-void *chunk_update_worker(void *data)
+/**
+ * world_draw_list() - submit visible chunks sorted by GL state
+ *
+ * Program and frame uniforms are set once per program, texture once
+ * per texel, so chunk draws only switch VAO and offset. Meshes in arena
+ * share one VAO, so those are bound once too. Within same state chunks
+ * go front to back.
+ *
+ * With multi-draw, arena chunks of a program and texel run are one
+ * indirect draw. Chunks drawn on a pending occlusion query and meshes
+ * in own buffers still draw one by one.
+ *
+ * @param w: pointer to world
+ * @param camera: position of camera
+ * @param trans: perspective transform matrix
+ */
+static void world_draw_list(world *w, vec3 camera, mat4 trans)
 {
-        typedef struct {
-                world *w;
-                chunk *c;
-        } thread_arg;
+        world_draw_stats *st = &w->draw_stats;
+        chunk_draw_item *list = w->draw_list.data;
+        size_t n = w->draw_list.count_utilized;
+        GLuint program = GL_PROGRAM_NONE;
+        GLuint texel = GL_TEXTURE_NONE;
+        GLuint vao = 0;
+        int batch;
+
+        if (!n)
+                return;
 
-        world *w = ((thread_arg *)data)->w;
-        chunk *c = ((thread_arg *)data)->c;
+        // Stream ring carries commands and offsets
+        batch = w->multi_draw && gl_stream_buffer() != GL_BUFFER_NONE;
 
-        // Thread arg is on heap, free it
-        memfree(&data);
+        qsort(list, n, sizeof(chunk_draw_item), chunk_draw_cmp);
 
-        pr_info_func("chunk (%d, %d, %d)\n",
-                      c->origin_l[X], c->origin_l[Y], c->origin_l[Z]);
+        if (w->overdraw_query[0])
+                world_overdraw_begin(w);
 
-        chunk_cull_blocks(c, w);
-        chunk_update(c);
+        for (size_t i = 0; i < n; ++i) {
+                gl_attr *glattr = &list[i].m->glattr;
 
-        return NULL;
-}
+                // Queued draws need state they were queued under
+                if (glattr->program != program ||
+                    (glattr->texel != texel && glattr->texel != GL_TEXTURE_NONE))
+                        world_draw_cmds_flush(w, &vao);
 
-int world_update_chunks(world *w, int detach)
-{
-        typedef struct {
-                world *w;
-                chunk *c;
-        } thread_arg;
+                if (glattr->program != program) {
+                        program = glattr->program;
 
-        linklist chunk_workers;
-        linklist_node *pos;
+                        glUseProgram(program);
 
-        if (!w)
-                return -EINVAL;
+                        glUniform1f(glattr->uniform_1, w->fog_distance);
+                        glUniform4fv(glattr->uniform_2, 1, &w->fog_color[0]);
+                        glUniform3fv(glattr->camera, 1, &camera[0]);
+                        glUniformMatrix4fv(glattr->mat_transform, 1, GL_FALSE,
+                                           &trans[0][0]);
+                        glUniform1i(glattr->sampler, 0);
 
-        linklist_init(&chunk_workers, sizeof(pthread_t));
+                        st->program_binds++;
+                }
 
-        linklist_for_each_node(pos, w->chunks->head) {
-                chunk *c = pos->data;
+                if (glattr->texel != texel && glattr->texel != GL_TEXTURE_NONE) {
+                        texel = glattr->texel;
 
-                pthread_rwlock_wrlock(&c->rwlock);
+                        glActiveTexture(GL_TEXTURE0);
+                        glBindTexture(GL_TEXTURE_2D, texel);
 
-                if (c->state != CHUNK_NEED_UPDATE) {
-                        pthread_rwlock_unlock(&c->rwlock);
-                        continue;
+                        st->texture_binds++;
                 }
 
-                c->state = CHUNK_SCHED_UPDATE;
-                pthread_rwlock_unlock(&c->rwlock);
-
-                thread_arg *arg = memalloc(sizeof(thread_arg));
+                if (batch && list[i].m->arena && !list[i].cond) {
+                        chunk_draw_cmds(w, list[i].c, list[i].m, camera);
+                        continue;
+                }
 
-                arg->w = w;
-                arg->c = c;
+                if (list[i].cond)
+                        glBeginConditionalRender(list[i].cond, GL_QUERY_NO_WAIT);
 
-                if (detach) {
-                        pthread_create_detached(chunk_update_worker, arg);
-                } else {
-                        pthread_t t = pthread_create_joinable(chunk_update_worker, arg);
-                        linklist_append(&chunk_workers, &t);
-                }
+                chunk_draw(w, list[i].c, list[i].m, camera, &vao);
 
+                if (list[i].cond)
+                        glEndConditionalRender();
         }
 
-        // Block and wait for all workers to finish
-        if (!detach) {
-                linklist_for_each_node(pos, chunk_workers.head) {
-                        pthread_t *t = (pthread_t *)pos->data;
-                        pthread_join(*t, NULL);
-                }
-        }
+        world_draw_cmds_flush(w, &vao);
 
-        linklist_deinit(&chunk_workers);
+        if (w->overdraw_query[0])
+                world_overdraw_end(w);
 
-        return 0;
+        glUseProgram(GL_PROGRAM_NONE);
+
+        w->draw_list.count_utilized = 0;
 }
 
-void *world_chunks_worker(void *data)
+/**
+ * chunk_lod_select() - pick detail level of chunk by camera distance
+ *
+ * Level i starts at lod distance * 2^(i - 1). Once picked, a level is
+ * kept until distance leaves its range by hysteresis, so chunks near a
+ * threshold do not flip level every frame while camera sways.
+ *
+ * @param w: pointer to world
+ * @param c: pointer to chunk
+ * @param dist2: squared distance from camera to chunk AABB
+ * @return level to draw
+ */
+static int chunk_lod_select(world *w, chunk *c, float dist2)
 {
-        world *w = data;
-        int pending;
-
-        while (1) {
-                pthread_spin_lock(&w->update_spin);
-                pending = w->update_pending;
-                pthread_spin_unlock(&w->update_spin);
-
-                // If we have no work pending, sleep and wait for signal
-                if (pending == 0) {
-                        pthread_cond_wait(&w->update_cond, &w->update_mutex);
-                        pthread_mutex_unlock(&w->update_mutex);
-                }
-
-                if (g_program->state == PROGRAM_EXIT)
-                        break;
+        float dist = sqrtf(dist2);
+        float t = w->lod_distance;
+        int lod = 0;
 
-                world_update_chunks(w, 1);
+        if (t <= 0.0f) {
+                c->lod = 0;
+                return 0;
+        }
 
-                pthread_spin_lock(&w->update_spin);
-                if (w->update_pending > 0)
-                        w->update_pending--;
-                pthread_spin_unlock(&w->update_spin);
+        for (int i = 1; i < MESH_LODS; ++i, t *= 2.0f) {
+                // Stay coarse until clearly nearer, go coarse once clearly farther
+                if (c->lod >= i ? dist > t - w->lod_hysteresis :
+                                  dist > t + w->lod_hysteresis)
+                        lod = i;
         }
 
-        pthread_exit(NULL);
+        if (lod != c->lod) {
+                c->lod = lod;
+                w->draw_stats.lod_switches++;
+        }
 
-        return NULL;
+        return lod;
 }
 
 /**
- * world_update_trigger() - try to wake up chunk update thread
+ * world_draw_chunk() - draw world by VBO indexed chunks
  *
- * @param w: pointer to world
- * @return
+ * Chunk AABB is tested against view frustum first, chunks out of view
+ * cost no GL call at all. Chunks cave walk did not reach are hidden,
+ * so are chunks whose occlusion query passed no sample. Far chunks draw
+ * a coarser mesh level.
+ *
+ * @param w: pointer to world container
+ * @param camera: position of camera
+ * @param trans: perspective transform matrix
+ * @return 0 on success
  */
-int world_update_trigger(world *w)
+int world_draw_chunks(world *w, vec3 camera, mat4 trans)
 {
+        world_draw_stats *st;
+        linklist_node *pos;
+        GLint vao_prev;
+        vec4 planes[6];
+
         if (!w)
                 return -EINVAL;
 
-        pthread_spin_lock(&w->update_spin);
-        w->update_pending++;
-        pthread_spin_unlock(&w->update_spin);
+        st = &w->draw_stats;
 
-        pthread_mutex_lock(&w->update_mutex);
-        pthread_cond_signal(&w->update_cond);
-        pthread_mutex_unlock(&w->update_mutex);
+        // Other renderers bind attributes into the shared VAO
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao_prev);
 
-        return 0;
-}
+        world_view_update(w, camera, trans);
 
-void chunk_gl_attr_free(chunk *c)
-{
-        gl_attr_buffer_delete(&c->glattr);
-        memzero(&c->glattr, sizeof(gl_attr));
-}
+        world_flush_chunks(w);
 
-int chunk_gl_attr_generate(gl_attr *glattr, block_attr *blk_dummy)
-{
-        int ret;
+        glm_frustum_planes(trans, planes);
 
-        if (!glattr)
-                return -EINVAL;
+        world_cave_walk(w, camera, planes);
 
-        glattr->program = block_shader_get(blk_dummy->shader);
-        ret  = glIsProgram(glattr->program);
-        if (ret == GL_FALSE) {
-                pr_err_func("invalid shader program\n");
-                return -EFAULT;
-        }
+        linklist_for_each_node(pos, w->chunks->head) {
+                chunk_draw_item item = { .c = pos->data };
+                chunk *c = item.c;
+                vec3 box[2];
+                int lod;
 
-        ret = glIsTexture(blk_dummy->texel.texel);
-        if (ret == GL_FALSE) {
-                pr_err_func("invalid texture object\n");
-                return -EFAULT;
-        } else {
-                glattr->texel = blk_dummy->texel.texel;
-        }
+                // Render thread owns c->mesh, nothing to draw yet
+                if (!c->mesh)
+                        continue;
 
-        glattr->camera = glGetUniformLocation(glattr->program, "camera");
-        glattr->sampler = glGetUniformLocation(glattr->program, "sampler");
-        glattr->mat_transform = glGetUniformLocation(glattr->program, "mat_transform");
-        glattr->uniform_1 = glGetUniformLocation(glattr->program, "fog_distance");
-        glattr->uniform_2 = glGetUniformLocation(glattr->program, "fog_color");
+                st->tested++;
 
-        return 0;
-}
+                chunk_aabb_gl(c->origin_l, w->chunk_length, box);
+                if (!glm_aabb_frustum(box, planes)) {
+                        st->culled++;
+                        continue;
+                }
 
-int chunk_gl_attr_buffer_create(chunk *c)
-{
-        int ret;
+                if (!world_cave_reached(w, c)) {
+                        st->occluded++;
+                        continue;
+                }
 
-        ret = gl_vbo_buffer_create(&c->glvbo, &c->glattr);
-        if (ret == GL_FALSE)
-                pr_err_func("failed to generate chunk VBO\n");
+                item.dist = chunk_aabb_dist2(box, camera);
+                lod = chunk_lod_select(w, c, item.dist);
+                item.m = chunk_mesh_lod(c->mesh, &lod);
 
-        return ret;
-}
+                // Chunk may have no visible face at all
+                if (!item.m->glattr.vertex_count)
+                        continue;
 
-int chunk_gl_data_generate(chunk *c)
-{
-        if (!c)
-                return -EINVAL;
+                if (w->occlusion && chunk_occlusion_test(w, c, item.dist, &item.cond))
+                        continue;
 
-        chunk_gl_attr_generate(&c->glattr, block_attr_get(BLOCK_DUMMY));
-        chunk_gl_attr_buffer_create(c);
+                st->lod_drawn[lod]++;
 
-        gl_vbo_deinit(&c->glvbo);
+                if (w->draw_unsorted)
+                        item.dist = 0.0f;
 
-        return 0;
-}
+                seqlist_append(&w->draw_list, &item);
+        }
 
-int chunk_flush(chunk *c)
-{
-        if (unlikely(!c))
-                return -EINVAL;
+        world_draw_list(w, camera, trans);
 
-        if (pthread_rwlock_trywrlock(&c->rwlock))
-                goto out;
+        if (w->occlusion)
+                world_occlusion_query(w, trans);
 
-        if (c->state != CHUNK_NEED_FLUSH)
-                goto unlock;
+        glBindVertexArray((GLuint)vao_prev);
 
-        c->state = CHUNK_FLUSHING;
+        st->frames++;
 
-        pr_info_func("chunk (%d, %d, %d)\n",
-                     c->origin_l[X], c->origin_l[Y], c->origin_l[Z]);
+        mesh_cache_trim(&w->meshes);
 
-        // Since we gonna call draw call in the same thread
-        // There is no point to grab rwlock_gl
-        chunk_gl_attr_free(c);
-        chunk_gl_data_generate(c);
+        // After trim, ranges it freed wait for draws of this frame
+        mesh_arena_fence(&w->arena);
 
-        c->state = CHUNK_FLUSHED;
+        // Block versions retired by edits since last frame
+        epoch_reclaim();
 
-unlock:
-        pthread_rwlock_unlock(&c->rwlock);
+        world_update_frame_end(w);
 
-out:
         return 0;
 }
 
-int chunk_draw(world *w, chunk *c, vec3 camera, mat4 trans)
+/**
+ * world_stats_dump() - print chunk pipeline counters
+ *
+ * @param w: pointer to world
+ */
+void world_stats_dump(world *w)
 {
-        gl_attr *glattr;
+        job_stage_stats sstats[NR_CHUNK_STAGES];
+        world_upload_stats ustats;
+        world_draw_stats dstats;
+        world_update_stats tstats;
+        world_async_stats astats;
+        gl_arena_stats avstats, aistats;
+        mesh_cache_stats mstats;
+        gl_stream_stats gstats;
+        gl_vbo_stats vstats;
+        uint64_t legacy;
+        size_t nr_vfree = 0;
+        size_t nr_ifree = 0;
+        double frames;
 
-        if (unlikely(!c))
-                return -EINVAL;
+        if (!w)
+                return;
 
-        if (pthread_rwlock_tryrdlock(&c->rwlock_gl))
-                goto out;
+        pthread_mutex_lock(&w->meshes.lock);
+        memcpy(&mstats, &w->meshes.stats, sizeof(mesh_cache_stats));
+        pthread_mutex_unlock(&w->meshes.lock);
 
-        glattr = &c->glattr;
+        gl_vbo_stats_get(&vstats);
+        gl_stream_stats_get(&gstats);
 
-        // Validate gl buffer is generated or not
-        // GL attr is generated during chunk flushing
-        if (!glattr->vertex_count)
-                goto unlock;
+        memzero(&avstats, sizeof(avstats));
+        memzero(&aistats, sizeof(aistats));
+        if (w->arena.vao) {
+                gl_arena_stats_get(&w->arena.vertices, &avstats, &nr_vfree);
+                gl_arena_stats_get(&w->arena.indices, &aistats, &nr_ifree);
+        }
 
-        glUseProgram(GL_PROGRAM_NONE);
+        // Written by render thread, which is the caller
+        memcpy(&ustats, &w->upload_stats, sizeof(world_upload_stats));
+        memcpy(&dstats, &w->draw_stats, sizeof(world_draw_stats));
 
-        glUseProgram(glattr->program);
+        pthread_mutex_lock(&w->stage_lock);
+        memcpy(sstats, w->stage_stats, sizeof(sstats));
+        pthread_mutex_unlock(&w->stage_lock);
 
-        glUniform1f(glattr->uniform_1, w->fog_distance);
-        glUniform4fv(glattr->uniform_2, 1, &w->fog_color[0]);
-        glUniform3fv(glattr->camera, 1, &camera[0]);
-        glUniformMatrix4fv(glattr->mat_transform, 1, GL_FALSE, &trans[0][0]);
+        pthread_mutex_lock(&w->update_mutex);
+        memcpy(&tstats, &w->update_stats, sizeof(world_update_stats));
+        pthread_mutex_unlock(&w->update_mutex);
 
-        if (glattr->texel != GL_TEXTURE_NONE) {
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, glattr->texel);
-                glUniform1i(glattr->sampler, 0);
+        pthread_mutex_lock(&w->upload_mutex);
+        memcpy(&astats, &w->async_stats, sizeof(world_async_stats));
+        pthread_mutex_unlock(&w->upload_mutex);
+
+        pr_info("mesh cache: %" PRIu64 " hits %" PRIu64 " misses %" PRIu64
+                " evictions %" PRIu64 " meshes %" PRIu64 " idle\n",
+                mstats.hits, mstats.misses, mstats.evictions,
+                mstats.meshes, mstats.idle);
+        pr_info("mesh data: %" PRIu64 " bytes written by CPU %" PRIu64
+                " bytes uploaded (%.2f CPU copies)\n",
+                vstats.bytes_copied, vstats.bytes_uploaded,
+                vstats.bytes_uploaded ?
+                (double)vstats.bytes_copied / (double)vstats.bytes_uploaded : 0.0);
+
+        legacy = 0;
+        for (int i = 0; i < NR_GL_VBO_LEGACY_STAGES; ++i)
+                legacy += vstats.bytes_legacy[i];
+
+        pr_info("mesh data old path: %" PRIu64 " pack %" PRIu64 " index %" PRIu64
+                " copy %" PRIu64 " split, %" PRIu64 " bytes (%.2f CPU copies)\n",
+                vstats.bytes_legacy[GL_VBO_LEGACY_PACK],
+                vstats.bytes_legacy[GL_VBO_LEGACY_INDEX],
+                vstats.bytes_legacy[GL_VBO_LEGACY_COPY],
+                vstats.bytes_legacy[GL_VBO_LEGACY_SPLIT], legacy,
+                vstats.bytes_uploaded ?
+                (double)legacy / (double)vstats.bytes_uploaded : 0.0);
+        pr_info("mesh arena: %zu/%zu vertices (peak %zu, %zu holes) %zu/%zu indices"
+                " (peak %zu, %zu holes) %" PRIu64 " full, %" PRIu64 " fallbacks,"
+                " %zu/%zu retired %" PRIu64 " fence waits\n",
+                avstats.used, w->arena.vertices.capacity, avstats.peak, nr_vfree,
+                aistats.used, w->arena.indices.capacity, aistats.peak, nr_ifree,
+                avstats.fails + aistats.fails,
+                (uint64_t)atomic_load(&w->arena.fallbacks),
+                avstats.retired, aistats.retired,
+                avstats.fence_waits + aistats.fence_waits);
+        pr_info("stream ring: %s, %" PRIu64 " writes %" PRIu64 " bytes %" PRIu64
+                " wraps, %" PRIu64 " fence waits %.3f ms total\n",
+                gstats.persistent ? "persistent" : "orphaned",
+                gstats.writes, gstats.bytes, gstats.wraps, gstats.fence_waits,
+                SEC_TO_MS(gstats.fence_wait));
+        pr_info("chunk flush: %" PRIu64 " flushes %" PRIu64 " bytes %" PRIu64
+                " frames deferred %" PRIu64 " stale dropped %zu pending\n",
+                ustats.flushes, ustats.bytes, ustats.frames_deferred,
+                ustats.stale, w->flush_heap.count_utilized);
+        pr_info("chunk rebuild: %" PRIu64 " triggers %" PRIu64 " passes (%" PRIu64
+                " merged) %" PRIu64 " aborted by newer edits\n",
+                tstats.triggers, tstats.passes,
+                tstats.triggers > tstats.passes ? tstats.triggers - tstats.passes : 0,
+                (uint64_t)atomic_load(&w->rebuilds_aborted));
+
+        if (w->upload_window) {
+                pr_info("upload thread: %" PRIu64 " batches %" PRIu64 " meshes %" PRIu64
+                        " bytes, avg fence wait %.3f ms\n",
+                        astats.batches, astats.meshes, astats.bytes,
+                        SEC_TO_MS(astats.fence_wait /
+                                  (astats.batches ? (double)astats.batches : 1.0)));
         }
 
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
-
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex_nrm);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
-
-        glEnableVertexAttribArray(2);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex_uv);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
-
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, glattr->vbo_index);
-        glDrawElements(GL_TRIANGLES, glattr->vertex_count, GL_UNSIGNED_INT, (void *)0);
+        frames = dstats.frames ? (double)dstats.frames : 1.0;
+        pr_info("chunk draw: %" PRIu64 " frames, per frame %.1f tested %.1f culled"
+                " %.1f occluded %.1f drawn\n", dstats.frames,
+                (double)dstats.tested / frames, (double)dstats.culled / frames,
+                (double)dstats.occluded / frames, (double)dstats.drawn / frames);
+        pr_info("chunk draw: per frame %.1f draw calls %.1f program %.1f texture"
+                " %.1f VAO binds\n",
+                (double)dstats.draw_calls / frames,
+                (double)dstats.program_binds / frames,
+                (double)dstats.texture_binds / frames,
+                (double)dstats.vao_binds / frames);
+        pr_info("chunk draw: multi-draw %s, per frame %.1f multi-draws for %.1f"
+                " chunks, %.1f chunks drawn one by one\n",
+                w->multi_draw ? "on" : "off",
+                (double)dstats.multi_draws / frames,
+                (double)dstats.multi_drawn / frames,
+                (double)(dstats.drawn - dstats.multi_drawn) / frames);
+
+        if (dstats.overdraw_frames) {
+                pr_info("chunk overdraw: %" PRIu64 " frames, %s order, %.3f samples"
+                        " passed per pixel\n", dstats.overdraw_frames,
+                        w->draw_unsorted ? "state" : "front to back",
+                        (double)dstats.overdraw_samples /
+                        (double)(dstats.overdraw_pixels ? dstats.overdraw_pixels : 1));
+        }
 
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
+        if (w->lod_distance > 0.0f) {
+                pr_info("chunk lod: first level at %.1f, per frame",
+                        (double)w->lod_distance);
+                for (int i = 0; i < MESH_LODS; ++i)
+                        pr_info(" %.1f", (double)dstats.lod_drawn[i] / frames);
+                pr_info(" drawn by level, %" PRIu64 " switches\n", dstats.lod_switches);
+        }
 
-        glUseProgram(GL_PROGRAM_NONE);
+        if (w->occlusion) {
+                pr_info("chunk occlusion: per frame %.1f queries %.1f hidden"
+                        " %.1f drawn on pending query\n",
+                        (double)dstats.occl_queries / frames,
+                        (double)dstats.occl_skipped / frames,
+                        (double)dstats.occl_conditional / frames);
+        }
 
-unlock:
-        pthread_rwlock_unlock(&c->rwlock_gl);
+        for (int i = 0; i < NR_CHUNK_STAGES; ++i) {
+                job_stage_stats *st = &sstats[i];
+                double n = st->count ? (double)st->count : 1.0;
 
-out:
-        return 0;
+                pr_info("stage %-8s: %" PRIu64 " jobs, avg wait %.3f ms,"
+                        " avg run %.3f ms, max latency %.3f ms\n",
+                        chunk_stage_names[i], st->count,
+                        SEC_TO_MS(st->wait / n), SEC_TO_MS(st->run / n),
+                        SEC_TO_MS(st->latency_max));
+        }
 }
 
 /**
- * world_draw_chunk() - draw world by VBO indexed chunks
+ * world_worker_create() - start world job scheduler and update thread
  *
- * @param w: pointer to world container
- * @param camera: position of camera
- * @param trans: perspective transform matrix
+ * With THREAD_POOL_WORKERS_INLINE no thread is started at all, every
+ * world job runs on render thread in a fixed order, results are same
+ * as threaded mode.
+ *
+ * @param w: pointer to world
+ * @param nr_workers: workers count, THREAD_POOL_WORKERS_AUTO for CPU count
  * @return 0 on success
  */
-int world_draw_chunks(world *w, vec3 camera, mat4 trans)
+int world_worker_create(world *w, int nr_workers)
 {
-        linklist_node *pos;
+        int ret;
 
         if (!w)
                 return -EINVAL;
 
-        linklist_for_each_node(pos, w->chunks->head) {
-                chunk *c = pos->data;
+        ret = work_sched_init(&w->sched, nr_workers);
+        if (ret)
+                return ret;
 
-                chunk_flush(c);
-                chunk_draw(w, c, camera, trans);
+        if (!w->sched.nr_workers) {
+                w->update_inline = 1;
+                return 0;
         }
 
+        w->update_worker = pthread_create_joinable(world_chunks_worker, w);
+
         return 0;
 }
 
-int world_worker_create(world *w)
+/**
+ * world_upload_thread_create() - move mesh uploads off render thread
+ *
+ * Call before chunks are built. Context of shared window must not be
+ * current on any thread, it is taken over until world_deinit().
+ *
+ * @param w: pointer to world
+ * @param shared: hidden window sharing GL objects with render window
+ * @return 0 on success
+ */
+int world_upload_thread_create(world *w, GLFWwindow *shared)
 {
-        if (!w)
+        if (!w || !shared)
                 return -EINVAL;
 
-        w->update_worker = pthread_create_joinable(world_chunks_worker, w);
+        // Would take uploads out of fixed order again
+        if (w->update_inline)
+                return -EINVAL;
+
+        w->upload_window = shared;
+        w->upload_worker = pthread_create_joinable(world_upload_worker, w);
 
         return 0;
 }
 
 int world_init(world *w)
 {
+        pthread_condattr_t cattr;
+
         if (!w)
                 return -EINVAL;
 
@@ -987,6 +4249,8 @@ int world_init(world *w)
         w->height_min = WORLD_HEIGHT_MIN;
 
         w->fog_distance = WORLD_FOG_DISTANCE;
+        w->lod_distance = WORLD_LOD_DISTANCE;
+        w->lod_hysteresis = WORLD_LOD_HYSTERESIS;
         glm_vec4_copy((vec4)WORLD_FOG_COLOR, w->fog_color);
 
         glm_vec4_copy((vec4)WORLD_SKY_COLOR, w->sky_color);
@@ -995,9 +4259,39 @@ int world_init(world *w)
         linklist_alloc(&w->chunks);
         linklist_init(w->chunks, sizeof(chunk));
 
-        pthread_spin_init(&w->update_spin, PTHREAD_PROCESS_PRIVATE);
+        mesh_cache_init(&w->meshes, MESH_CACHE_IDLE_MAX);
+
+        // Meshes fall back to own buffers without it
+        if (mesh_arena_init(&w->arena, WORLD_MESH_ARENA_VERTICES,
+                            WORLD_MESH_ARENA_INDICES))
+                pr_err_func("failed to create mesh arena\n");
+
+        for (int i = 0; i < NR_CHUNK_QUEUES; ++i)
+                atomic_init(&w->queues[i], NULL);
+
+        atomic_init(&w->rebuilds_aborted, 0);
+
+        seqlist_init(&w->flush_heap, sizeof(chunk_prio), 256);
+        seqlist_init(&w->draw_list, sizeof(chunk_draw_item), 256);
+        seqlist_init(&w->draw_cmds, sizeof(gl_draw_cmd), 1024);
+        seqlist_init(&w->occl_list, sizeof(chunk *), 256);
+        pthread_mutex_init(&w->stage_lock, NULL);
+        w->upload_budget_bytes = WORLD_UPLOAD_BUDGET_BYTES;
+        w->upload_budget_us = WORLD_UPLOAD_BUDGET_US;
+
+        w->update_window_us = WORLD_UPDATE_WINDOW_US;
+
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+
         pthread_mutex_init(&w->update_mutex, NULL);
-        pthread_cond_init(&w->update_cond, NULL);
+        pthread_cond_init(&w->update_cond, &cattr);
+        pthread_mutex_init(&w->view_lock, NULL);
+
+        pthread_mutex_init(&w->upload_mutex, NULL);
+        pthread_cond_init(&w->upload_cond, NULL);
+
+        pthread_condattr_destroy(&cattr);
 
         return 0;
 }
@@ -1009,33 +4303,64 @@ int world_deinit(world *w)
         if (!w)
                 return -EINVAL;
 
+        pthread_mutex_lock(&w->update_mutex);
+        w->update_stop = 1;
+        pthread_cond_signal(&w->update_cond);
+        pthread_mutex_unlock(&w->update_mutex);
+
+        if (w->update_worker)
+                pthread_join(w->update_worker, NULL);
+
+        // Update thread was the only one waiting on jobs
+        work_sched_shutdown(&w->sched);
+
+        pthread_mutex_lock(&w->upload_mutex);
+        w->upload_stop = 1;
+        pthread_cond_signal(&w->upload_cond);
+        pthread_mutex_unlock(&w->upload_mutex);
+
+        if (w->upload_worker)
+                pthread_join(w->upload_worker, NULL);
+
+        // Walks chunks to delete their queries
+        world_occlusion_set(w, 0);
+
         linklist_for_each_node(pos, w->chunks->head) {
                 chunk *c = pos->data;
 
-                while (1) {
-                        if (chunk_state_ready(c, 1))
-                                break;
-                }
+                chunk_mesh_pending_set(w, c, NULL);
+                chunk_mesh_upload_set(w, c, NULL);
+
+                if (c->mesh)
+                        mesh_cache_put(&w->meshes, c->mesh);
 
                 chunk_deinit(c);
         }
 
-        linklist_deinit(w->chunks);
-        linklist_free(&w->chunks);
+        // Nobody reads blocks any more, free retired versions now
+        epoch_synchronize();
 
-        pthread_spin_lock(&w->update_spin);
-        if (w->update_pending == 0) {
-                pthread_mutex_lock(&w->update_mutex);
-                pthread_cond_signal(&w->update_cond);
-                pthread_mutex_unlock(&w->update_mutex);
-        }
-        pthread_spin_unlock(&w->update_spin);
+        mesh_cache_deinit(&w->meshes);
 
-        pthread_join(w->update_worker, NULL);
+        // After mesh cache, freed meshes return their ranges
+        mesh_arena_deinit(&w->arena);
+
+        seqlist_deinit(&w->flush_heap);
+        seqlist_deinit(&w->draw_list);
+        seqlist_deinit(&w->draw_cmds);
+        seqlist_deinit(&w->occl_list);
+        world_overdraw_set(w, 0);
+        chunk_grid_deinit(&w->grid);
+
+        linklist_deinit(w->chunks);
+        linklist_free(&w->chunks);
 
-        pthread_mutex_destroy(&w->update_cond);
+        pthread_cond_destroy(&w->update_cond);
         pthread_mutex_destroy(&w->update_mutex);
-        pthread_spin_destroy(&w->update_spin);
+        pthread_mutex_destroy(&w->view_lock);
+        pthread_mutex_destroy(&w->stage_lock);
+        pthread_cond_destroy(&w->upload_cond);
+        pthread_mutex_destroy(&w->upload_mutex);
 
         return 0;
 }
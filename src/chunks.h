@@ -2,11 +2,14 @@
 #define MYCRAFT_DEMO_CHUNKS_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "block.h"
 #include "model.h"
 #include "utils.h"
 #include "glutils.h"
+#include "mesh.h"
+#include "thread.h"
 
 #define WORLD_CLEAR_COLOR               R_G_B_A_2GLSL(160, 192, 214, 255)
 #define WORLD_SKY_COLOR                 WORLD_CLEAR_COLOR
@@ -14,6 +17,17 @@
 #define WORLD_FOG_COLOR                 WORLD_SKY_COLOR
 #define WORLD_FOG_DISTANCE              (64.0f)
 
+// Coarser mesh levels start here, each next one twice as far
+#define WORLD_LOD_DISTANCE              (WORLD_FOG_DISTANCE / 2.0f)
+#define WORLD_LOD_HYSTERESIS            (CHUNK_EDGE_LEN_GLUNIT / 4.0f)
+
+// Chunks found visible by occlusion query are tested again this late
+#define WORLD_OCCLUSION_RETEST          (4)
+// Query box grows so chunk faces on it do not fail depth test
+#define WORLD_OCCLUSION_MARGIN          (BLOCK_EDGE_LEN_GLUNIT / 16.0f)
+// Boxes this close to camera may be clipped by near plane, never hidden
+#define WORLD_OCCLUSION_NEAR            (BLOCK_EDGE_LEN_GLUNIT * 2.0f)
+
 #define WORLD_HEIGHT_MAX                (BLOCK_EDGE_LEN_GLUNIT * 256)
 #define WORLD_HEIGHT_MIN                (0)
 #define WORLD_HEIGHT_AUTO               (-1)
@@ -23,6 +37,39 @@
 
 #define CHUNK_EDGE_LEN_GLUNIT           (BLOCK_EDGE_LEN_GLUNIT * 16)
 
+// Dirty chunks popped per worker before reprioritizing
+#define CHUNK_UPDATE_BATCH              (2)
+
+// Per frame mesh upload budget, 0 for unlimited
+#define WORLD_UPLOAD_BUDGET_BYTES       (4 << 20)
+#define WORLD_UPLOAD_BUDGET_US          (2000)
+
+// Upload thread waits on its fence in slices, so stop is noticed
+#define WORLD_UPLOAD_FENCE_WAIT_NS      (10 * 1000 * 1000)
+
+// Shared mesh storage, meshes not fitting get their own buffers
+#define WORLD_MESH_ARENA_VERTICES       (2 << 20)
+#define WORLD_MESH_ARENA_INDICES        (3 << 20)
+
+// Indirect commands per multi-draw, one stream ring write each
+#define WORLD_DRAW_CMDS_MAX             (4096)
+
+// Edits coalesced into one rebuild pass, cut short by frame end
+#define WORLD_UPDATE_WINDOW_US          (8000)
+
+// Blocks culled between checks for a newer chunk generation
+#define CHUNK_CULL_ABORT_CHECK          (256)
+
+// Initial block capacity of chunk, doubled on growth
+#define CHUNK_BLOCKS_MIN                (64)
+
+// Chunk links bit: faces a and b see each other through air
+#define CHUNK_LINK(a, b)                (1ULL << ((a) * NR_CUBE_FACES + (b)))
+#define CHUNK_LINKS_ALL                 ((1ULL << (NR_CUBE_FACES * NR_CUBE_FACES)) - 1)
+
+// Cave culling gives up on a larger walk domain, in chunks
+#define CHUNK_GRID_CELLS_MAX            (1 << 20)
+
 typedef struct block {
         ivec3           origin_l;
         vec3            axis[3];
@@ -35,7 +82,7 @@ typedef enum chunk_state {
         CHUNK_UNKNOWN = 0,      // Undefined
         CHUNK_INITED,           // Ready
         CHUNK_DEINITED,         // In case
-        CHUNK_UPDATING,         // Updating vertices (WR locked)
+        CHUNK_UPDATING,         // Culling and meshing, one pipeline owns it
         CHUNK_FLUSHED,          // GL data is updated
         CHUNK_FLUSHING,         // Updating GL data
         CHUNK_NEED_FLUSH,       // GL data is ready
@@ -44,21 +91,160 @@ typedef enum chunk_state {
         NR_CHUNK_STATES,
 } chunk_state;
 
+#define CHUNK_STATE_BIT(s)              (1U << (s))
+
+// Hashed wait queues shared by all chunks, power of 2
+#define CHUNK_STATE_WAITQ_BUCKETS       (64)
+
+typedef enum chunk_stage {
+        CHUNK_STAGE_GENERATE = 0,
+        CHUNK_STAGE_BARRIER,    // neighbours generated
+        CHUNK_STAGE_CULL,
+        CHUNK_STAGE_MESH,
+        CHUNK_STAGE_UPLOAD,     // render thread
+        NR_CHUNK_STAGES,
+} chunk_stage;
+
+typedef enum chunk_queue_idx {
+        CHUNK_QUEUE_DIRTY = 0,  // waiting for rebuild
+        CHUNK_QUEUE_READY,      // built, waiting for upload
+        CHUNK_QUEUE_UPLOAD,     // mesh waiting for upload thread
+        NR_CHUNK_QUEUES,
+} chunk_queue_idx;
+
+/**
+ * Published version of chunk blocks, readers walk it without lock inside
+ * epoch read section. Blocks below count never change, writers append
+ * in place while capacity lasts, other edits publish a new copy.
+ */
+typedef struct chunk_blocks {
+        epoch_head              retire;         // must be first
+        atomic_size_t           count;
+        size_t                  capacity;
+        block                   blocks[];
+} chunk_blocks;
+
 typedef struct chunk {
         ivec3                   origin_l;
 
-        gl_vbo                  glvbo;
-        gl_attr                 glattr;
+        chunk_mesh              *mesh;          // drawing, render thread only
+        _Atomic(chunk_mesh *)   mesh_pending;   // built, waiting for flush
+        _Atomic(chunk_mesh *)   mesh_upload;    // referenced for upload thread
         pthread_rwlock_t        rwlock_gl;
 
-        seqlist                 *vertices;
-        linklist                *blocks;
+        // Writers hold rwlock, readers go through epoch
+        _Atomic(chunk_blocks *) blocks;
+
+        atomic_int              state;          // chunk_state, moved by CAS
 
-        chunk_state             state;
+        // Content generation, bumped whenever chunk needs a rebuild
+        atomic_uint             gen;
+        uint32_t                build_gen;      // being rebuilt, under rwlock
+        atomic_uint             mesh_pending_gen;
 
-        pthread_rwlock_t        rwlock;
+        // CHUNK_LINK() bits computed by mesher, follow mesh to render thread
+        atomic_ullong           links_pending;
+        uint64_t                links;          // of mesh, render thread only
+
+        int                     lod;            // mesh level drawn, render thread only
+
+        // AABB occlusion query, render thread only
+        GLuint                  occl_query;
+        int                     occl_pending;   // result not read yet
+        int                     occl_hidden;    // no sample passed last result
+        uint64_t                occl_frame;     // frame last query was issued
+
+        pthread_rwlock_t        rwlock;         // block data writers
+
+        // Queue links, owned by queue while queued bit is set
+        atomic_int              queued[NR_CHUNK_QUEUES];
+        struct chunk            *queue_next[NR_CHUNK_QUEUES];
+        _Atomic double          ready_time;     // handed over by upload node
 } chunk;
 
+typedef struct chunk_prio {
+        chunk                   *c;
+        int                     outside;        // out of view frustum
+        float                   dist;           // squared, to chunk AABB
+} chunk_prio;
+
+typedef struct world_upload_stats {
+        uint64_t                flushes;
+        uint64_t                bytes;
+        uint64_t                frames_deferred;
+        uint64_t                stale;          // outdated results dropped
+} world_upload_stats;
+
+typedef struct world_draw_stats {
+        uint64_t                frames;
+        uint64_t                tested;         // chunks with a mesh
+        uint64_t                culled;         // out of view frustum
+        uint64_t                occluded;       // not reached by cave walk
+        uint64_t                drawn;
+        uint64_t                draw_calls;
+        uint64_t                program_binds;
+        uint64_t                texture_binds;
+        uint64_t                vao_binds;
+        uint64_t                multi_draws;
+        uint64_t                multi_drawn;    // chunks in multi-draws
+
+        // Samples passed by opaque chunk draws, see world_overdraw_set()
+        uint64_t                overdraw_frames;
+        uint64_t                overdraw_samples;
+        uint64_t                overdraw_pixels;
+
+        uint64_t                lod_drawn[MESH_LODS];
+        uint64_t                lod_switches;
+
+        uint64_t                occl_queries;
+        uint64_t                occl_skipped;   // hidden by last read result
+        uint64_t                occl_conditional; // drawn on pending query
+} world_draw_stats;
+
+typedef struct chunk_draw_item {
+        chunk                   *c;
+        chunk_mesh              *m;             // level picked by distance
+        float                   dist;           // squared, to camera
+        GLuint                  cond;           // query to draw on, 0 for none
+} chunk_draw_item;
+
+typedef struct chunk_visit {
+        ivec3                   origin;
+        uint8_t                 from;           // face entered through
+        uint8_t                 dirs;           // directions stepped so far
+} chunk_visit;
+
+/**
+ * Dense chunk index walked by cave culling, render thread only. Domain
+ * covers chunk bounds with one chunk of air around, and camera chunk.
+ */
+typedef struct chunk_grid {
+        size_t                  nr_chunks;      // world chunks in bounds
+        ivec3                   min;            // chunk bounds
+        ivec3                   max;
+
+        ivec3                   dom_min;
+        ivec3                   dom_dim;
+        size_t                  dom_cells;
+        chunk                   **chunks;
+        uint32_t                *visit;         // stamp of walk which reached it
+        chunk_visit             *queue;
+        uint32_t                stamp;
+        int                     walked;         // visit is valid this frame
+} chunk_grid;
+
+typedef struct world_async_stats {
+        uint64_t                batches;
+        uint64_t                meshes;
+        uint64_t                bytes;
+        double                  fence_wait;     // seconds
+} world_async_stats;
+
+typedef struct world_update_stats {
+        uint64_t                triggers;
+        uint64_t                passes;
+} world_update_stats;
+
 typedef struct world {
         int32_t                 height_min;
         int32_t                 height_max;
@@ -71,13 +257,79 @@ typedef struct world {
         color_rgba              fog_color;
         float                   fog_distance;
 
+        mesh_cache              meshes;
+        mesh_arena              arena;
+
+        work_sched              sched;
+
+        // Camera snapshot from render thread, orders chunk rebuilds
+        vec3                    view_camera;
+        vec4                    view_planes[6];
+        mat4                    view_trans;
+        uint32_t                view_seq;       // 0 before first snapshot
+        pthread_mutex_t         view_lock;
+
+        // Lock-free MPSC stacks of chunks
+        _Atomic(chunk *)        queues[NR_CHUNK_QUEUES];
+
+        // Ready chunks by priority, render thread only
+        seqlist                 flush_heap;
+        size_t                  upload_budget_bytes;
+        uint32_t                upload_budget_us;
+        world_upload_stats      upload_stats;
+        world_draw_stats        draw_stats;
+        chunk_grid              grid;
+        seqlist                 draw_list;      // chunk_draw_item, sorted by state
+        int                     draw_unsorted;  // keep state order only
+
+        // Arena chunks of a state run, see world_multi_draw_set()
+        int                     multi_draw;
+        seqlist                 draw_cmds;      // gl_draw_cmd
+
+        // First coarse level distance, 0 builds full resolution only
+        float                   lod_distance;
+        float                   lod_hysteresis;
+
+        // Ping-pong samples passed queries, read two frames later
+        GLuint                  overdraw_query[2];
+        uint64_t                overdraw_pixels[2];
+        int                     overdraw_pending[2];
+        uint32_t                overdraw_frame;
+
+        // Chunk AABB occlusion queries, see world_occlusion_set()
+        int                     occlusion;
+        gl_attr                 occl_attr;      // box program and cube buffer
+        GLuint                  occl_vao;
+        seqlist                 occl_list;      // chunk *, queried after draw
+
+        // Optional upload thread on hidden window sharing GL objects
+        GLFWwindow              *upload_window;
+        int                     upload_stop;    // under upload_mutex
+        world_async_stats       async_stats;    // under upload_mutex
+        pthread_t               upload_worker;
+        pthread_cond_t          upload_cond;
+        pthread_mutex_t         upload_mutex;
+
+        job_stage_stats         stage_stats[NR_CHUNK_STAGES];
+        pthread_mutex_t         stage_lock;
+        atomic_ullong           rebuilds_aborted;
+
+        // Under update_mutex
         int                     update_pending;
+        int                     update_stop;
+        int                     update_frame_end;       // since first trigger
+        double                  update_first;           // trigger opened window
+        uint32_t                update_window_us;
+        int                     update_inline;          // passes run at frame end
+        world_update_stats      update_stats;
         pthread_t               update_worker;
         pthread_cond_t          update_cond;
         pthread_mutex_t         update_mutex;
-        pthread_spinlock_t      update_spin;
 } world;
 
+// Fills blocks of one chunk, may run concurrently for other chunks
+typedef void (*chunk_generate_func)(world *w, chunk *c, void *data);
+
 void point_local_to_gl(const ivec3 local, int edge_len, vec3 gl);
 void point_gl_to_local(const vec3 gl, int edge_len, vec3 local);
 
@@ -89,23 +341,40 @@ int block_in_chunk(ivec3 origin_block, int chunk_length, ivec3 origin_chunk);
 int chunk_init(chunk *c, ivec3 origin_chunk);
 int chunk_deinit(chunk *c);
 
-block *chunk_get_block(chunk *c, ivec3 origin_block, int wait);
+block *chunk_get_block(chunk *c, ivec3 origin_block);
 block *chunk_add_block(chunk *c, block *b);
 int chunk_del_block(chunk *c, ivec3 origin_block);
 int chunk_cull_blocks(chunk *c, world *w);
 
+void world_chunk_mark_update(world *w, chunk *c);
+
 chunk *world_add_chunk(world *w, ivec3 origin_chunk);
 chunk *world_get_chunk(world *w, ivec3 origin_chunk);
 
 int world_add_block(world *w, block *b, int update);
 int world_del_block(world *w, ivec3 origin_block);
-block *world_get_block(world *w, ivec3 origin_block, int wait);
+block *world_get_block(world *w, ivec3 origin_block);
+
+int chunk_fill_blocks(world *w, chunk *c, ivec3 min, ivec3 max, block_attr_idx type);
+int world_generate_chunks(world *w, ivec3 chunk_min, ivec3 chunk_max,
+                          chunk_generate_func gen, void *data);
 
-int world_update_chunks(world *w, int detach);
+void world_view_update(world *w, vec3 camera, mat4 trans);
+int world_update_chunks(world *w);
+void world_flush_chunks(world *w);
 int world_draw_chunks(world *w, vec3 camera, mat4 trans);
+void world_stats_dump(world *w);
+void world_upload_budget_set(world *w, size_t bytes, uint32_t us);
+void world_update_window_set(world *w, uint32_t us);
+void world_draw_order_set(world *w, int front_to_back);
+void world_lod_distance_set(world *w, float distance);
+int world_overdraw_set(world *w, int enable);
+int world_occlusion_set(world *w, int enable);
+int world_multi_draw_set(world *w, int enable);
 
 int world_update_trigger(world *w);
-int world_worker_create(world *w);
+int world_worker_create(world *w, int nr_workers);
+int world_upload_thread_create(world *w, GLFWwindow *shared);
 
 int world_init(world *w);
 int world_deinit(world *w);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <memory.h>
 #include <errno.h>
@@ -395,7 +396,7 @@ int gl_attr_buffer_delete(gl_attr *attr)
         if (glIsBuffer(attr->vertex) != GL_FALSE)
                 buffer_delete(&attr->vertex);
 
-        if (glIsBuffer(attr->vertex) != GL_FALSE)
+        if (glIsBuffer(attr->vertex_nrm) != GL_FALSE)
                 buffer_delete(&attr->vertex_nrm);
 
         if (glIsBuffer(attr->vertex_uv) != GL_FALSE)
@@ -461,171 +462,774 @@ void gl_vertices_free(vec3 **positions, vec3 **normals, vec2 **uvs)
  * VBOs
  */
 
-#define GL_VBO_EXPAND_COUNT                     (32)
+static gl_vbo_stats g_vbo_stats;
+
+static inline void gl_vbo_stats_add(uint64_t *counter, size_t bytes)
+{
+        __atomic_fetch_add(counter, (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+static inline size_t gl_vbo_vertices_size(gl_vbo *vbo)
+{
+        return sizeof(vertex_attr) * vbo->vertex_count;
+}
+
+static inline size_t gl_vbo_indices_size(gl_vbo *vbo)
+{
+        return sizeof(uint32_t) * vbo->index_count;
+}
 
 int gl_vbo_init(gl_vbo *vbo)
 {
-        int ret;
+        if (!vbo)
+                return -EINVAL;
+
+        memzero(vbo, sizeof(gl_vbo));
+
+        return 0;
+}
 
+int gl_vbo_deinit(gl_vbo *vbo)
+{
         if (!vbo)
                 return -EINVAL;
 
-        ret = seqlist_init(&vbo->indices, sizeof(uint32_t), GL_VBO_EXPAND_COUNT);
-        if (ret) {
-                goto err;
+        if (vbo->staging)
+                memfree((void **)&vbo->staging);
+
+        memzero(vbo, sizeof(gl_vbo));
+
+        return 0;
+}
+
+/**
+ * gl_vbo_alloc() - allocate staging buffer of final upload size
+ *
+ * Producer writes vertices and indices in place, nothing is reshaped
+ * afterwards.
+ *
+ * @param vbo: pointer to vbo, must be inited and empty
+ * @param vertex_count: interleaved vertices count
+ * @param index_count: indices count
+ * @return 0 on success
+ */
+int gl_vbo_alloc(gl_vbo *vbo, size_t vertex_count, size_t index_count)
+{
+        if (!vbo || vbo->staging)
+                return -EINVAL;
+
+        vbo->vertex_count = vertex_count;
+        vbo->index_count = index_count;
+
+        if (!vertex_count && !index_count)
+                return 0;
+
+        vbo->staging = memalloc(gl_vbo_vertices_size(vbo) +
+                                gl_vbo_indices_size(vbo));
+        if (!vbo->staging) {
+                pr_err_alloc();
+                vbo->vertex_count = 0;
+                vbo->index_count = 0;
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+vertex_attr *gl_vbo_vertices(gl_vbo *vbo)
+{
+        return (vertex_attr *)vbo->staging;
+}
+
+uint32_t *gl_vbo_indices(gl_vbo *vbo)
+{
+        return (uint32_t *)(vbo->staging + gl_vbo_vertices_size(vbo));
+}
+
+// Bytes per quad face each removed pipeline stage wrote
+static const size_t gl_vbo_legacy_face_bytes[NR_GL_VBO_LEGACY_STAGES] = {
+        [GL_VBO_LEGACY_PACK]    = sizeof(vertex_attr) * VERTICES_TRIANGULATE_QUAD,
+        [GL_VBO_LEGACY_INDEX]   = sizeof(vertex_attr) * VERTICES_QUAD +
+                                  sizeof(uint32_t) * VERTICES_TRIANGULATE_QUAD,
+        [GL_VBO_LEGACY_COPY]    = sizeof(vertex_attr) * VERTICES_QUAD +
+                                  sizeof(uint32_t) * VERTICES_TRIANGULATE_QUAD,
+        [GL_VBO_LEGACY_SPLIT]   = sizeof(vertex_attr) * VERTICES_QUAD,
+};
+
+/**
+ * gl_vbo_staged() - account producer writes into staging buffer
+ *
+ * Producer fills the whole staging buffer once. Later CPU copies of the
+ * same data, like staging through stream ring, are counted where they
+ * happen, so copied over uploaded bytes is the number of CPU copies.
+ *
+ * Bytes each stage of the removed pipeline would have written for the
+ * same faces are counted next to it, for comparison.
+ *
+ * @param vbo: pointer to filled vbo
+ */
+void gl_vbo_staged(gl_vbo *vbo)
+{
+        size_t faces = vbo->vertex_count / VERTICES_QUAD;
+
+        gl_vbo_stats_add(&g_vbo_stats.bytes_copied,
+                         gl_vbo_vertices_size(vbo) + gl_vbo_indices_size(vbo));
+
+        for (int i = 0; i < NR_GL_VBO_LEGACY_STAGES; ++i)
+                gl_vbo_stats_add(&g_vbo_stats.bytes_legacy[i],
+                                 faces * gl_vbo_legacy_face_bytes[i]);
+}
+
+/**
+ * gl_vbo_buffer_create() - hand staging buffer to GL as it is
+ *
+ * Creates interleaved vertex buffer and element buffer, bind attributes
+ * with gl_vbo_attrib_bind() when drawing.
+ *
+ * @param vbo: pointer to filled vbo
+ * @param glattr: pointer to gl_attr to store buffers
+ * @return GL_TRUE on success
+ */
+int gl_vbo_buffer_create(gl_vbo *vbo, gl_attr *glattr)
+{
+        int ret;
+
+        if (!vbo || !glattr)
+                return GL_FALSE;
+
+        glattr->vertex_count = (GLsizei)vbo->index_count;
+        glattr->vbo_index = buffer_element_create(gl_vbo_indices(vbo),
+                                                  gl_vbo_indices_size(vbo));
+        ret = glIsBuffer(glattr->vbo_index);
+        if (ret == GL_FALSE) {
+                pr_err_func("failed to create vertex indexed buffer\n");
+                return ret;
         }
 
-        ret = seqlist_init(&vbo->vbo_attrs, sizeof(vertex_attr), GL_VBO_EXPAND_COUNT);
-        if (ret) {
-                goto err;
+        glattr->vertex = buffer_create(gl_vbo_vertices(vbo),
+                                       gl_vbo_vertices_size(vbo));
+        ret = glIsBuffer(glattr->vertex);
+        if (ret == GL_FALSE) {
+                pr_err_func("failed to create vertex buffer\n");
+                goto del_indices;
         }
 
+        gl_vbo_stats_add(&g_vbo_stats.bytes_uploaded,
+                         gl_vbo_vertices_size(vbo) + gl_vbo_indices_size(vbo));
+
+        return ret;
+
+del_indices:
+        buffer_delete(&glattr->vbo_index);
+
+        return ret;
+}
+
+void gl_vbo_attrib_bind(gl_attr *glattr)
+{
+        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_attr),
+                              (void *)offsetof(vertex_attr, position));
+
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertex_attr),
+                              (void *)offsetof(vertex_attr, normal));
+
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(vertex_attr),
+                              (void *)offsetof(vertex_attr, uv));
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, glattr->vbo_index);
+}
+
+void gl_vbo_attrib_unbind(void)
+{
+        glDisableVertexAttribArray(0);
+        glDisableVertexAttribArray(1);
+        glDisableVertexAttribArray(2);
+}
+
+void gl_vbo_stats_get(gl_vbo_stats *stats)
+{
+        stats->bytes_copied = __atomic_load_n(&g_vbo_stats.bytes_copied, __ATOMIC_RELAXED);
+        stats->bytes_uploaded = __atomic_load_n(&g_vbo_stats.bytes_uploaded, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < NR_GL_VBO_LEGACY_STAGES; ++i)
+                stats->bytes_legacy[i] = __atomic_load_n(&g_vbo_stats.bytes_legacy[i],
+                                                         __ATOMIC_RELAXED);
+}
+
+/**
+ * Buffer Arena
+ */
+
+#define GL_ARENA_FREE_INIT              (64)
+
+/**
+ * gl_arena_init() - create arena buffer, GL context must be current
+ *
+ * @param a: pointer to arena
+ * @param unit: bytes per element
+ * @param capacity: arena size in elements
+ * @return 0 on success
+ */
+int gl_arena_init(gl_arena *a, size_t unit, size_t capacity)
+{
+        int ret = -ENOMEM;
+
+        if (!a || !unit || !capacity)
+                return -EINVAL;
+
+        memzero(a, sizeof(gl_arena));
+
+        a->free = memalloc(sizeof(gl_arena_range) * GL_ARENA_FREE_INIT);
+        a->retired = memalloc(sizeof(gl_arena_retired) * GL_ARENA_FREE_INIT);
+        if (!a->free || !a->retired) {
+                pr_err_alloc();
+                goto free;
+        }
+
+        // Storage only, array target leaves bound VAO untouched
+        a->buffer = buffer_create(NULL, (GLsizeiptr)(unit * capacity));
+        if (glIsBuffer(a->buffer) == GL_FALSE) {
+                pr_err_func("failed to create arena buffer\n");
+                ret = -EFAULT;
+                goto free;
+        }
+
+        a->unit = unit;
+        a->capacity = capacity;
+
+        a->free[0].first = 0;
+        a->free[0].count = capacity;
+        a->nr_free = 1;
+        a->nr_free_max = GL_ARENA_FREE_INIT;
+        a->nr_retired_max = GL_ARENA_FREE_INIT;
+
+        pthread_mutex_init(&a->lock, NULL);
+
         return 0;
 
-err:
-        // seqlist_deinit() will validate data itself
-        seqlist_deinit(&vbo->indices);
-        seqlist_deinit(&vbo->vbo_attrs);
+free:
+        if (a->free)
+                memfree((void **)&a->free);
+
+        if (a->retired)
+                memfree((void **)&a->retired);
+
         return ret;
 }
 
-int gl_vbo_deinit(gl_vbo *vbo)
+int gl_arena_deinit(gl_arena *a)
 {
-        if (!vbo)
+        if (!a || !a->free)
                 return -EINVAL;
 
-        seqlist_deinit(&vbo->indices);
-        seqlist_deinit(&vbo->vbo_attrs);
+        if (a->stats.used)
+                pr_err_func("arena still has %zu elements in use\n",
+                            a->stats.used);
+
+        for (uint64_t s = a->seq_done; s < a->seq; ++s)
+                glDeleteSync(a->fences[s % GL_ARENA_FENCES]);
+
+        buffer_delete(&a->buffer);
+        memfree((void **)&a->free);
+        memfree((void **)&a->retired);
+
+        pthread_mutex_destroy(&a->lock);
 
         return 0;
 }
 
-int vertex_is_indexed(seqlist *vbo_list, vertex_attr *new_attr, uint32_t *idx)
+/**
+ * gl_arena_alloc() - take first free range large enough
+ *
+ * @param a: pointer to arena
+ * @param count: elements wanted
+ * @param r: output range
+ * @return 0 on success, -ENOMEM if no free range fits
+ */
+int gl_arena_alloc(gl_arena *a, size_t count, gl_arena_range *r)
 {
-        // FIXME: Linear search
-        for (uint32_t i = 0; i < vbo_list->count_utilized; ++i) {
-                vertex_attr *attr = &((vertex_attr *)vbo_list->data)[i];
+        int ret = -ENOMEM;
+
+        if (!a || !r || !count)
+                return -EINVAL;
+
+        pthread_mutex_lock(&a->lock);
+
+        for (size_t i = 0; i < a->nr_free; ++i) {
+                gl_arena_range *f = &a->free[i];
+
+                if (f->count < count)
+                        continue;
 
-                if (vec3_equal(attr->position, new_attr->position) &&
-                    vec3_equal(attr->normal, new_attr->normal) &&
-                    vec2_equal(attr->uv, new_attr->uv)) {
-                        *idx = i;
-                        return 1;
+                r->first = f->first;
+                r->count = count;
+
+                f->first += count;
+                f->count -= count;
+
+                if (!f->count) {
+                        memmove(f, f + 1, sizeof(gl_arena_range) *
+                                (a->nr_free - i - 1));
+                        a->nr_free--;
                 }
+
+                a->stats.allocs++;
+                a->stats.used += count;
+                if (a->stats.used > a->stats.peak)
+                        a->stats.peak = a->stats.used;
+
+                ret = 0;
+                goto unlock;
         }
 
+        a->stats.fails++;
+
+unlock:
+        pthread_mutex_unlock(&a->lock);
+
+        return ret;
+}
+
+static int gl_arena_free_expand(gl_arena *a)
+{
+        gl_arena_range *t;
+        size_t n = a->nr_free_max * 2;
+
+        t = memalloc(sizeof(gl_arena_range) * n);
+        if (!t) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        memcpy(t, a->free, sizeof(gl_arena_range) * a->nr_free);
+        memfree((void **)&a->free);
+
+        a->free = t;
+        a->nr_free_max = n;
+
         return 0;
 }
 
-int gl_vbo_index(gl_vbo *vbo, vertex_attr *vertices, uint32_t vertex_count)
+/**
+ * gl_arena_release() - put range back to free list, merged with neighbours
+ *
+ * @param a: pointer to arena, locked
+ * @param r: range no longer read by GPU
+ */
+static void gl_arena_release(gl_arena *a, gl_arena_range *r)
+{
+        gl_arena_range *prev, *next;
+        size_t i;
+
+        for (i = 0; i < a->nr_free; ++i) {
+                if (a->free[i].first > r->first)
+                        break;
+        }
+
+        prev = i > 0 ? &a->free[i - 1] : NULL;
+        next = i < a->nr_free ? &a->free[i] : NULL;
+
+        if (prev && prev->first + prev->count == r->first) {
+                prev->count += r->count;
+
+                if (next && prev->first + prev->count == next->first) {
+                        prev->count += next->count;
+                        memmove(next, next + 1, sizeof(gl_arena_range) *
+                                (a->nr_free - i - 1));
+                        a->nr_free--;
+                }
+        } else if (next && r->first + r->count == next->first) {
+                next->first = r->first;
+                next->count += r->count;
+        } else {
+                // Range leaks until deinit if list cannot grow
+                if (a->nr_free == a->nr_free_max && gl_arena_free_expand(a))
+                        return;
+
+                memmove(&a->free[i + 1], &a->free[i], sizeof(gl_arena_range) *
+                        (a->nr_free - i));
+                a->free[i] = *r;
+                a->nr_free++;
+        }
+}
+
+/**
+ * gl_arena_free() - retire range until GPU is done with it
+ *
+ * Draws reading the range may still be in flight, it joins open batch
+ * and is reused once gl_arena_fence() saw fence of that batch passed.
+ *
+ * @param a: pointer to arena
+ * @param r: range from gl_arena_alloc(), emptied
+ */
+void gl_arena_free(gl_arena *a, gl_arena_range *r)
 {
-        for (uint32_t i = 0; i < vertex_count; ++i) {
-                vertex_attr *vertex_pack = &vertices[i];
-                uint32_t idx;
+        if (!a || !r || !r->count)
+                return;
 
-                if (vertex_is_indexed(&vbo->vbo_attrs, vertex_pack, &idx)) {
-                        seqlist_append(&vbo->indices, &idx);
-                } else {
-                        uint32_t new_idx = (uint32_t)vbo->vbo_attrs.count_utilized;
+        pthread_mutex_lock(&a->lock);
+
+        if (a->nr_retired == a->nr_retired_max) {
+                gl_arena_retired *t;
+                size_t n = a->nr_retired_max * 2;
 
-                        seqlist_append(&vbo->indices, &new_idx);
-                        seqlist_append(&vbo->vbo_attrs, vertex_pack);
+                // Range leaks until deinit if list cannot grow
+                t = memalloc(sizeof(gl_arena_retired) * n);
+                if (!t) {
+                        pr_err_alloc();
+                        goto stats;
                 }
+
+                memcpy(t, a->retired, sizeof(gl_arena_retired) * a->nr_retired);
+                memfree((void **)&a->retired);
+
+                a->retired = t;
+                a->nr_retired_max = n;
         }
 
-        seqlist_shrink(&vbo->indices);
-        seqlist_shrink(&vbo->vbo_attrs);
+        a->retired[a->nr_retired].r = *r;
+        a->retired[a->nr_retired].seq = a->seq;
+        a->nr_retired++;
 
-        return 0;
+        a->stats.retired += r->count;
+
+stats:
+        a->stats.frees++;
+        a->stats.used -= r->count;
+
+        pthread_mutex_unlock(&a->lock);
+
+        r->first = 0;
+        r->count = 0;
 }
 
-void gl_vbo_vertices_copy(gl_vbo *vbo, vec3 *vertex, vec3 *normal, vec2 *uv)
+/**
+ * gl_arena_fence() - fence freed ranges and reuse those GPU is done with
+ *
+ * Call once per frame after draws, on context drawing from arena. Fence
+ * is put behind draws of ranges freed since last call. Ranges of batches
+ * whose fence was passed go back to free list, any context may
+ * overwrite them from then on. Never waits unless every fence is busy.
+ *
+ * @param a: pointer to arena
+ */
+void gl_arena_fence(gl_arena *a)
 {
-        for (size_t i = 0; i < vbo->vbo_attrs.count_utilized; ++i) {
-                vertex_attr *attr = &((vertex_attr *)vbo->vbo_attrs.data)[i];
+        GLsync *f;
+        size_t n;
+
+        if (!a)
+                return;
+
+        pthread_mutex_lock(&a->lock);
+
+        for (; a->seq_done < a->seq; a->seq_done++) {
+                f = &a->fences[a->seq_done % GL_ARENA_FENCES];
+
+                if (glClientWaitSync(*f, 0, 0) == GL_TIMEOUT_EXPIRED)
+                        break;
+
+                glDeleteSync(*f);
+                *f = NULL;
+        }
+
+        // Open batch got ranges since last call
+        if (a->nr_retired && a->retired[a->nr_retired - 1].seq == a->seq) {
+                if (a->seq - a->seq_done == GL_ARENA_FENCES) {
+                        f = &a->fences[a->seq_done % GL_ARENA_FENCES];
 
-                memcpy(&vertex[i], attr->position, sizeof(vec3));
-                memcpy(&normal[i], attr->normal, sizeof(vec3));
-                memcpy(&uv[i], attr->uv, sizeof(vec2));
+                        // Frames old, GPU is about to pass it anyway
+                        while (glClientWaitSync(*f, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                                GL_STREAM_FENCE_WAIT_NS) == GL_TIMEOUT_EXPIRED)
+                                ;
+
+                        glDeleteSync(*f);
+                        *f = NULL;
+                        a->seq_done++;
+                        a->stats.fence_waits++;
+                }
+
+                a->fences[a->seq % GL_ARENA_FENCES] =
+                        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                a->seq++;
+        }
+
+        for (n = 0; n < a->nr_retired && a->retired[n].seq < a->seq_done; ++n) {
+                gl_arena_release(a, &a->retired[n].r);
+                a->stats.retired -= a->retired[n].r.count;
         }
+
+        if (n) {
+                memmove(a->retired, a->retired + n,
+                        sizeof(gl_arena_retired) * (a->nr_retired - n));
+                a->nr_retired -= n;
+        }
+
+        pthread_mutex_unlock(&a->lock);
 }
 
-int gl_vbo_buffer_create(gl_vbo *vbo, gl_attr *glattr)
+/**
+ * gl_arena_write() - fill allocated range
+ *
+ * @param a: pointer to arena
+ * @param r: allocated range
+ * @param data: r->count elements
+ * @param stream: stage through stream ring, render thread only
+ * @return 0 on success
+ */
+int gl_arena_write(gl_arena *a, gl_arena_range *r, const void *data, int stream)
 {
-        vec2 *uvs;
-        vec3 *normals;
-        vec3 *positions;
-        size_t vertex_count;
-        int ret;
+        GLintptr src;
+        size_t size;
 
-        if (!vbo || !glattr)
+        if (!a || !r || !data)
                 return -EINVAL;
 
-        vertex_count = vbo->vbo_attrs.count_utilized;
+        size = a->unit * r->count;
 
-        gl_vertices_alloc(&positions, &normals, &uvs, vertex_count);
-        gl_vbo_vertices_copy(vbo, positions, normals, uvs);
+        // Driver copies nothing, GPU moves data from ring to arena
+        if (stream && !gl_stream_write(data, size, &src)) {
+                gl_vbo_stats_add(&g_vbo_stats.bytes_copied, size);
 
-        glattr->vertex_count = (GLsizei)vbo->indices.count_utilized;
-        glattr->vbo_index = buffer_element_create(vbo->indices.data,
-                                                  vbo->indices.element_size *
-                                                  vbo->indices.count_utilized);
-        ret = glIsBuffer(glattr->vbo_index);
-        if (ret == GL_FALSE) {
-                pr_err_func("failed to create vertex indexed buffer\n");
-                goto free_alloc;
+                glBindBuffer(GL_COPY_READ_BUFFER, gl_stream_buffer());
+                glBindBuffer(GL_COPY_WRITE_BUFFER, a->buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    src, (GLintptr)(a->unit * r->first),
+                                    (GLsizeiptr)size);
+                glBindBuffer(GL_COPY_READ_BUFFER, GL_BUFFER_NONE);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
+        } else {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, a->buffer);
+                glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)(a->unit * r->first),
+                                (GLsizeiptr)size, data);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
         }
 
-        glattr->vertex = buffer_create(positions, sizeof(vec3) * vertex_count);
-        ret = glIsBuffer(glattr->vertex);
-        if (ret == GL_FALSE) {
-                pr_err_func("failed to create vertex buffer\n");
-                goto del_indices;
+        gl_vbo_stats_add(&g_vbo_stats.bytes_uploaded, size);
+
+        return 0;
+}
+
+void gl_arena_stats_get(gl_arena *a, gl_arena_stats *stats, size_t *nr_free)
+{
+        pthread_mutex_lock(&a->lock);
+        memcpy(stats, &a->stats, sizeof(gl_arena_stats));
+        *nr_free = a->nr_free;
+        pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Stream Buffer
+ */
+
+typedef struct gl_stream {
+        GLuint          buffer;
+        size_t          size;
+        size_t          head;
+        size_t          seg;            // segment head is in
+        uint8_t         *map;           // persistent mapping, if any
+        GLsync          fences[GL_STREAM_SEGMENTS];
+        gl_stream_stats stats;
+} gl_stream;
+
+static gl_stream g_stream;
+
+static inline size_t gl_stream_seg(gl_stream *s, size_t offset)
+{
+        return offset / (s->size / GL_STREAM_SEGMENTS);
+}
+
+static void gl_stream_fence(gl_stream *s, size_t seg)
+{
+        if (s->fences[seg])
+                glDeleteSync(s->fences[seg]);
+
+        s->fences[seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+static void gl_stream_wait(gl_stream *s, size_t seg)
+{
+        GLsync fence = s->fences[seg];
+        double start;
+        GLenum ret;
+
+        if (!fence)
+                return;
+
+        start = glfwGetTime();
+
+        do {
+                ret = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                       GL_STREAM_FENCE_WAIT_NS);
+        } while (ret == GL_TIMEOUT_EXPIRED);
+
+        if (ret == GL_WAIT_FAILED)
+                pr_err_func("stream fence wait failed\n");
+
+        if (ret == GL_CONDITION_SATISFIED) {
+                s->stats.fence_waits++;
+                s->stats.fence_wait += glfwGetTime() - start;
         }
 
-        glattr->vertex_nrm = buffer_create(normals, sizeof(vec3) * vertex_count);
-        ret = glIsBuffer(glattr->vertex_nrm);
-        if (ret == GL_FALSE) {
-                pr_err_func("failed to create vertex normal buffer\n");
-                goto del_vertex;
+        glDeleteSync(fence);
+        s->fences[seg] = NULL;
+}
+
+/**
+ * gl_stream_init() - create stream ring, GL context must be current
+ *
+ * @param size: ring size in bytes, rounded down to whole segments
+ * @return 0 on success
+ */
+int gl_stream_init(size_t size)
+{
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                                 GL_MAP_COHERENT_BIT;
+        gl_stream *s = &g_stream;
+
+        size -= size % (GL_STREAM_SEGMENTS * GL_STREAM_ALIGN);
+        if (!size)
+                return -EINVAL;
+
+        memzero(s, sizeof(gl_stream));
+
+        glGenBuffers(1, &s->buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+
+        if (GLEW_ARB_buffer_storage) {
+                glBufferStorage(GL_COPY_WRITE_BUFFER, (GLsizeiptr)size, NULL, flags);
+                s->map = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0,
+                                          (GLsizeiptr)size, flags);
+        } else {
+                glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)size, NULL,
+                             GL_STREAM_DRAW);
         }
 
-        glattr->vertex_uv = buffer_create(uvs, sizeof(vec2) * vertex_count);
-        ret = glIsBuffer(glattr->vertex_uv);
-        if (ret == GL_FALSE) {
-                pr_err_func("failed to create vertex uv buffer\n");
-                goto del_normal;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
+
+        if (glIsBuffer(s->buffer) == GL_FALSE ||
+            (GLEW_ARB_buffer_storage && !s->map)) {
+                pr_err_func("failed to create stream buffer\n");
+                buffer_delete(&s->buffer);
+                return -EFAULT;
         }
 
-free_alloc:
-        gl_vertices_free(&positions, &normals, &uvs);
+        s->size = size;
+        s->stats.persistent = s->map ? 1 : 0;
 
-        return ret;
+        return 0;
+}
 
-del_indices:
-        buffer_delete(&glattr->vbo_index);
+int gl_stream_deinit(void)
+{
+        gl_stream *s = &g_stream;
+
+        if (!s->buffer)
+                return -EINVAL;
 
-del_vertex:
-        buffer_delete(&glattr->vertex);
+        for (int i = 0; i < GL_STREAM_SEGMENTS; ++i) {
+                if (s->fences[i])
+                        glDeleteSync(s->fences[i]);
+        }
 
-del_normal:
-        buffer_delete(&glattr->vertex_nrm);
+        if (s->map) {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+                glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
+        }
 
-        goto free_alloc;
+        buffer_delete(&s->buffer);
+        memzero(s, sizeof(gl_stream));
+
+        return 0;
 }
 
-int gl_vbo_is_empty(gl_vbo *vbo)
+/**
+ * gl_stream_write() - append data to stream ring
+ *
+ * Data stays valid for GL commands issued until the next write. With
+ * persistent mapping, segment is fenced once head leaves it, and is
+ * waited on before head enters it again. Without, buffer is orphaned
+ * on wrap and driver keeps old storage alive for pending commands.
+ *
+ * @param data: data to write
+ * @param size: bytes to write
+ * @param offset: output offset of data in gl_stream_buffer()
+ * @return 0 on success, -ENOSPC if ring is smaller than data
+ */
+int gl_stream_write(const void *data, size_t size, GLintptr *offset)
 {
-        if (!vbo)
-                return 1;
+        gl_stream *s = &g_stream;
+        size_t len;
 
-        if (seqlist_is_empty(&vbo->indices) &&
-            seqlist_is_empty(&vbo->vbo_attrs))
-                return 1;
+        if (!s->buffer || !offset)
+                return -EINVAL;
+
+        // Nothing to draw, any offset does
+        if (!size) {
+                *offset = 0;
+                return 0;
+        }
+
+        len = (size + GL_STREAM_ALIGN - 1) & ~((size_t)GL_STREAM_ALIGN - 1);
+        if (len > s->size)
+                return -ENOSPC;
+
+        if (s->head + len > s->size) {
+                if (s->map) {
+                        gl_stream_fence(s, s->seg);
+                        s->seg = 0;
+                        gl_stream_wait(s, s->seg);
+                } else {
+                        glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+                        glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)s->size,
+                                     NULL, GL_STREAM_DRAW);
+                        glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
+                }
+
+                s->head = 0;
+                s->stats.wraps++;
+        }
+
+        while (s->map && s->seg != gl_stream_seg(s, s->head + len - 1)) {
+                gl_stream_fence(s, s->seg);
+                s->seg++;
+                gl_stream_wait(s, s->seg);
+        }
+
+        if (s->map) {
+                memcpy(s->map + s->head, data, size);
+        } else {
+                glBindBuffer(GL_COPY_WRITE_BUFFER, s->buffer);
+                glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)s->head,
+                                (GLsizeiptr)size, data);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, GL_BUFFER_NONE);
+        }
+
+        *offset = (GLintptr)s->head;
+        s->head += len;
+
+        s->stats.writes++;
+        s->stats.bytes += size;
 
         return 0;
 }
 
+GLuint gl_stream_buffer(void)
+{
+        return g_stream.buffer;
+}
+
+void gl_stream_stats_get(gl_stream_stats *stats)
+{
+        memcpy(stats, &g_stream.stats, sizeof(gl_stream_stats));
+}
+
 /**
  * Space Line Rendering
  */
@@ -642,10 +1246,14 @@ int line_3d_draw(float *vertices, size_t count, vec4 color, GLenum color_op,
 {
         line_render *lr = &g_line_render;
         gl_attr *glattr = &lr->glattr;
+        GLintptr offset;
 
         pthread_spin_lock(&lr->spinlock);
 
-        glattr->vertex = buffer_create(vertices, sizeof(vec3) * count);
+        if (gl_stream_write(vertices, sizeof(vec3) * count, &offset)) {
+                pthread_spin_unlock(&lr->spinlock);
+                return -ENOSPC;
+        }
 
         glUseProgram(GL_PROGRAM_NONE);
 
@@ -658,8 +1266,8 @@ int line_3d_draw(float *vertices, size_t count, vec4 color, GLenum color_op,
         glUniformMatrix4fv(glattr->mat_transform, 1, GL_FALSE, &mat_transform[0][0]);
 
         glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glBindBuffer(GL_ARRAY_BUFFER, gl_stream_buffer());
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)offset);
 
         glDrawArrays(GL_LINES, 0, (GLsizei)count);
 
@@ -667,8 +1275,6 @@ int line_3d_draw(float *vertices, size_t count, vec4 color, GLenum color_op,
 
         glDisable(GL_COLOR_LOGIC_OP);
 
-        buffer_delete(&glattr->vertex);
-
         pthread_spin_unlock(&lr->spinlock);
 
         return 0;
@@ -862,8 +1468,10 @@ int text_string_draw(const char *str, int x, int y, float scale,
         float screen_size[2] = { fb_width, fb_height };
         text_font *font = g_font;
         gl_attr *glattr = &font->glattr;
+        GLintptr offset_vertex, offset_uv;
         seqlist vertices;
         seqlist uvs;
+        int ret = 0;
 
         if (!str)
                 return -EINVAL;
@@ -879,8 +1487,13 @@ int text_string_draw(const char *str, int x, int y, float scale,
         else
                 glattr->texel = font->texel;
 
-        glattr->vertex = buffer_create(vertices.data, vertices.element_size * vertices.count_utilized);
-        glattr->vertex_uv = buffer_create(uvs.data, uvs.element_size * uvs.count_utilized);
+        if (gl_stream_write(vertices.data, vertices.element_size * vertices.count_utilized,
+                            &offset_vertex) ||
+            gl_stream_write(uvs.data, uvs.element_size * uvs.count_utilized,
+                            &offset_uv)) {
+                ret = -ENOSPC;
+                goto out;
+        }
 
         glUseProgram(glattr->program);
 
@@ -904,26 +1517,24 @@ int text_string_draw(const char *str, int x, int y, float scale,
         glBindTexture(GL_TEXTURE_2D, glattr->texel);
         glUniform1i(glattr->sampler, 0);
 
+        glBindBuffer(GL_ARRAY_BUFFER, gl_stream_buffer());
+
         glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)offset_vertex);
 
         glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex_uv);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void *)offset_uv);
 
         glDrawArrays(GL_TRIANGLES, 0, (GLsizei)vertices.count_utilized);
 
         glDisableVertexAttribArray(0);
         glDisableVertexAttribArray(1);
 
-        buffer_delete(&glattr->vertex);
-        buffer_delete(&glattr->vertex_uv);
-
+out:
         seqlist_deinit(&vertices);
         seqlist_deinit(&uvs);
 
-        return 0;
+        return ret;
 }
 
 int text_render_init(void)
@@ -1096,8 +1707,10 @@ int crosshair_textured_draw(float scale, int fb_width, int fb_height)
         float screen_size[2] = { fb_width, fb_height };
         crosshair *ch = g_crosshair;
         gl_attr *glattr = &ch->glattr;
+        GLintptr offset_vertex, offset_uv;
         seqlist vertices;
         seqlist uvs;
+        int ret = 0;
 
         seqlist_init(&vertices, sizeof(vec2), 6);
         seqlist_init(&uvs, sizeof(vec2), 6);
@@ -1105,8 +1718,13 @@ int crosshair_textured_draw(float scale, int fb_width, int fb_height)
         crosshair_vertex_generate(ch, scale, fb_width, fb_height,
                                   &vertices, &uvs);
 
-        glattr->vertex = buffer_create(vertices.data, vertices.element_size * vertices.count_utilized);
-        glattr->vertex_uv = buffer_create(uvs.data, uvs.element_size * uvs.count_utilized);
+        if (gl_stream_write(vertices.data, vertices.element_size * vertices.count_utilized,
+                            &offset_vertex) ||
+            gl_stream_write(uvs.data, uvs.element_size * uvs.count_utilized,
+                            &offset_uv)) {
+                ret = -ENOSPC;
+                goto out;
+        }
 
         glUseProgram(glattr->program);
 
@@ -1116,26 +1734,24 @@ int crosshair_textured_draw(float scale, int fb_width, int fb_height)
         glBindTexture(GL_TEXTURE_2D, glattr->texel);
         glUniform1i(glattr->sampler, 0);
 
+        glBindBuffer(GL_ARRAY_BUFFER, gl_stream_buffer());
+
         glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *)offset_vertex);
 
         glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, glattr->vertex_uv);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void *)offset_uv);
 
         glDrawArrays(GL_TRIANGLES, 0, (GLsizei)vertices.count_utilized);
 
         glDisableVertexAttribArray(0);
         glDisableVertexAttribArray(1);
 
-        buffer_delete(&glattr->vertex);
-        buffer_delete(&glattr->vertex_uv);
-
+out:
         seqlist_deinit(&vertices);
         seqlist_deinit(&uvs);
 
-        return 0;
+        return ret;
 }
 
 int crosshair_textured_init(void)
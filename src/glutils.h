@@ -139,19 +139,161 @@ int face_is_back_face(vec3 f_vertex, vec3 f_normal, vec3 v_pos);
 #define GL_VBO_ENABLED                  (1)
 #define GL_VBO_DISABLED                 (0)
 
+/**
+ * Staging buffer laid out exactly as uploaded: interleaved vertex_attr
+ * array followed by uint32_t indices, in one right-sized allocation.
+ */
 typedef struct gl_vbo {
-        seqlist indices;
-        seqlist vbo_attrs;
+        uint8_t         *staging;
+        size_t          vertex_count;
+        size_t          index_count;
 } gl_vbo;
 
+/**
+ * CPU stages of removed mesh pipeline: pack triangulated faces, dedup
+ * into indexed lists, copy into final allocation, split per attribute
+ */
+enum gl_vbo_legacy_stage {
+        GL_VBO_LEGACY_PACK = 0,
+        GL_VBO_LEGACY_INDEX,
+        GL_VBO_LEGACY_COPY,
+        GL_VBO_LEGACY_SPLIT,
+        NR_GL_VBO_LEGACY_STAGES,
+};
+
+typedef struct gl_vbo_stats {
+        uint64_t        bytes_copied;   // CPU writes of mesh data, every stage
+        uint64_t        bytes_uploaded; // handed to GL
+        // What removed pipeline would have written for same faces
+        uint64_t        bytes_legacy[NR_GL_VBO_LEGACY_STAGES];
+} gl_vbo_stats;
+
 int gl_vbo_init(gl_vbo *vbo);
 int gl_vbo_deinit(gl_vbo *vbo);
 
-int gl_vbo_index(gl_vbo *vbo, vertex_attr *vertices, uint32_t vertex_count);
+int gl_vbo_alloc(gl_vbo *vbo, size_t vertex_count, size_t index_count);
+vertex_attr *gl_vbo_vertices(gl_vbo *vbo);
+uint32_t *gl_vbo_indices(gl_vbo *vbo);
+void gl_vbo_staged(gl_vbo *vbo);
 
 int gl_vbo_buffer_create(gl_vbo *vbo, gl_attr *glattr);
+void gl_vbo_attrib_bind(gl_attr *glattr);
+void gl_vbo_attrib_unbind(void);
+
+void gl_vbo_stats_get(gl_vbo_stats *stats);
+
+/**
+ * Indirect Draw
+ */
+
+// Per draw offset of mesh, constant or read per instance
+#define GL_VBO_OFFSET_ATTR              (3)
+
+/**
+ * Command laid out as glMultiDrawElementsIndirect() reads it, followed
+ * by data of that draw. Draw i has base_instance i, so an instanced
+ * attribute with command stride fetches offset from its own command.
+ */
+typedef struct gl_draw_cmd {
+        GLuint          count;
+        GLuint          instance_count;
+        GLuint          first_index;
+        GLint           base_vertex;
+        GLuint          base_instance;
+        GLfloat         offset[3];
+} gl_draw_cmd;
+
+/**
+ * Buffer Arena
+ *
+ * One GL buffer sub-allocated in element units, free ranges are kept
+ * sorted by offset and coalesced. Freed ranges are only reused once GPU
+ * passed fence put behind draws which may still read them.
+ */
+
+// Batches of freed ranges waiting on their fence
+#define GL_ARENA_FENCES                 (4)
+
+typedef struct gl_arena_range {
+        size_t          first;          // in elements
+        size_t          count;
+} gl_arena_range;
+
+typedef struct gl_arena_retired {
+        gl_arena_range  r;
+        uint64_t        seq;            // fence batch freed in
+} gl_arena_retired;
+
+typedef struct gl_arena_stats {
+        uint64_t        allocs;
+        uint64_t        frees;
+        uint64_t        fails;
+        size_t          used;           // in elements
+        size_t          peak;
+        size_t          retired;        // freed, waiting on fence
+        uint64_t        fence_waits;    // fence ring full
+} gl_arena_stats;
+
+typedef struct gl_arena {
+        GLuint          buffer;
+        size_t          unit;           // bytes per element
+        size_t          capacity;       // in elements
+
+        gl_arena_range  *free;
+        size_t          nr_free;
+        size_t          nr_free_max;
+
+        // Ordered by batch, reusable ones come first
+        gl_arena_retired *retired;
+        size_t          nr_retired;
+        size_t          nr_retired_max;
+        GLsync          fences[GL_ARENA_FENCES];
+        uint64_t        seq;            // open batch
+        uint64_t        seq_done;       // batches below passed by GPU
+
+        gl_arena_stats  stats;
+        pthread_mutex_t lock;
+} gl_arena;
+
+int gl_arena_init(gl_arena *a, size_t unit, size_t capacity);
+int gl_arena_deinit(gl_arena *a);
+
+int gl_arena_alloc(gl_arena *a, size_t count, gl_arena_range *r);
+void gl_arena_free(gl_arena *a, gl_arena_range *r);
+void gl_arena_fence(gl_arena *a);
+int gl_arena_write(gl_arena *a, gl_arena_range *r, const void *data, int stream);
+
+void gl_arena_stats_get(gl_arena *a, gl_arena_stats *stats, size_t *nr_free);
+
+/**
+ * Stream Buffer
+ *
+ * Ring for data written once and consumed by the very next GL commands,
+ * render thread only. Persistently mapped and fenced per segment with
+ * ARB_buffer_storage, orphaned on wrap otherwise.
+ */
+
+#define GL_STREAM_BUFFER_SIZE           (8 << 20)
+#define GL_STREAM_SEGMENTS              (4)
+#define GL_STREAM_ALIGN                 (16)
+#define GL_STREAM_FENCE_WAIT_NS         (10 * 1000 * 1000)
+
+typedef struct gl_stream_stats {
+        uint64_t        writes;
+        uint64_t        bytes;
+        uint64_t        wraps;
+        uint64_t        fence_waits;
+        double          fence_wait;     // seconds
+        int             persistent;
+} gl_stream_stats;
+
+int gl_stream_init(size_t size);
+int gl_stream_deinit(void);
+
+int gl_stream_write(const void *data, size_t size, GLintptr *offset);
+GLuint gl_stream_buffer(void);
 
-int gl_vbo_is_empty(gl_vbo *vbo);
+void gl_stream_stats_get(gl_stream_stats *stats);
 
 /**
  * FPS Meter
@@ -36,6 +36,16 @@ static mc_config def_config = {
         .texture_mipmap_level   = 4,
         .debug_level            = PRINT_INFO_BIT | PRINT_ERROR_BIT | PRINT_DEBUG_BIT,
         .opengl_msaa            = 4,
+        .worker_threads         = THREAD_POOL_WORKERS_AUTO,
+        .upload_budget_bytes    = WORLD_UPLOAD_BUDGET_BYTES,
+        .upload_budget_us       = WORLD_UPLOAD_BUDGET_US,
+        .update_window_us       = WORLD_UPDATE_WINDOW_US,
+        .upload_thread          = 0,
+        .draw_front_to_back     = true,
+        .overdraw_measure       = false,
+        .lod_distance           = WORLD_LOD_DISTANCE,
+        .occlusion_query        = true,
+        .multi_draw             = true,
 };
 
 static mc_program def_program;
@@ -71,6 +81,12 @@ void mc_program_key_callback(mc_program *program, int key, int action)
 
                         break;
 
+                case GLFW_KEY_KP_1:
+                        if (action == GLFW_PRESS)
+                                world_stats_dump(&program->mc_world);
+
+                        break;
+
                 case GLFW_KEY_KP_3:
                         if (action == GLFW_PRESS) {
                                 world_update_trigger(&program->mc_world);
@@ -189,6 +205,32 @@ int glfw_window_init(GLFWwindow **window, int width, int height, int msaa, int v
         return 0;
 }
 
+/**
+ * glfw_upload_window_init() - create hidden window for upload context
+ *
+ * Context hints of render window still apply, so both contexts match
+ * and share buffers, textures and programs.
+ *
+ * @param window: output hidden window
+ * @param shared: render window
+ * @return 0 on success
+ */
+int glfw_upload_window_init(GLFWwindow **window, GLFWwindow *shared)
+{
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+        *window = glfwCreateWindow(1, 1, PROGRAM_WINDOW_TITLE, NULL, shared);
+
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+
+        if (!*window) {
+                pr_err_func("failed to create upload window\n");
+                return -EFAULT;
+        }
+
+        return 0;
+}
+
 void glfw_input_init(GLFWwindow *window)
 {
         int width;
@@ -258,6 +300,16 @@ int main(const int argc, const char *argv[])
         mc_program *program = &def_program;
         player *mc_player = &program->mc_player;
         world *mc_world = &program->mc_world;
+        int bench_sched = 0;
+        int upload_thread = 0;
+        int single_thread = 0;
+        int check_inline = 0;
+        int check_upload = 0;
+        int draw_unsorted = 0;
+        int overdraw = 0;
+        int no_lod = 0;
+        int no_occlusion = 0;
+        int no_multi_draw = 0;
         int ret;
 
         // Cmdline process
@@ -266,6 +318,36 @@ int main(const int argc, const char *argv[])
                 pr_debug_func("cmdline: ");
                 for (int i = 1; i < argc; ++i) {
                         pr_debug("%s ", argv[i]);
+
+                        if (!strcmp(argv[i], "--bench-sched"))
+                                bench_sched = 1;
+
+                        if (!strcmp(argv[i], "--upload-thread"))
+                                upload_thread = 1;
+
+                        if (!strcmp(argv[i], "--single-thread"))
+                                single_thread = 1;
+
+                        if (!strcmp(argv[i], "--check-inline"))
+                                check_inline = 1;
+
+                        if (!strcmp(argv[i], "--check-upload"))
+                                check_upload = 1;
+
+                        if (!strcmp(argv[i], "--draw-unsorted"))
+                                draw_unsorted = 1;
+
+                        if (!strcmp(argv[i], "--overdraw"))
+                                overdraw = 1;
+
+                        if (!strcmp(argv[i], "--no-lod"))
+                                no_lod = 1;
+
+                        if (!strcmp(argv[i], "--no-occlusion"))
+                                no_occlusion = 1;
+
+                        if (!strcmp(argv[i], "--no-multi-draw"))
+                                no_multi_draw = 1;
                 }
                 pr_debug("\n");
         }
@@ -274,6 +356,31 @@ int main(const int argc, const char *argv[])
 
         mc_program_init(program, &def_config);
 
+        if (upload_thread)
+                program->config.upload_thread = true;
+
+        // Reproducible profiles, all world jobs run inline on main thread
+        if (single_thread)
+                program->config.worker_threads = THREAD_POOL_WORKERS_INLINE;
+
+        // Compare overdraw of both orders, see world_stats_dump()
+        if (draw_unsorted)
+                program->config.draw_front_to_back = false;
+
+        if (overdraw)
+                program->config.overdraw_measure = true;
+
+        // Full detail everywhere, to compare vertex load
+        if (no_lod)
+                program->config.lod_distance = 0.0f;
+
+        if (no_occlusion)
+                program->config.occlusion_query = false;
+
+        // Draw calls per chunk, to compare with batched ones
+        if (no_multi_draw)
+                program->config.multi_draw = false;
+
         // GLFW init
 
         ret = glfw_init();
@@ -281,6 +388,11 @@ int main(const int argc, const char *argv[])
                 goto out;
         }
 
+        if (bench_sched) {
+                ret = thread_sched_benchmark(program->config.worker_threads);
+                goto out_glfw;
+        }
+
         ret = glfw_window_init(&program->window,
                                program->window_width,
                                program->window_height,
@@ -332,21 +444,79 @@ int main(const int argc, const char *argv[])
                 goto out_block_shader;
         }
 
+        block_face_templates_init();
+
+        // Compare --single-thread against workers, nothing is drawn
+        if (check_inline) {
+                int nr_workers = program->config.worker_threads;
+
+                // --single-thread only applies to the inline run
+                if (nr_workers == THREAD_POOL_WORKERS_INLINE)
+                        nr_workers = THREAD_POOL_WORKERS_AUTO;
+
+                thread_helper_init();
+                ret = world_inline_check(nr_workers);
+                thread_helper_deinit();
+                goto out_block_attr;
+        }
+
+        // Compare --upload-thread against render thread uploads, headless
+        if (check_upload) {
+                int nr_workers = program->config.worker_threads;
+
+                // Upload thread needs workers to feed it
+                if (nr_workers == THREAD_POOL_WORKERS_INLINE)
+                        nr_workers = THREAD_POOL_WORKERS_AUTO;
+
+                ret = glfw_upload_window_init(&program->upload_window, program->window);
+                if (ret)
+                        goto out_block_attr;
+
+                thread_helper_init();
+                ret = world_upload_check(nr_workers, program->upload_window);
+                thread_helper_deinit();
+
+                glfwDestroyWindow(program->upload_window);
+                program->upload_window = NULL;
+                goto out_block_attr;
+        }
+
         fps_meter_init(&program->fps);
 
         player_default(mc_player);
         player_init(mc_player);
 
+        // Shared by renderers below and chunk uploads
+        gl_stream_init(GL_STREAM_BUFFER_SIZE);
+
         line_render_init();
         text_render_init();
         thread_helper_init();
         crosshair_textured_init();
 
         world_init(mc_world);
+        world_upload_budget_set(mc_world,
+                                (size_t)program->config.upload_budget_bytes,
+                                (uint32_t)program->config.upload_budget_us);
+        world_update_window_set(mc_world, (uint32_t)program->config.update_window_us);
+        world_draw_order_set(mc_world, program->config.draw_front_to_back);
+        world_overdraw_set(mc_world, program->config.overdraw_measure);
+        world_lod_distance_set(mc_world, program->config.lod_distance);
+        world_occlusion_set(mc_world, program->config.occlusion_query);
+        world_multi_draw_set(mc_world, program->config.multi_draw);
+
+        world_worker_create(mc_world, program->config.worker_threads);
+
+        // Falls back to uploading on render thread
+        if (program->config.upload_thread &&
+            !glfw_upload_window_init(&program->upload_window, program->window) &&
+            world_upload_thread_create(mc_world, program->upload_window)) {
+                glfwDestroyWindow(program->upload_window);
+                program->upload_window = NULL;
+        }
 
+        // Generated chunks are meshed too, uploads start with first frame
         super_flat_generate(mc_world, SUPER_FLAT_GRASS, 128, 128);
-        world_update_chunks(mc_world, 0);
-        world_worker_create(mc_world);
 
         player_position_set(mc_player, (vec3){ 32, 10, 32 });
 
@@ -386,11 +556,19 @@ int main(const int argc, const char *argv[])
         crosshair_textured_deinit();
         text_render_deinit();
         line_render_deinit();
-        thread_helper_deinit();
 
         world_deinit(mc_world);
         player_deinit(mc_player);
 
+        gl_stream_deinit();
+
+        if (program->upload_window)
+                glfwDestroyWindow(program->upload_window);
+
+        // Workers may still hold scratch arenas until world is down
+        thread_helper_deinit();
+
+out_block_attr:
         block_attr_deinit();
 
 out_block_shader:
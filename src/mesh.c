@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <GL/glew.h>
+
+#include "debug.h"
+#include "utils.h"
+#include "glutils.h"
+#include "mesh.h"
+
+/**
+ * Mesh Key
+ */
+
+static inline uint64_t hash_mix64(uint64_t x)
+{
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+
+        return x;
+}
+
+int mesh_key_equal(const mesh_key *a, const mesh_key *b)
+{
+        return (a->hash == b->hash &&
+                a->hash_alt == b->hash_alt &&
+                a->faces == b->faces &&
+                a->range == b->range);
+}
+
+/**
+ * mesh_key_block_add() - accumulate one block into mesh key
+ *
+ * Blocks are combined commutatively, chunks which hold the same blocks
+ * in different list order still produce the same key.
+ *
+ * @param key: pointer to key, zeroed before first call
+ * @param origin_rel: block origin relative to chunk
+ * @param type: block type identity
+ * @param face_mask: visible faces bitmask
+ */
+void mesh_key_block_add(mesh_key *key, const ivec3 origin_rel,
+                        const void *type, uint32_t face_mask)
+{
+        uint64_t v;
+
+        if (!face_mask)
+                return;
+
+        v  = (uint64_t)(uint16_t)origin_rel[X];
+        v |= (uint64_t)(uint16_t)origin_rel[Y] << 16;
+        v |= (uint64_t)(uint16_t)origin_rel[Z] << 32;
+        v |= (uint64_t)(face_mask & 0xffff) << 48;
+
+        v ^= hash_mix64((uint64_t)(uintptr_t)type);
+
+        key->hash += hash_mix64(v);
+        key->hash_alt ^= hash_mix64(v ^ 0x9e3779b97f4a7c15ULL);
+
+        for (uint32_t m = face_mask; m; m &= m - 1)
+                key->faces++;
+}
+
+static inline size_t mesh_key_bucket(const mesh_key *key)
+{
+        return (size_t)(key->hash ^ (key->hash >> 32)) & (MESH_CACHE_BUCKETS - 1);
+}
+
+/**
+ * Mesh Arena
+ */
+
+/**
+ * mesh_arena_init() - create shared mesh buffers and their VAO
+ *
+ * GL context must be current, bound VAO is kept.
+ *
+ * @param ma: pointer to mesh arena
+ * @param nr_vertices: vertex capacity
+ * @param nr_indices: index capacity
+ * @return 0 on success
+ */
+int mesh_arena_init(mesh_arena *ma, size_t nr_vertices, size_t nr_indices)
+{
+        gl_attr glattr = { 0 };
+        GLint vao_prev;
+        int ret;
+
+        if (!ma)
+                return -EINVAL;
+
+        memzero(ma, sizeof(mesh_arena));
+
+        ret = gl_arena_init(&ma->vertices, sizeof(vertex_attr), nr_vertices);
+        if (ret)
+                return ret;
+
+        ret = gl_arena_init(&ma->indices, sizeof(uint32_t), nr_indices);
+        if (ret)
+                goto vertices_deinit;
+
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao_prev);
+
+        glattr.vertex = ma->vertices.buffer;
+        glattr.vbo_index = ma->indices.buffer;
+
+        ma->vao = vertex_array_create();
+        gl_vbo_attrib_bind(&glattr);
+
+        glBindVertexArray((GLuint)vao_prev);
+
+        atomic_init(&ma->fallbacks, 0);
+
+        return 0;
+
+vertices_deinit:
+        gl_arena_deinit(&ma->vertices);
+
+        return ret;
+}
+
+int mesh_arena_deinit(mesh_arena *ma)
+{
+        if (!ma || !ma->vao)
+                return -EINVAL;
+
+        vertex_array_delete(&ma->vao);
+
+        gl_arena_deinit(&ma->indices);
+        gl_arena_deinit(&ma->vertices);
+
+        return 0;
+}
+
+/**
+ * mesh_arena_fence() - let ranges of freed meshes be reused once drawn
+ *
+ * @param ma: pointer to mesh arena, render thread after frame draws
+ */
+void mesh_arena_fence(mesh_arena *ma)
+{
+        if (!ma || !ma->vao)
+                return;
+
+        gl_arena_fence(&ma->vertices);
+        gl_arena_fence(&ma->indices);
+}
+
+/**
+ * mesh_arena_upload() - place staged mesh data into arena
+ *
+ * @param ma: pointer to mesh arena
+ * @param m: pointer to mesh with staging data, may be empty
+ * @param stream: copy through stream ring, render thread only
+ * @return 0 on success, -ENOMEM if arena is full
+ */
+int mesh_arena_upload(mesh_arena *ma, chunk_mesh *m, int stream)
+{
+        gl_vbo *vbo;
+        int ret;
+
+        if (!ma || !m || !ma->vao)
+                return -EINVAL;
+
+        vbo = &m->glvbo;
+
+        // Nothing to draw, nothing to allocate, draws use arena VAO anyway
+        if (!vbo->vertex_count || !vbo->index_count) {
+                m->arena = ma;
+                m->glattr.vertex_count = 0;
+                return 0;
+        }
+
+        ret = gl_arena_alloc(&ma->vertices, vbo->vertex_count, &m->vertex_range);
+        if (ret)
+                return ret;
+
+        ret = gl_arena_alloc(&ma->indices, vbo->index_count, &m->index_range);
+        if (ret) {
+                gl_arena_free(&ma->vertices, &m->vertex_range);
+                return ret;
+        }
+
+        gl_arena_write(&ma->vertices, &m->vertex_range, gl_vbo_vertices(vbo), stream);
+        gl_arena_write(&ma->indices, &m->index_range, gl_vbo_indices(vbo), stream);
+
+        m->arena = ma;
+        m->glattr.vertex_count = (GLsizei)vbo->index_count;
+
+        return 0;
+}
+
+/**
+ * Chunk Mesh
+ */
+
+chunk_mesh *chunk_mesh_alloc(const mesh_key *key)
+{
+        chunk_mesh *m;
+
+        m = memalloc(sizeof(chunk_mesh));
+        if (!m) {
+                pr_err_alloc();
+                return NULL;
+        }
+
+        if (key)
+                memcpy(&m->key, key, sizeof(mesh_key));
+
+        gl_vbo_init(&m->glvbo);
+        gl_attr_init(&m->glattr);
+
+        return m;
+}
+
+void chunk_mesh_free(chunk_mesh **m)
+{
+        if (!m || !*m)
+                return;
+
+        for (int i = 0; i < MESH_LODS - 1; ++i)
+                chunk_mesh_free(&(*m)->lods[i]);
+
+        gl_vbo_deinit(&(*m)->glvbo);
+
+        if ((*m)->vao)
+                vertex_array_delete(&(*m)->vao);
+
+        if ((*m)->arena) {
+                gl_arena_free(&(*m)->arena->vertices, &(*m)->vertex_range);
+                gl_arena_free(&(*m)->arena->indices, &(*m)->index_range);
+        }
+
+        if ((*m)->uploaded)
+                gl_attr_buffer_delete(&(*m)->glattr);
+
+        memfree((void **)m);
+}
+
+/**
+ * Mesh Cache
+ */
+
+static inline void mesh_lru_unlink(mesh_cache *mc, chunk_mesh *m)
+{
+        if (m->lru_prev)
+                m->lru_prev->lru_next = m->lru_next;
+        else
+                mc->lru_head = m->lru_next;
+
+        if (m->lru_next)
+                m->lru_next->lru_prev = m->lru_prev;
+        else
+                mc->lru_tail = m->lru_prev;
+
+        m->lru_prev = NULL;
+        m->lru_next = NULL;
+
+        mc->stats.idle--;
+}
+
+static inline void mesh_lru_push(mesh_cache *mc, chunk_mesh *m)
+{
+        m->lru_prev = NULL;
+        m->lru_next = mc->lru_head;
+
+        if (mc->lru_head)
+                mc->lru_head->lru_prev = m;
+        else
+                mc->lru_tail = m;
+
+        mc->lru_head = m;
+
+        mc->stats.idle++;
+}
+
+static inline void mesh_hash_unlink(mesh_cache *mc, chunk_mesh *m)
+{
+        chunk_mesh **pos = &mc->buckets[mesh_key_bucket(&m->key)];
+
+        while (*pos) {
+                if (*pos == m) {
+                        *pos = m->hash_next;
+                        break;
+                }
+
+                pos = &(*pos)->hash_next;
+        }
+
+        m->hash_next = NULL;
+        mc->stats.meshes--;
+}
+
+static inline chunk_mesh *__mesh_cache_lookup(mesh_cache *mc, const mesh_key *key)
+{
+        chunk_mesh *pos;
+
+        for (pos = mc->buckets[mesh_key_bucket(key)]; pos; pos = pos->hash_next) {
+                if (mesh_key_equal(&pos->key, key))
+                        return pos;
+        }
+
+        return NULL;
+}
+
+static inline void __mesh_cache_ref(mesh_cache *mc, chunk_mesh *m)
+{
+        if (m->refcount == 0)
+                mesh_lru_unlink(mc, m);
+
+        m->refcount++;
+}
+
+int mesh_cache_init(mesh_cache *mc, size_t idle_max)
+{
+        if (!mc)
+                return -EINVAL;
+
+        memzero(mc, sizeof(mesh_cache));
+
+        mc->idle_max = idle_max;
+
+        pthread_mutex_init(&mc->lock, NULL);
+
+        return 0;
+}
+
+/**
+ * mesh_cache_deinit() - free all meshes, GL context must be current
+ *
+ * @param mc: pointer to mesh cache
+ * @return 0 on success
+ */
+int mesh_cache_deinit(mesh_cache *mc)
+{
+        if (!mc)
+                return -EINVAL;
+
+        pthread_mutex_lock(&mc->lock);
+
+        for (int i = 0; i < MESH_CACHE_BUCKETS; ++i) {
+                chunk_mesh *pos = mc->buckets[i];
+
+                while (pos) {
+                        chunk_mesh *next = pos->hash_next;
+
+                        if (pos->refcount)
+                                pr_err_func("mesh still has %d references\n",
+                                            pos->refcount);
+
+                        chunk_mesh_free(&pos);
+                        pos = next;
+                }
+
+                mc->buckets[i] = NULL;
+        }
+
+        pthread_mutex_unlock(&mc->lock);
+
+        pthread_mutex_destroy(&mc->lock);
+
+        return 0;
+}
+
+/**
+ * mesh_cache_get() - look up and reference a finished mesh
+ *
+ * @param mc: pointer to mesh cache
+ * @param key: mesh content key
+ * @return referenced mesh, NULL on miss
+ */
+chunk_mesh *mesh_cache_get(mesh_cache *mc, const mesh_key *key)
+{
+        chunk_mesh *m;
+
+        if (!mc || !key)
+                return NULL;
+
+        pthread_mutex_lock(&mc->lock);
+
+        m = __mesh_cache_lookup(mc, key);
+        if (m) {
+                __mesh_cache_ref(mc, m);
+                mc->stats.hits++;
+        } else {
+                mc->stats.misses++;
+        }
+
+        pthread_mutex_unlock(&mc->lock);
+
+        return m;
+}
+
+/**
+ * mesh_cache_add() - insert newly built mesh and reference it
+ *
+ * If another worker inserted the same key meanwhile, given mesh is freed
+ * and the cached one is returned instead.
+ *
+ * @param mc: pointer to mesh cache
+ * @param m: mesh to insert, not uploaded yet
+ * @return referenced mesh
+ */
+chunk_mesh *mesh_cache_add(mesh_cache *mc, chunk_mesh *m)
+{
+        chunk_mesh *exist;
+        size_t bucket;
+
+        if (!mc || !m)
+                return NULL;
+
+        pthread_mutex_lock(&mc->lock);
+
+        exist = __mesh_cache_lookup(mc, &m->key);
+        if (exist) {
+                __mesh_cache_ref(mc, exist);
+                pthread_mutex_unlock(&mc->lock);
+
+                chunk_mesh_free(&m);
+
+                return exist;
+        }
+
+        bucket = mesh_key_bucket(&m->key);
+
+        m->refcount = 1;
+        m->hash_next = mc->buckets[bucket];
+        mc->buckets[bucket] = m;
+        mc->stats.meshes++;
+
+        pthread_mutex_unlock(&mc->lock);
+
+        return m;
+}
+
+/**
+ * mesh_cache_ref() - take one more reference of mesh caller holds
+ *
+ * @param mc: pointer to mesh cache
+ * @param m: pointer to referenced mesh
+ */
+void mesh_cache_ref(mesh_cache *mc, chunk_mesh *m)
+{
+        if (!mc || !m)
+                return;
+
+        pthread_mutex_lock(&mc->lock);
+        __mesh_cache_ref(mc, m);
+        pthread_mutex_unlock(&mc->lock);
+}
+
+/**
+ * mesh_cache_put() - drop one reference of mesh
+ *
+ * Unreferenced meshes stay cached in LRU until mesh_cache_trim().
+ *
+ * @param mc: pointer to mesh cache
+ * @param m: pointer to mesh
+ */
+void mesh_cache_put(mesh_cache *mc, chunk_mesh *m)
+{
+        if (!mc || !m)
+                return;
+
+        pthread_mutex_lock(&mc->lock);
+
+        if (m->refcount <= 0) {
+                pr_err_func("mesh refcount underflow\n");
+                goto unlock;
+        }
+
+        m->refcount--;
+        if (m->refcount == 0)
+                mesh_lru_push(mc, m);
+
+unlock:
+        pthread_mutex_unlock(&mc->lock);
+}
+
+/**
+ * mesh_cache_trim() - evict least recently used idle meshes
+ *
+ * Deletes GL buffers, call from GL context thread only.
+ *
+ * @param mc: pointer to mesh cache
+ * @return evicted mesh count
+ */
+int mesh_cache_trim(mesh_cache *mc)
+{
+        chunk_mesh *evict = NULL;
+        int ret = 0;
+
+        if (!mc)
+                return 0;
+
+        pthread_mutex_lock(&mc->lock);
+
+        while (mc->stats.idle > mc->idle_max && mc->lru_tail) {
+                chunk_mesh *m = mc->lru_tail;
+
+                mesh_lru_unlink(mc, m);
+                mesh_hash_unlink(mc, m);
+
+                // Reuse hash link to chain evicted meshes
+                m->hash_next = evict;
+                evict = m;
+
+                mc->stats.evictions++;
+                ret++;
+        }
+
+        pthread_mutex_unlock(&mc->lock);
+
+        while (evict) {
+                chunk_mesh *next = evict->hash_next;
+
+                chunk_mesh_free(&evict);
+                evict = next;
+        }
+
+        return ret;
+}
@@ -0,0 +1,107 @@
+#ifndef MYCRAFT_DEMO_MESH_H
+#define MYCRAFT_DEMO_MESH_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "utils.h"
+#include "glutils.h"
+
+#define MESH_CACHE_BUCKETS              (4096)
+#define MESH_CACHE_IDLE_MAX             (256)
+
+// Full resolution, then each level downsampled by 2 more
+#define MESH_LODS                       (3)
+
+/**
+ * Mesh content key, computed on chunk relative coordinates,
+ * identical chunks produce identical keys wherever they are.
+ */
+typedef struct mesh_key {
+        uint64_t                hash;
+        uint64_t                hash_alt;
+        uint32_t                faces;
+        uint32_t                range;
+} mesh_key;
+
+/**
+ * Vertex and index storage shared by chunk meshes, drawn through one VAO
+ * with base vertex, so meshes keep their indices mesh relative.
+ */
+typedef struct mesh_arena {
+        gl_arena                vertices;
+        gl_arena                indices;
+        GLuint                  vao;
+        atomic_ullong           fallbacks;      // meshes given own buffers
+} mesh_arena;
+
+typedef struct chunk_mesh {
+        mesh_key                key;
+        int32_t                 refcount;
+
+        gl_vbo                  glvbo;          // CPU data, freed once uploaded
+        gl_attr                 glattr;         // GPU buffers
+        atomic_int              uploaded;       // set once GPU copy is complete
+        atomic_int              upload_failed;  // upload thread gave it up
+        GLuint                  vao;            // render context, made at flush
+
+        // Set if data lives in arena instead of own buffers
+        mesh_arena              *arena;
+        gl_arena_range          vertex_range;
+        gl_arena_range          index_range;
+
+        // Index range of each cube_face_idx direction
+        GLsizei                 face_first[CUBE_QUAD_FACES];
+        GLsizei                 face_count[CUBE_QUAD_FACES];
+
+        // Coarser levels built with it, owned, uploaded along
+        struct chunk_mesh       *lods[MESH_LODS - 1];
+
+        struct chunk_mesh       *hash_next;
+        struct chunk_mesh       *lru_prev;
+        struct chunk_mesh       *lru_next;
+} chunk_mesh;
+
+typedef struct mesh_cache_stats {
+        uint64_t                hits;
+        uint64_t                misses;
+        uint64_t                evictions;
+        uint64_t                meshes;
+        uint64_t                idle;
+} mesh_cache_stats;
+
+typedef struct mesh_cache {
+        chunk_mesh              *buckets[MESH_CACHE_BUCKETS];
+
+        // Unreferenced meshes, most recently used at head
+        chunk_mesh              *lru_head;
+        chunk_mesh              *lru_tail;
+        size_t                  idle_max;
+
+        mesh_cache_stats        stats;
+
+        pthread_mutex_t         lock;
+} mesh_cache;
+
+int mesh_key_equal(const mesh_key *a, const mesh_key *b);
+void mesh_key_block_add(mesh_key *key, const ivec3 origin_rel,
+                        const void *type, uint32_t face_mask);
+
+int mesh_arena_init(mesh_arena *ma, size_t nr_vertices, size_t nr_indices);
+int mesh_arena_deinit(mesh_arena *ma);
+void mesh_arena_fence(mesh_arena *ma);
+int mesh_arena_upload(mesh_arena *ma, chunk_mesh *m, int stream);
+
+chunk_mesh *chunk_mesh_alloc(const mesh_key *key);
+void chunk_mesh_free(chunk_mesh **m);
+
+int mesh_cache_init(mesh_cache *mc, size_t idle_max);
+int mesh_cache_deinit(mesh_cache *mc);
+chunk_mesh *mesh_cache_get(mesh_cache *mc, const mesh_key *key);
+chunk_mesh *mesh_cache_add(mesh_cache *mc, chunk_mesh *m);
+void mesh_cache_ref(mesh_cache *mc, chunk_mesh *m);
+void mesh_cache_put(mesh_cache *mc, chunk_mesh *m);
+int mesh_cache_trim(mesh_cache *mc);
+
+#endif //MYCRAFT_DEMO_MESH_H
@@ -6,6 +6,10 @@
 
 #include <GL/glew.h>
 
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
 #include "block.h"
 #include "debug.h"
 #include "utils.h"
@@ -13,22 +17,11 @@
 #include "model.h"
 #include "chunks.h"
 
-enum texel_corner {
-        LOWER_LEFT = 0,
-        LOWER_RIGHT,
-        UPPER_LEFT,
-        UPPER_RIGHT,
-        NR_TEXEL_CORNER,
-};
-
 typedef enum cube_face_vertices {
-        UL  = CUBE_FACE_UL,
-        UR  = CUBE_FACE_UR,
-        LL  = CUBE_FACE_LL,
-        LR  = CUBE_FACE_LR,
-
-        UR1 = V4,
-        LL1 = V6,
+        UL  = QUAD_UL,
+        UR  = QUAD_UR,
+        LL  = QUAD_LL,
+        LR  = QUAD_LR,
 } cube_face_vertices;
 
 // Normalized, not rotated
@@ -41,282 +34,191 @@ static vec3 cube_normals[] = {
         [CUBE_RIGHT]    = {  1.0f,  0.0f,  0.0f },
 };
 
-int block_model_face_init(block_face *f)
-{
-        size_t face_vertices = VERTICES_TRIANGULATE_QUAD;
-
-        if (!f)
-                return -EINVAL;
-
-        if (!f->visible)
-                return 0;
-
-        f->vertices = memalloc(sizeof(vertex_attr) * face_vertices);
-        if (!f->vertices) {
-                pr_err_alloc();
-                return -ENOMEM;
-        }
-
-        return 0;
-}
-
-int block_model_face_deinit(block_face *f)
-{
-        if (!f)
-                return -EINVAL;
+// Corner offsets from block center of a unit cube, multiplied by model size
+static const float cube_corner_offsets[CUBE_QUAD_FACES][VERTICES_QUAD][3] = {
+        [CUBE_FRONT] = {
+                [UL] = { -0.5f,  0.5f,  0.5f },
+                [UR] = {  0.5f,  0.5f,  0.5f },
+                [LL] = { -0.5f, -0.5f,  0.5f },
+                [LR] = {  0.5f, -0.5f,  0.5f },
+        },
+        [CUBE_BACK] = {
+                [UL] = {  0.5f,  0.5f, -0.5f },
+                [UR] = { -0.5f,  0.5f, -0.5f },
+                [LL] = {  0.5f, -0.5f, -0.5f },
+                [LR] = { -0.5f, -0.5f, -0.5f },
+        },
+        [CUBE_TOP] = {
+                [UL] = { -0.5f,  0.5f, -0.5f },
+                [UR] = {  0.5f,  0.5f, -0.5f },
+                [LL] = { -0.5f,  0.5f,  0.5f },
+                [LR] = {  0.5f,  0.5f,  0.5f },
+        },
+        [CUBE_BOTTOM] = {
+                [UL] = { -0.5f, -0.5f,  0.5f },
+                [UR] = {  0.5f, -0.5f,  0.5f },
+                [LL] = { -0.5f, -0.5f, -0.5f },
+                [LR] = {  0.5f, -0.5f, -0.5f },
+        },
+        [CUBE_LEFT] = {
+                [UL] = { -0.5f,  0.5f, -0.5f },
+                [UR] = { -0.5f,  0.5f,  0.5f },
+                [LL] = { -0.5f, -0.5f, -0.5f },
+                [LR] = { -0.5f, -0.5f,  0.5f },
+        },
+        [CUBE_RIGHT] = {
+                [UL] = {  0.5f,  0.5f,  0.5f },
+                [UR] = {  0.5f,  0.5f, -0.5f },
+                [LL] = {  0.5f, -0.5f,  0.5f },
+                [LR] = {  0.5f, -0.5f, -0.5f },
+        },
+};
 
-        if (f->vertices)
-                memfree((void **)&f->vertices);
+// Texel uv are stored LL[0] -> UL -> UR -> LR, pick corner by rotation
+static const int texel_rotated_seq[NR_TEXEL_ROTATE][VERTICES_QUAD] = {
+        [TEXEL_ROTATE_0]   = { LL, UL, UR, LR },
+        [TEXEL_ROTATE_90]  = { LR, LL, UL, UR },
+        [TEXEL_ROTATE_180] = { UR, LR, LL, UL },
+        [TEXEL_ROTATE_270] = { UL, UR, LR, LL },
+};
 
-        return 0;
-}
+/**
+ * Each (block type, face) corner is precomputed in staging layout:
+ * position offset from block origin, corner normal and uv. A face in
+ * chunk is then just its template plus block origin.
+ */
+static _Alignas(32) vertex_attr face_templates[NR_BLOCK_TYPE][CUBE_QUAD_FACES][VERTICES_QUAD];
 
-static void block_model_face_vertex(block_face *face, block_attr *blk_attr,
-                                    const vec3 origin_gl, float scale, int face_idx)
+static void face_template_generate(vertex_attr *v, block_attr *blk_attr, int face_idx)
 {
-        float w = blk_attr->size_model.width * scale;
-        float h = blk_attr->size_model.height * scale;
-        float l = blk_attr->size_model.length * scale;
-        vertex_attr *v = face->vertices;
-
-        switch (face_idx) {
-                case CUBE_FRONT:
-                        v[UL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[LR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        break;
-
-                case CUBE_BACK:
-                        v[UL].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LR].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        break;
-
-                case CUBE_TOP:
-                        v[UL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[LR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        break;
-
-                case CUBE_BOTTOM:
-                        v[UL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        break;
-
-                case CUBE_LEFT:
-                        v[UL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LR].position[X] = origin_gl[X] - (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        break;
-
-                case CUBE_RIGHT:
-                        v[UL].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UL].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
-
-                        v[UR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[UR].position[Y] = origin_gl[Y] + (1.0f / 2.0f) * h;
-                        v[UR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
-
-                        v[LL].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LL].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LL].position[Z] = origin_gl[Z] + (1.0f / 2.0f) * l;
+        float size[NR_VEC3_ATTR] = {
+                [X] = blk_attr->size_model.width,
+                [Y] = blk_attr->size_model.height,
+                [Z] = blk_attr->size_model.length,
+        };
 
-                        v[LR].position[X] = origin_gl[X] + (1.0f / 2.0f) * w;
-                        v[LR].position[Y] = origin_gl[Y] - (1.0f / 2.0f) * h;
-                        v[LR].position[Z] = origin_gl[Z] - (1.0f / 2.0f) * l;
+        for (int i = 0; i < VERTICES_QUAD; ++i) {
+                for (int j = 0; j < NR_VEC3_ATTR; ++j) {
+                        float offset = cube_corner_offsets[face_idx][i][j];
 
-                        break;
+                        v[i].position[j] = offset * size[j];
 
-                default:
-                        break;
+                        // Sum of surrounding face normals
+                        v[i].normal[j] = (offset > 0) ? 1.0f : -1.0f;
+                }
         }
 
-        // Duplicate vertices
-        memcpy(v[UR1].position, v[UR].position, sizeof(vec3));
-        memcpy(v[LL1].position, v[LL].position, sizeof(vec3));
-}
-
-static void block_model_face_vertex_uv(block_face *face, block_attr *blk_attr,
-                                       int face_idx)
-{
-        int rotation = blk_attr->texel.texel_rotation[face_idx];
-        int rotated_seq[][4] = {
-                [TEXEL_ROTATE_0]   = { LL, UL, UR, LR },
-                [TEXEL_ROTATE_90]  = { LR, LL, UL, UR },
-                [TEXEL_ROTATE_180] = { UR, LR, LL, UL },
-                [TEXEL_ROTATE_270] = { UL, UR, LR, LL },
-        };
-
-        vec2 uv_seq[VERTICES_QUAD];
-        vertex_attr *v = face->vertices;
-
         if (!blk_attr->texel.textured)
                 return;
 
-        memcpy(uv_seq, blk_attr->texel.uv[face_idx], sizeof(uv_seq));
+        for (int i = 0; i < VERTICES_QUAD; ++i) {
+                int rotation = blk_attr->texel.texel_rotation[face_idx];
+                int j = texel_rotated_seq[rotation][i];
 
-        for (int i = 0; i < NR_TEXEL_CORNER; ++i) {
-                int j = rotated_seq[rotation][i];  // Pick vertex by rotation
-                memcpy(v[j].uv, uv_seq[i], sizeof(vec2));
+                memcpy(v[j].uv, blk_attr->texel.uv[face_idx][i], sizeof(vec2));
         }
-
-        // Duplicate vertices
-        memcpy(v[UR1].uv, v[UR].uv, sizeof(vec2));
-        memcpy(v[LL1].uv, v[LL].uv, sizeof(vec2));
 }
 
-void block_model_face_vertex_normal(block_face *face, const vec3 origin_gl)
+/**
+ * block_face_templates_init() - precompute face corner templates
+ *
+ * Must be called after block_attr_init(), texel uv are needed.
+ *
+ * @return 0 on success
+ */
+int block_face_templates_init(void)
 {
-        vec3 surround_normals[3];
-        vertex_attr *v = face->vertices;
-
-        for (int i = 0; i < VERTICES_TRIANGULATE_QUAD; ++i) {
-                if ((v[i].position[X] - origin_gl[X]) > 0) {
-                        glm_vec_copy(cube_normals[CUBE_RIGHT], surround_normals[0]);
-                } else {
-                        glm_vec_copy(cube_normals[CUBE_LEFT], surround_normals[0]);
-                }
+        for (int i = 0; i < NR_BLOCK_TYPE; ++i) {
+                block_attr *blk_attr = block_attr_get(i);
 
-                if ((v[i].position[Y] - origin_gl[Y]) > 0) {
-                        glm_vec_copy(cube_normals[CUBE_TOP], surround_normals[1]);
-                } else {
-                        glm_vec_copy(cube_normals[CUBE_BOTTOM], surround_normals[1]);
-                }
-
-                if ((v[i].position[Z] - origin_gl[Z]) > 0) {
-                        glm_vec_copy(cube_normals[CUBE_FRONT], surround_normals[2]);
-                } else {
-                        glm_vec_copy(cube_normals[CUBE_BACK], surround_normals[2]);
-                }
+                if (!blk_attr)
+                        continue;
 
-                for (uint32_t j = 0; j < ARRAY_SIZE(surround_normals); ++j) {
-                        v[i].normal[X] += surround_normals[j][X];
-                        v[i].normal[Y] += surround_normals[j][Y];
-                        v[i].normal[Z] += surround_normals[j][Z];
-                }
+                for (int j = 0; j < CUBE_QUAD_FACES; ++j)
+                        face_template_generate(face_templates[i][j], blk_attr, j);
         }
-}
 
-static inline void block_model_face_normal(block_face *face, int idx)
-{
-        face->normal[X] = cube_normals[idx][X];
-        face->normal[Y] = cube_normals[idx][Y];
-        face->normal[Z] = cube_normals[idx][Z];
+        return 0;
 }
 
 /**
- * block_model_face_generate() - generate single block face vertices
+ * block_face_batch_generate() - emit interleaved corners of faces
  *
- * @param f: pointer to face
- * @param m: pointer to model
- * @param attr: pointer to block attribute
- * @param idx: face index
- * @return 0 on success
+ * Each corner is one vertex_attr of 8 floats, computed as template plus
+ * (x, y, z, 0, 0, 0, 0, 0), that is a single AVX lane set per corner,
+ * or two SSE ones.
+ *
+ * @param out: output, VERTICES_QUAD corners for each face
+ * @param origins: block origins, w component must be 0
+ * @param faces: face indices
+ * @param slots: block types, selecting texel atlas uv
+ * @param count: faces count
  */
-int block_model_face_generate(block_face *f, block_model *m, block_attr *attr,
-                              float scale, int idx)
+void block_face_batch_generate(vertex_attr *out, const vec4 *origins,
+                               const uint8_t *faces, const uint8_t *slots,
+                               size_t count)
 {
-        if (!f || !m || !attr)
-                return -EINVAL;
-
-        if (!f->visible)
-                return 0;
+        for (size_t i = 0; i < count; ++i) {
+                const vertex_attr *tmpl = face_templates[slots[i]][faces[i]];
+                vertex_attr *v = &out[i * VERTICES_QUAD];
 
-        if (!f->vertices)
-                return -ENODATA;
+#if defined(__AVX__)
+                __m256 o = _mm256_insertf128_ps(_mm256_setzero_ps(),
+                                                _mm_loadu_ps(origins[i]), 0);
 
-        block_model_face_vertex(f, attr, m->origin_gl, scale, idx);
-        block_model_face_vertex_normal(f, m->origin_gl);
-        block_model_face_vertex_uv(f, attr, idx);
+                for (int k = 0; k < VERTICES_QUAD; ++k) {
+                        __m256 t = _mm256_load_ps((const float *)&tmpl[k]);
+                        _mm256_storeu_ps((float *)&v[k], _mm256_add_ps(t, o));
+                }
+#elif defined(__SSE__)
+                __m128 o = _mm_loadu_ps(origins[i]);
 
-        block_model_face_normal(f, idx);
+                for (int k = 0; k < VERTICES_QUAD; ++k) {
+                        const float *t = (const float *)&tmpl[k];
+                        float *d = (float *)&v[k];
 
-        return 0;
+                        _mm_storeu_ps(d, _mm_add_ps(_mm_load_ps(t), o));
+                        _mm_storeu_ps(d + 4, _mm_load_ps(t + 4));
+                }
+#else
+                for (int k = 0; k < VERTICES_QUAD; ++k) {
+                        memcpy(&v[k], &tmpl[k], sizeof(vertex_attr));
+                        glm_vec_add(v[k].position, (float *)origins[i], v[k].position);
+                }
+#endif
+        }
 }
 
-int block_model_generate(block_model *model, block_attr *blk_attr, float scale)
+/**
+ * block_face_corners_get() - compute face corner positions on demand
+ *
+ * @param blk_attr: pointer to block attribute
+ * @param face_idx: face index
+ * @param origin_gl: block origin
+ * @param corners: output corners, in quad_corner order
+ */
+void block_face_corners_get(block_attr *blk_attr, int face_idx,
+                            const vec3 origin_gl, vec3 corners[VERTICES_QUAD])
 {
-        if (!model || !blk_attr)
-                return -EINVAL;
-
-        for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
-                block_face *face = &(model->faces[i]);
+        float size[NR_VEC3_ATTR] = {
+                [X] = blk_attr->size_model.width,
+                [Y] = blk_attr->size_model.height,
+                [Z] = blk_attr->size_model.length,
+        };
 
-                if (block_model_face_generate(face, model, blk_attr, scale, i)) {
-                        pr_err_func("block model (%f, %f, %f) face %d failed\n",
-                                    model->origin_gl[X], model->origin_gl[Y],
-                                    model->origin_gl[Z], i);
+        for (int i = 0; i < VERTICES_QUAD; ++i) {
+                for (int j = 0; j < NR_VEC3_ATTR; ++j) {
+                        corners[i][j] = origin_gl[j] +
+                                        cube_corner_offsets[face_idx][i][j] * size[j];
                 }
         }
+}
 
-        return 0;
+void block_model_face_normal(block_face *face, int idx)
+{
+        face->normal[X] = cube_normals[idx][X];
+        face->normal[Y] = cube_normals[idx][Y];
+        face->normal[Z] = cube_normals[idx][Z];
 }
 
 int block_model_init(block_model *model, vec3 origin_gl)
@@ -336,11 +238,6 @@ int block_model_deinit(block_model *model)
         if (!model)
                 return -EINVAL;
 
-        for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
-                block_face *f = &(model->faces[i]);
-                block_model_face_deinit(f);
-        }
-
         return 0;
 }
 
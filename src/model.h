@@ -7,13 +7,15 @@
 #include "glutils.h"
 #include "block.h"
 
-#define CUBE_FACE_UL                            (V1)
-#define CUBE_FACE_UR                            (V2)
-#define CUBE_FACE_LL                            (V3)
-#define CUBE_FACE_LR                            (V5)
+// Corner order of a face, as emitted into mesh
+typedef enum quad_corner {
+        QUAD_UL = 0,
+        QUAD_UR,
+        QUAD_LL,
+        QUAD_LR,
+} quad_corner;
 
 typedef struct block_face {
-        vertex_attr     *vertices;
         vec3            normal;
         int             visible;
 } block_face;
@@ -24,12 +26,14 @@ typedef struct block_model {
         block_face      faces[CUBE_QUAD_FACES];
 } block_model;
 
-int block_model_face_generate(block_face *f, block_model *m, block_attr *attr,
-                              float scale, int idx);
-int block_model_face_init(block_face *f);
-int block_model_face_deinit(block_face *f);
+int block_face_templates_init(void);
+void block_face_batch_generate(vertex_attr *out, const vec4 *origins,
+                               const uint8_t *faces, const uint8_t *slots,
+                               size_t count);
+void block_face_corners_get(block_attr *blk_attr, int face_idx,
+                            const vec3 origin_gl, vec3 corners[VERTICES_QUAD]);
+void block_model_face_normal(block_face *face, int idx);
 
-int block_model_generate(block_model *model, block_attr *blk_attr, float scale);
 int block_model_init(block_model *model, vec3 origin_gl);
 int block_model_deinit(block_model *model);
 
@@ -31,6 +31,16 @@ typedef struct mc_config {
         int32_t         cursor_speed;
         int32_t         show_fps;
         int32_t         no_clip;
+        int32_t         worker_threads;
+        int32_t         upload_budget_bytes;    // per frame, 0 unlimited
+        int32_t         upload_budget_us;       // per frame, 0 unlimited
+        int32_t         update_window_us;       // rebuild coalescing, 0 off
+        int32_t         upload_thread;          // upload on shared context
+        int32_t         draw_front_to_back;     // chunk draw order
+        int32_t         overdraw_measure;       // count samples passed
+        float           lod_distance;           // coarser chunk meshes, 0 off
+        int32_t         occlusion_query;        // hide chunks behind drawn ones
+        int32_t         multi_draw;             // batch chunks per GL state
 } mc_config;
 
 typedef enum program_state {
@@ -45,6 +55,7 @@ typedef struct mc_program {
         mc_config       config;
 
         GLFWwindow      *window;
+        GLFWwindow      *upload_window;         // hidden, shares objects
         int32_t         window_width;
         int32_t         window_height;
 
@@ -208,18 +208,13 @@ static inline int vec3_in_range(vec3 t, vec3 a, vec3 b)
  *
  * this method is very conditional, it requires block is axis-aligned.
  *
- * @param face: block face to detect
+ * @param corners: block face corners
  * @param point: contact point
  * @return 1 on true, 0 on false
  */
-static inline int point_is_on_block_face(block_face *face, vec3 point)
+static inline int point_is_on_block_face(vec3 corners[VERTICES_QUAD], vec3 point)
 {
-        vec3 v1, v2;
-
-        glm_vec_copy(face->vertices[CUBE_FACE_UL].position, v1);
-        glm_vec_copy(face->vertices[CUBE_FACE_LR].position, v2);
-
-        if (!vec3_in_range(point, v1, v2))
+        if (!vec3_in_range(point, corners[QUAD_UL], corners[QUAD_LR]))
                 return 0;
 
         return 1;
@@ -247,6 +242,7 @@ block_face *player_hittest_block_face(player *p, block *b)
         for (int i = 0; i < CUBE_QUAD_FACES; ++i) {
                 block_face *f = &b->model.faces[i];
                 camera *cam = &p->cam;
+                vec3 corners[VERTICES_QUAD];
                 vec3 ray = { 0 };
                 vec3 contact = { 0 };
 
@@ -255,10 +251,9 @@ block_face *player_hittest_block_face(player *p, block *b)
                 if (!f->visible)
                         continue;
 
-                if (!f->vertices)
-                        continue;
+                block_face_corners_get(b->blk_attr, i, b->model.origin_gl, corners);
 
-                if (face_is_back_face(f->vertices[V1].position,
+                if (face_is_back_face(corners[QUAD_UL],
                                       f->normal,
                                       cam->position))
                         continue;
@@ -267,10 +262,10 @@ block_face *player_hittest_block_face(player *p, block *b)
                                                cam->vector_front,
                                                cam->position,
                                                f->normal,
-                                               f->vertices[V1].position))
+                                               corners[QUAD_UL]))
                         continue;
 
-                if (!point_is_on_block_face(f, contact))
+                if (!point_is_on_block_face(corners, contact))
                         continue;
 
                 return f;
@@ -410,6 +405,9 @@ int player_ray_hittest(player *p, world *w, int radius)
         int h_min = clamp(origin_pb[Y] - radius, w->height_min, w->height_max);
         int h_max = clamp(origin_pb[Y] + radius, w->height_min, w->height_max);
 
+        // Hit blocks are pointers into chunk storage, keep them alive
+        epoch_read_lock();
+
         for (int h = h_min; h <= h_max; ++h) {
                 block *b;
                 block_face *f;
@@ -424,7 +422,7 @@ int player_ray_hittest(player *p, world *w, int radius)
                         if (!block_in_distance(origin_b, origin_pb, radius))
                                 continue;
 
-                        b = world_get_block(w, origin_b, L_NOWAIT);
+                        b = world_get_block(w, origin_b);
                         if (b == NULL)
                                 continue;
 
@@ -444,10 +442,12 @@ int player_ray_hittest(player *p, world *w, int radius)
         hit_block *nearest = hit_block_nearest_get(&hit_blocks, origin_pb);
 
         hittest->hit = 1;
-        hittest->face = nearest->f;
+        memcpy(&hittest->face, nearest->f, sizeof(block_face));
         ivec3_copy(nearest->b->origin_l, hittest->origin_b);
 
 out:
+        epoch_read_unlock();
+
         linklist_deinit(&ray_blocks);
         linklist_deinit(&hit_blocks);
 
@@ -665,7 +665,7 @@ int player_collision_test(player *p, world *w, vec3 origin_t)
 
         for (int i = 0; i < VERTICES_COLLISION_TEST; ++i) {
                 if (collision_test_block_point(test_vertices[i], origin_d)) {
-                        if (world_get_block(w, origin_d, L_WAIT))
+                        if (world_get_block(w, origin_d))
                                 return 1;
                 }
         }
@@ -1038,7 +1038,7 @@ void player_action_destroy(player *p, world *w)
 void player_action_place(player *p, world *w)
 {
         player_hittest *hit_test = &p->hittest;
-        block_face *f = hit_test->face;
+        block_face *f = &hit_test->face;
         ivec3 origin_new = { 0 };
         ivec3 f_normal = { 0 };
         block block_n;
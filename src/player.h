@@ -72,7 +72,7 @@ typedef struct player_attr {
 typedef struct player_hittest {
         int             hit;
         ivec3           origin_b;
-        block_face      *face;
+        block_face      face;           // copy, block may be gone
 } player_hittest;
 
 typedef struct player_item {
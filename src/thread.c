@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <memory.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -16,6 +18,15 @@
 pthread_attr_t thread_attr_join;
 pthread_attr_t thread_attr_detach;
 
+/*
+ * Scratch arenas are owned by threads, and recycled when thread exits,
+ * so short-lived workers do not pay warm up of a new arena every time.
+ */
+static pthread_key_t scratch_key;
+static mem_arena *scratch_cache[SCRATCH_ARENA_CACHED];
+static int scratch_cached;
+static pthread_spinlock_t scratch_spin;
+
 pthread_t pthread_create_joinable(void *(*func)(void *), void *arg)
 {
         pthread_t t;
@@ -40,6 +51,1492 @@ pthread_t pthread_create_detached(void *(*func)(void *), void *arg)
         return t;
 }
 
+static void scratch_arena_free(mem_arena **arena)
+{
+        mem_arena_deinit(*arena);
+        memfree((void **)arena);
+}
+
+static void scratch_arena_release(void *data)
+{
+        mem_arena *arena = data;
+
+        if (!arena)
+                return;
+
+        mem_arena_reset(arena);
+
+        pthread_spin_lock(&scratch_spin);
+
+        if (scratch_cached < SCRATCH_ARENA_CACHED) {
+                scratch_cache[scratch_cached++] = arena;
+                arena = NULL;
+        }
+
+        pthread_spin_unlock(&scratch_spin);
+
+        if (arena)
+                scratch_arena_free(&arena);
+}
+
+/**
+ * Wait Group
+ */
+
+int wait_group_init(wait_group *wg)
+{
+        if (!wg)
+                return -EINVAL;
+
+        wg->count = 0;
+        pthread_mutex_init(&wg->lock, NULL);
+        pthread_cond_init(&wg->cond, NULL);
+
+        return 0;
+}
+
+int wait_group_deinit(wait_group *wg)
+{
+        if (!wg)
+                return -EINVAL;
+
+        pthread_cond_destroy(&wg->cond);
+        pthread_mutex_destroy(&wg->lock);
+
+        return 0;
+}
+
+void wait_group_add(wait_group *wg, int n)
+{
+        pthread_mutex_lock(&wg->lock);
+        wg->count += n;
+        pthread_mutex_unlock(&wg->lock);
+}
+
+void wait_group_done(wait_group *wg)
+{
+        pthread_mutex_lock(&wg->lock);
+
+        if (--wg->count <= 0)
+                pthread_cond_broadcast(&wg->cond);
+
+        pthread_mutex_unlock(&wg->lock);
+}
+
+void wait_group_wait(wait_group *wg)
+{
+        pthread_mutex_lock(&wg->lock);
+
+        while (wg->count > 0)
+                pthread_cond_wait(&wg->cond, &wg->lock);
+
+        pthread_mutex_unlock(&wg->lock);
+}
+
+/**
+ * Thread Pool
+ */
+
+static void *thread_pool_worker(void *data)
+{
+        thread_pool *pool = data;
+        thread_job *done = NULL;
+
+        while (1) {
+                thread_job *job;
+
+                pthread_mutex_lock(&pool->lock);
+
+                // Recycle last job node under the same lock hold
+                if (done) {
+                        done->next = pool->free;
+                        pool->free = done;
+                        done = NULL;
+                }
+
+                while (!pool->head && !pool->shutdown)
+                        pthread_cond_wait(&pool->cond, &pool->lock);
+
+                // Queued jobs are drained before exiting
+                job = pool->head;
+                if (!job) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+
+                pool->head = job->next;
+                if (!pool->head)
+                        pool->tail = NULL;
+
+                pthread_mutex_unlock(&pool->lock);
+
+                job->func(job->ctx, job->arg);
+
+                if (job->wg)
+                        wait_group_done(job->wg);
+
+                done = job;
+        }
+
+        return NULL;
+}
+
+/**
+ * thread_pool_init() - start fixed size worker pool
+ *
+ * @param pool: pointer to pool
+ * @param nr_workers: workers count, THREAD_POOL_WORKERS_AUTO for CPU count
+ * @return 0 on success
+ */
+int thread_pool_init(thread_pool *pool, int nr_workers)
+{
+        if (!pool)
+                return -EINVAL;
+
+        memzero(pool, sizeof(thread_pool));
+
+        if (nr_workers <= THREAD_POOL_WORKERS_AUTO)
+                nr_workers = (int)get_cpu_count();
+
+        if (nr_workers < 1)
+                nr_workers = 1;
+
+        if (nr_workers > THREAD_POOL_WORKERS_MAX)
+                nr_workers = THREAD_POOL_WORKERS_MAX;
+
+        pool->workers = memalloc(sizeof(pthread_t) * nr_workers);
+        if (!pool->workers) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->cond, NULL);
+
+        for (int i = 0; i < nr_workers; ++i) {
+                if (pthread_create(&pool->workers[i], &thread_attr_join,
+                                   thread_pool_worker, pool)) {
+                        pr_err_func("failed to create worker %d\n", i);
+                        break;
+                }
+
+                pool->nr_workers++;
+        }
+
+        pr_info_func("%d workers\n", pool->nr_workers);
+
+        if (!pool->nr_workers) {
+                thread_pool_shutdown(pool);
+                return -EFAULT;
+        }
+
+        return 0;
+}
+
+/**
+ * thread_pool_submit() - queue a job to pool
+ *
+ * @param pool: pointer to pool
+ * @param func: job function
+ * @param ctx: first argument of job function
+ * @param arg: second argument of job function
+ * @param wg: wait group to count job in, can be NULL
+ * @return 0 on success
+ */
+int thread_pool_submit(thread_pool *pool, thread_job_func func,
+                       void *ctx, void *arg, wait_group *wg)
+{
+        thread_job *job;
+
+        if (!pool || !func)
+                return -EINVAL;
+
+        if (wg)
+                wait_group_add(wg, 1);
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->shutdown)
+                goto err_unlock;
+
+        job = pool->free;
+        if (job) {
+                pool->free = job->next;
+        } else {
+                job = memalloc(sizeof(thread_job));
+                if (!job) {
+                        pr_err_alloc();
+                        goto err_unlock;
+                }
+        }
+
+        job->func = func;
+        job->ctx = ctx;
+        job->arg = arg;
+        job->wg = wg;
+        job->next = NULL;
+
+        if (pool->tail)
+                pool->tail->next = job;
+        else
+                pool->head = job;
+
+        pool->tail = job;
+
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        return 0;
+
+err_unlock:
+        pthread_mutex_unlock(&pool->lock);
+
+        if (wg)
+                wait_group_done(wg);
+
+        return -EFAULT;
+}
+
+/**
+ * thread_pool_shutdown() - run queued jobs to end and join workers
+ *
+ * @param pool: pointer to pool
+ * @return 0 on success
+ */
+int thread_pool_shutdown(thread_pool *pool)
+{
+        thread_job *job;
+
+        if (!pool || !pool->workers)
+                return -EINVAL;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->nr_workers; ++i)
+                pthread_join(pool->workers[i], NULL);
+
+        while ((job = pool->free) != NULL) {
+                pool->free = job->next;
+                memfree((void **)&job);
+        }
+
+        memfree((void **)&pool->workers);
+        pool->nr_workers = 0;
+
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+
+        return 0;
+}
+
+/**
+ * Work Stealing Scheduler
+ */
+
+static _Thread_local ws_worker *ws_self;
+
+static void ws_deque_init(ws_deque *d)
+{
+        atomic_init(&d->top, 0);
+        atomic_init(&d->bottom, 0);
+
+        for (int i = 0; i < WS_DEQUE_SIZE; ++i)
+                atomic_init(&d->tasks[i], NULL);
+}
+
+static int ws_deque_push(ws_deque *d, ws_task *t)
+{
+        long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+        long long top = atomic_load_explicit(&d->top, memory_order_acquire);
+
+        if (b - top >= WS_DEQUE_SIZE)
+                return -ENOSPC;
+
+        // Task contents are published to thieves by bottom release
+        atomic_store_explicit(&d->tasks[b & (WS_DEQUE_SIZE - 1)], t,
+                              memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+
+        return 0;
+}
+
+static ws_task *ws_deque_pop(ws_deque *d)
+{
+        long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+        long long top;
+        ws_task *t = NULL;
+
+        atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+        if (top <= b) {
+                t = atomic_load_explicit(&d->tasks[b & (WS_DEQUE_SIZE - 1)],
+                                         memory_order_relaxed);
+
+                // Last one, race against thieves
+                if (top == b) {
+                        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                                     memory_order_seq_cst,
+                                                                     memory_order_relaxed))
+                                t = NULL;
+
+                        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+                }
+        } else {
+                atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+
+        return t;
+}
+
+static ws_task *ws_deque_steal(ws_deque *d)
+{
+        long long top = atomic_load_explicit(&d->top, memory_order_acquire);
+        long long b;
+        ws_task *t;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+        if (top >= b)
+                return NULL;
+
+        t = atomic_load_explicit(&d->tasks[top & (WS_DEQUE_SIZE - 1)],
+                                 memory_order_relaxed);
+
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+                return NULL;
+
+        return t;
+}
+
+static ws_task *ws_task_alloc(ws_worker *self)
+{
+        ws_task *t;
+
+        if (self && self->free) {
+                t = self->free;
+                self->free = t->next;
+                return t;
+        }
+
+        t = memalloc(sizeof(ws_task));
+        if (!t)
+                pr_err_alloc();
+
+        return t;
+}
+
+static void ws_task_free(ws_worker *self, ws_task *t)
+{
+        if (!self) {
+                memfree((void **)&t);
+                return;
+        }
+
+        t->next = self->free;
+        self->free = t;
+}
+
+static void ws_sched_wake(work_sched *s)
+{
+        atomic_fetch_add(&s->epoch, 1);
+
+        if (atomic_load(&s->nr_sleeping) > 0) {
+                pthread_mutex_lock(&s->sleep_lock);
+                pthread_cond_signal(&s->sleep_cond);
+                pthread_mutex_unlock(&s->sleep_lock);
+        }
+}
+
+static void ws_join_done(ws_join *join, size_t items)
+{
+        // Last finisher wakes waiter, join is gone after unlock
+        if (atomic_fetch_sub(&join->remaining, items) != items)
+                return;
+
+        pthread_mutex_lock(&join->lock);
+        join->done = 1;
+        pthread_cond_broadcast(&join->cond);
+        pthread_mutex_unlock(&join->lock);
+}
+
+static ws_task *ws_inject_pop(work_sched *s)
+{
+        ws_task *t;
+
+        if (atomic_load_explicit(&s->nr_inject, memory_order_relaxed) == 0)
+                return NULL;
+
+        pthread_mutex_lock(&s->inject_lock);
+
+        t = s->inject;
+        if (t) {
+                s->inject = t->next;
+                atomic_fetch_sub(&s->nr_inject, 1);
+        }
+
+        pthread_mutex_unlock(&s->inject_lock);
+
+        return t;
+}
+
+static void ws_inject_push(work_sched *s, ws_task *t)
+{
+        pthread_mutex_lock(&s->inject_lock);
+
+        t->next = s->inject;
+        s->inject = t;
+        atomic_fetch_add(&s->nr_inject, 1);
+
+        pthread_mutex_unlock(&s->inject_lock);
+
+        ws_sched_wake(s);
+}
+
+static ws_task *ws_task_find(ws_worker *self)
+{
+        work_sched *s = self->sched;
+        ws_task *t;
+        int victim;
+
+        t = ws_deque_pop(&self->deque);
+        if (t)
+                return t;
+
+        t = ws_inject_pop(s);
+        if (t)
+                return t;
+
+        // xorshift32, start from a random victim
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+
+        victim = (int)(self->seed % (uint32_t)s->nr_workers);
+
+        for (int i = 0; i < s->nr_workers; ++i) {
+                ws_worker *w = &s->workers[(victim + i) % s->nr_workers];
+
+                if (w == self)
+                        continue;
+
+                t = ws_deque_steal(&w->deque);
+                if (t)
+                        return t;
+        }
+
+        return NULL;
+}
+
+/**
+ * ws_task_run() - split range task down to grain and run it
+ *
+ * Right halves are pushed to own deque, where idle workers steal them,
+ * uneven items are balanced without central queue.
+ */
+static void ws_task_run(ws_worker *self, ws_task *t)
+{
+        ws_join *join = t->join;
+        size_t items;
+
+        while (t->end - t->begin > t->grain) {
+                size_t mid = t->begin + (t->end - t->begin) / 2;
+                ws_task *r = ws_task_alloc(self);
+
+                if (!r)
+                        break;
+
+                memcpy(r, t, sizeof(ws_task));
+                r->begin = mid;
+
+                if (ws_deque_push(&self->deque, r)) {
+                        ws_task_free(self, r);
+                        break;
+                }
+
+                ws_sched_wake(self->sched);
+                t->end = mid;
+        }
+
+        items = t->end - t->begin;
+        t->func(t->ctx, t->begin, t->end);
+
+        ws_task_free(self, t);
+        ws_join_done(join, items);
+}
+
+/**
+ * ws_join_wait() - wait until all items of join finished
+ *
+ * Worker caller runs tasks while waiting, so nested waits do not
+ * deadlock. Join may be destroyed once this returns.
+ */
+static void ws_join_wait(ws_worker *self, ws_join *join)
+{
+        // Help others instead of sleeping
+        while (self && atomic_load(&join->remaining) > 0) {
+                ws_task *t = ws_task_find(self);
+
+                if (t)
+                        ws_task_run(self, t);
+                else
+                        sched_yield();
+        }
+
+        pthread_mutex_lock(&join->lock);
+
+        while (!join->done)
+                pthread_cond_wait(&join->cond, &join->lock);
+
+        pthread_mutex_unlock(&join->lock);
+}
+
+static void *ws_worker_main(void *data)
+{
+        ws_worker *self = data;
+        work_sched *s = self->sched;
+        int spins = 0;
+
+        ws_self = self;
+
+        while (1) {
+                unsigned epoch = atomic_load(&s->epoch);
+                ws_task *t = ws_task_find(self);
+
+                if (t) {
+                        ws_task_run(self, t);
+                        spins = 0;
+                        continue;
+                }
+
+                if (atomic_load(&s->shutdown))
+                        break;
+
+                if (++spins < WS_IDLE_SPINS) {
+                        sched_yield();
+                        continue;
+                }
+
+                spins = 0;
+
+                // Anything pushed since epoch read wakes us up
+                pthread_mutex_lock(&s->sleep_lock);
+                atomic_fetch_add(&s->nr_sleeping, 1);
+
+                if (atomic_load(&s->epoch) == epoch && !atomic_load(&s->shutdown))
+                        pthread_cond_wait(&s->sleep_cond, &s->sleep_lock);
+
+                atomic_fetch_sub(&s->nr_sleeping, 1);
+                pthread_mutex_unlock(&s->sleep_lock);
+        }
+
+        ws_self = NULL;
+
+        return NULL;
+}
+
+/**
+ * work_sched_init() - start work stealing workers
+ *
+ * Without workers, parallel_for() and job graphs run on calling thread
+ * in a fixed order, which keeps profiles reproducible.
+ *
+ * @param s: pointer to scheduler
+ * @param nr_workers: workers count, THREAD_POOL_WORKERS_AUTO for CPU count,
+ *                    THREAD_POOL_WORKERS_INLINE for none
+ * @return 0 on success
+ */
+int work_sched_init(work_sched *s, int nr_workers)
+{
+        int nr_started = 0;
+
+        if (!s)
+                return -EINVAL;
+
+        memzero(s, sizeof(work_sched));
+
+        if (nr_workers == THREAD_POOL_WORKERS_INLINE) {
+                pr_info_func("no workers, jobs run inline\n");
+                return 0;
+        }
+
+        if (nr_workers <= THREAD_POOL_WORKERS_AUTO)
+                nr_workers = (int)get_cpu_count();
+
+        if (nr_workers < 1)
+                nr_workers = 1;
+
+        if (nr_workers > THREAD_POOL_WORKERS_MAX)
+                nr_workers = THREAD_POOL_WORKERS_MAX;
+
+        s->workers = memalloc(sizeof(ws_worker) * nr_workers);
+        if (!s->workers) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        pthread_mutex_init(&s->inject_lock, NULL);
+        pthread_mutex_init(&s->sleep_lock, NULL);
+        pthread_cond_init(&s->sleep_cond, NULL);
+
+        // Thieves index all workers, set them up before any starts
+        s->nr_workers = nr_workers;
+
+        for (int i = 0; i < nr_workers; ++i) {
+                ws_worker *w = &s->workers[i];
+
+                ws_deque_init(&w->deque);
+                w->sched = s;
+                w->seed = 0x9e3779b9U * (uint32_t)(i + 1);
+        }
+
+        for (int i = 0; i < nr_workers; ++i) {
+                if (pthread_create(&s->workers[i].thread, &thread_attr_join,
+                                   ws_worker_main, &s->workers[i])) {
+                        pr_err_func("failed to create worker %d\n", i);
+                        break;
+                }
+
+                nr_started++;
+        }
+
+        if (nr_started != nr_workers) {
+                atomic_store(&s->shutdown, 1);
+                ws_sched_wake(s);
+
+                for (int i = 0; i < nr_started; ++i)
+                        pthread_join(s->workers[i].thread, NULL);
+
+                memfree((void **)&s->workers);
+                s->nr_workers = 0;
+
+                return -EFAULT;
+        }
+
+        pr_info_func("%d workers\n", s->nr_workers);
+
+        return 0;
+}
+
+/**
+ * work_sched_shutdown() - stop workers, no parallel_for() may be running
+ *
+ * @param s: pointer to scheduler
+ * @return 0 on success
+ */
+int work_sched_shutdown(work_sched *s)
+{
+        if (!s)
+                return -EINVAL;
+
+        // Inline scheduler, nothing was started
+        if (!s->workers)
+                return 0;
+
+        atomic_store(&s->shutdown, 1);
+
+        pthread_mutex_lock(&s->sleep_lock);
+        pthread_cond_broadcast(&s->sleep_cond);
+        pthread_mutex_unlock(&s->sleep_lock);
+
+        for (int i = 0; i < s->nr_workers; ++i)
+                pthread_join(s->workers[i].thread, NULL);
+
+        for (int i = 0; i < s->nr_workers; ++i) {
+                ws_task *t;
+
+                while ((t = s->workers[i].free) != NULL) {
+                        s->workers[i].free = t->next;
+                        memfree((void **)&t);
+                }
+        }
+
+        memfree((void **)&s->workers);
+        s->nr_workers = 0;
+
+        pthread_cond_destroy(&s->sleep_cond);
+        pthread_mutex_destroy(&s->sleep_lock);
+        pthread_mutex_destroy(&s->inject_lock);
+
+        return 0;
+}
+
+/**
+ * parallel_for() - run func over [begin, end) on scheduler and wait
+ *
+ * Range is split in halves down to grain items, func is called with
+ * sub ranges. Called from a worker, caller runs tasks while waiting,
+ * so nested parallel_for() does not deadlock.
+ *
+ * @param s: pointer to scheduler, runs inline if it has no worker
+ * @param begin: first item
+ * @param end: last item + 1
+ * @param grain: max items per func call
+ * @param func: range function
+ * @param ctx: first argument of func
+ * @return 0 on success
+ */
+int parallel_for(work_sched *s, size_t begin, size_t end, size_t grain,
+                 parallel_for_func func, void *ctx)
+{
+        ws_worker *self = ws_self;
+        ws_join join;
+        ws_task *root;
+
+        if (!func)
+                return -EINVAL;
+
+        if (begin >= end)
+                return 0;
+
+        if (grain < 1)
+                grain = 1;
+
+        if (!s || !s->nr_workers || (self && self->sched != s)) {
+                func(ctx, begin, end);
+                return 0;
+        }
+
+        atomic_init(&join.remaining, end - begin);
+        join.done = 0;
+        pthread_mutex_init(&join.lock, NULL);
+        pthread_cond_init(&join.cond, NULL);
+
+        root = ws_task_alloc(self);
+        if (!root) {
+                func(ctx, begin, end);
+                goto destroy;
+        }
+
+        root->func = func;
+        root->ctx = ctx;
+        root->begin = begin;
+        root->end = end;
+        root->grain = grain;
+        root->join = &join;
+        root->next = NULL;
+
+        if (self)
+                ws_task_run(self, root);
+        else
+                ws_inject_push(s, root);
+
+        ws_join_wait(self, &join);
+
+destroy:
+        pthread_cond_destroy(&join.cond);
+        pthread_mutex_destroy(&join.lock);
+
+        return 0;
+}
+
+/**
+ * Job Graph
+ */
+
+static int job_graph_grow(void **buf, uint32_t *cap, uint32_t count, size_t size)
+{
+        uint32_t new_cap;
+        void *p;
+
+        if (count < *cap)
+                return 0;
+
+        new_cap = *cap ? *cap * 2 : 64;
+
+        p = memalloc(size * new_cap);
+        if (!p) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        if (*buf) {
+                memcpy(p, *buf, size * (*cap));
+                memfree(buf);
+        }
+
+        *buf = p;
+        *cap = new_cap;
+
+        return 0;
+}
+
+int job_graph_init(job_graph *g, work_sched *s, void *ctx)
+{
+        if (!g)
+                return -EINVAL;
+
+        memzero(g, sizeof(job_graph));
+
+        g->sched = s;
+        g->ctx = ctx;
+
+        pthread_mutex_init(&g->stats_lock, NULL);
+
+        return 0;
+}
+
+int job_graph_deinit(job_graph *g)
+{
+        if (!g)
+                return -EINVAL;
+
+        if (g->nodes)
+                memfree((void **)&g->nodes);
+
+        if (g->edges)
+                memfree((void **)&g->edges);
+
+        if (g->succ)
+                memfree((void **)&g->succ);
+
+        if (g->inline_ready)
+                memfree((void **)&g->inline_ready);
+
+        pthread_mutex_destroy(&g->stats_lock);
+
+        return 0;
+}
+
+/**
+ * job_graph_reset() - drop nodes and edges, keep buffers and stats
+ *
+ * @param g: pointer to graph, not running
+ */
+void job_graph_reset(job_graph *g)
+{
+        if (!g)
+                return;
+
+        g->nr_nodes = 0;
+        g->nr_edges = 0;
+}
+
+/**
+ * job_graph_add() - add a node to graph
+ *
+ * @param g: pointer to graph, not running
+ * @param func: node function, NULL for barrier which only joins deps
+ * @param arg: second argument of func
+ * @param stage: stage index for latency stats
+ * @param flags: JOB_NODE_DEFER to hand node to another thread
+ * @return node index, negative on error
+ */
+int job_graph_add(job_graph *g, job_node_func func, void *arg,
+                  uint32_t stage, uint32_t flags)
+{
+        job_node *n;
+
+        if (!g || stage >= JOB_GRAPH_STAGES_MAX)
+                return -EINVAL;
+
+        if (job_graph_grow((void **)&g->nodes, &g->cap_nodes,
+                           g->nr_nodes, sizeof(job_node)))
+                return -ENOMEM;
+
+        n = &g->nodes[g->nr_nodes];
+        memzero(n, sizeof(job_node));
+
+        n->func = func;
+        n->arg = arg;
+        n->stage = stage;
+        n->flags = flags;
+
+        return (int)g->nr_nodes++;
+}
+
+/**
+ * job_graph_depend() - declare that node after runs once before finished
+ *
+ * @param g: pointer to graph, not running
+ * @param before: predecessor node index
+ * @param after: successor node index
+ * @return 0 on success
+ */
+int job_graph_depend(job_graph *g, int before, int after)
+{
+        if (!g || before < 0 || after < 0 || before == after ||
+            (uint32_t)before >= g->nr_nodes || (uint32_t)after >= g->nr_nodes)
+                return -EINVAL;
+
+        if (job_graph_grow((void **)&g->edges, &g->cap_edges,
+                           g->nr_edges, sizeof(uint32_t) * 2))
+                return -ENOMEM;
+
+        g->edges[g->nr_edges * 2] = (uint32_t)before;
+        g->edges[g->nr_edges * 2 + 1] = (uint32_t)after;
+        g->nr_edges++;
+
+        return 0;
+}
+
+void job_stage_stats_add(job_stage_stats *st, double wait, double run)
+{
+        st->count++;
+        st->wait += wait;
+        st->run += run;
+
+        if (wait + run > st->latency_max)
+                st->latency_max = wait + run;
+}
+
+void job_stage_stats_merge(job_stage_stats *dst, const job_stage_stats *src, int n)
+{
+        for (int i = 0; i < n; ++i) {
+                dst[i].count += src[i].count;
+                dst[i].wait += src[i].wait;
+                dst[i].run += src[i].run;
+
+                if (src[i].latency_max > dst[i].latency_max)
+                        dst[i].latency_max = src[i].latency_max;
+        }
+}
+
+static void job_node_ready(job_graph *g, uint32_t idx);
+
+static void job_node_finish(job_graph *g, job_node *n)
+{
+        for (uint32_t i = 0; i < n->nr_succ; ++i) {
+                uint32_t s = g->succ[n->succ_first + i];
+
+                if (atomic_fetch_sub(&g->nodes[s].deps, 1) == 1)
+                        job_node_ready(g, s);
+        }
+}
+
+static void job_node_run(job_graph *g, job_node *n)
+{
+        double start = glfwGetTime();
+        double end;
+
+        if (n->func)
+                n->func(g->ctx, n->arg);
+
+        end = glfwGetTime();
+
+        // Deferred work is accounted by thread which really runs it
+        if (!(n->flags & JOB_NODE_DEFER)) {
+                pthread_mutex_lock(&g->stats_lock);
+                job_stage_stats_add(&g->stats[n->stage], start - n->t_ready,
+                                    end - start);
+                pthread_mutex_unlock(&g->stats_lock);
+        }
+
+        job_node_finish(g, n);
+}
+
+static void job_graph_task(void *ctx, size_t begin, size_t end)
+{
+        job_graph *g = ctx;
+
+        for (size_t i = begin; i < end; ++i)
+                job_node_run(g, &g->nodes[i]);
+}
+
+/**
+ * job_node_ready() - node has no unfinished predecessor, start it
+ *
+ * Barriers and deferred nodes finish in place, others are pushed to own
+ * deque of worker which finished last predecessor, so a chunk tends to
+ * stay on the same core through its stages.
+ */
+static void job_node_ready(job_graph *g, uint32_t idx)
+{
+        job_node *n = &g->nodes[idx];
+        ws_worker *self = ws_self;
+        ws_task *t;
+
+        n->t_ready = glfwGetTime();
+
+        if (!n->func || (n->flags & JOB_NODE_DEFER)) {
+                job_node_run(g, n);
+                ws_join_done(&g->join, 1);
+                return;
+        }
+
+        if (!g->sched || !g->sched->nr_workers) {
+                g->inline_ready[g->nr_inline_ready++] = idx;
+                return;
+        }
+
+        if (self && self->sched != g->sched)
+                self = NULL;
+
+        t = ws_task_alloc(self);
+        if (!t) {
+                job_node_run(g, n);
+                ws_join_done(&g->join, 1);
+                return;
+        }
+
+        t->func = job_graph_task;
+        t->ctx = g;
+        t->begin = idx;
+        t->end = idx + 1;
+        t->grain = 1;
+        t->join = &g->join;
+        t->next = NULL;
+
+        if (self && !ws_deque_push(&self->deque, t)) {
+                ws_sched_wake(g->sched);
+                return;
+        }
+
+        ws_inject_push(g->sched, t);
+}
+
+static int job_graph_link(job_graph *g)
+{
+        uint32_t pos = 0;
+
+        if (g->nr_edges &&
+            !(g->succ = memalloc(sizeof(uint32_t) * g->nr_edges))) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        for (uint32_t i = 0; i < g->nr_edges; ++i) {
+                g->nodes[g->edges[i * 2]].nr_succ++;
+                g->nodes[g->edges[i * 2 + 1]].nr_deps++;
+        }
+
+        for (uint32_t i = 0; i < g->nr_nodes; ++i) {
+                job_node *n = &g->nodes[i];
+
+                n->succ_first = pos;
+                pos += n->nr_succ;
+                n->nr_succ = 0;
+
+                atomic_init(&n->deps, n->nr_deps);
+        }
+
+        for (uint32_t i = 0; i < g->nr_edges; ++i) {
+                job_node *n = &g->nodes[g->edges[i * 2]];
+
+                g->succ[n->succ_first + n->nr_succ++] = g->edges[i * 2 + 1];
+        }
+
+        return 0;
+}
+
+/**
+ * job_graph_run() - run all nodes in dependency order and wait
+ *
+ * Nodes without predecessors are started in the order they were added.
+ * Deferred nodes only count as finished once handed over. Graph may be
+ * reset and reused afterwards.
+ *
+ * @param g: pointer to graph
+ * @return 0 on success
+ */
+int job_graph_run(job_graph *g)
+{
+        ws_worker *self = ws_self;
+        int ret = 0;
+
+        if (!g)
+                return -EINVAL;
+
+        if (!g->nr_nodes)
+                return 0;
+
+        if (self && self->sched != g->sched)
+                self = NULL;
+
+        if (g->succ)
+                memfree((void **)&g->succ);
+
+        ret = job_graph_link(g);
+        if (ret)
+                return ret;
+
+        atomic_init(&g->join.remaining, g->nr_nodes);
+        g->join.done = 0;
+        pthread_mutex_init(&g->join.lock, NULL);
+        pthread_cond_init(&g->join.cond, NULL);
+
+        if (!g->sched || !g->sched->nr_workers) {
+                if (g->inline_ready)
+                        memfree((void **)&g->inline_ready);
+
+                g->inline_ready = memalloc(sizeof(uint32_t) * g->nr_nodes);
+                if (!g->inline_ready) {
+                        pr_err_alloc();
+                        ret = -ENOMEM;
+                        goto destroy;
+                }
+        }
+
+        // Inject stack is LIFO, push roots backwards to start in order
+        for (uint32_t i = g->nr_nodes; i-- > 0; ) {
+                if (g->nodes[i].nr_deps == 0)
+                        job_node_ready(g, i);
+        }
+
+        // No worker, drain ready nodes on caller
+        while (g->nr_inline_ready) {
+                uint32_t idx = g->inline_ready[--g->nr_inline_ready];
+
+                job_node_run(g, &g->nodes[idx]);
+                ws_join_done(&g->join, 1);
+        }
+
+        ws_join_wait(self, &g->join);
+
+destroy:
+        pthread_cond_destroy(&g->join.cond);
+        pthread_mutex_destroy(&g->join.lock);
+
+        return ret;
+}
+
+/**
+ * Scheduler Benchmark
+ */
+
+typedef struct sched_bench_case {
+        const char      *name;
+        size_t          items;
+        uint32_t        heavy_every;    // every Nth item is heavy
+        uint32_t        light_cost;
+        uint32_t        heavy_cost;
+} sched_bench_case;
+
+static const sched_bench_case sched_bench_cases[] = {
+        { "uneven",  1 << 14, 16, 64, 100000 },
+        { "uniform", 1 << 14,  0, 4000,     0 },
+        { "tiny",    1 << 18,  0, 8,        0 },
+};
+
+static volatile uint32_t sched_bench_sink;
+
+static void sched_bench_item(const sched_bench_case *bc, size_t i)
+{
+        uint32_t cost = bc->light_cost;
+        uint32_t x = (uint32_t)i + 1;
+
+        // Heavy items are scattered, not clustered at range ends
+        if (bc->heavy_every && (((uint32_t)i * 2654435761U) >> 16) % bc->heavy_every == 0)
+                cost = bc->heavy_cost;
+
+        for (uint32_t k = 0; k < cost; ++k)
+                x = x * 1664525U + 1013904223U;
+
+        sched_bench_sink += x;
+}
+
+static void sched_bench_pool_job(void *ctx, void *arg)
+{
+        sched_bench_item(ctx, (size_t)arg);
+}
+
+static void sched_bench_range(void *ctx, size_t begin, size_t end)
+{
+        for (size_t i = begin; i < end; ++i)
+                sched_bench_item(ctx, i);
+}
+
+/**
+ * thread_sched_benchmark() - compare work stealing against plain pool
+ *
+ * @param nr_workers: workers count of both
+ * @return 0 on success
+ */
+int thread_sched_benchmark(int nr_workers)
+{
+        thread_pool pool;
+        work_sched sched;
+        wait_group wg;
+        int ret;
+
+        ret = thread_pool_init(&pool, nr_workers);
+        if (ret)
+                return ret;
+
+        ret = work_sched_init(&sched, nr_workers);
+        if (ret) {
+                thread_pool_shutdown(&pool);
+                return ret;
+        }
+
+        wait_group_init(&wg);
+
+        for (size_t i = 0; i < ARRAY_SIZE(sched_bench_cases); ++i) {
+                const sched_bench_case *bc = &sched_bench_cases[i];
+                double t0, t1, t2;
+
+                t0 = glfwGetTime();
+
+                for (size_t j = 0; j < bc->items; ++j)
+                        thread_pool_submit(&pool, sched_bench_pool_job,
+                                           (void *)bc, (void *)j, &wg);
+
+                wait_group_wait(&wg);
+
+                t1 = glfwGetTime();
+
+                parallel_for(&sched, 0, bc->items, 1, sched_bench_range, (void *)bc);
+
+                t2 = glfwGetTime();
+
+                pr_info("sched bench %-8s %7zu items: pool %8.2f ms, work stealing %8.2f ms\n",
+                        bc->name, bc->items, SEC_TO_MS(t1 - t0), SEC_TO_MS(t2 - t1));
+        }
+
+        wait_group_deinit(&wg);
+        work_sched_shutdown(&sched);
+        thread_pool_shutdown(&pool);
+
+        return 0;
+}
+
+/**
+ * Epoch Reclamation
+ *
+ * Readers announce global epoch they entered with, writers retire
+ * unpublished objects tagged with global epoch after unpublishing.
+ * Object is freed once every active reader entered later than that,
+ * so nobody can still hold a pointer loaded before it was unpublished.
+ */
+
+static epoch_reader epoch_readers[EPOCH_READERS_MAX];
+static atomic_ullong epoch_global = 1; // zero means idle reader
+static pthread_key_t epoch_key;
+
+static epoch_head *epoch_retired;
+static size_t epoch_nr_retired;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void epoch_reader_release(void *data)
+{
+        epoch_reader *r = data;
+
+        if (!r)
+                return;
+
+        atomic_store_explicit(&r->epoch, 0, memory_order_release);
+        atomic_store_explicit(&r->used, 0, memory_order_release);
+}
+
+static epoch_reader *epoch_reader_self(void)
+{
+        epoch_reader *r;
+
+        r = pthread_getspecific(epoch_key);
+        if (r)
+                return r;
+
+        // Slots are released when threads exit, so this rarely loops
+        while (1) {
+                for (int i = 0; i < EPOCH_READERS_MAX; ++i) {
+                        int unused = 0;
+
+                        r = &epoch_readers[i];
+
+                        if (atomic_compare_exchange_strong(&r->used, &unused, 1)) {
+                                r->nesting = 0;
+                                pthread_setspecific(epoch_key, r);
+
+                                return r;
+                        }
+                }
+
+                sched_yield();
+        }
+}
+
+/**
+ * epoch_read_lock() - enter read section, may nest
+ *
+ * Objects loaded inside section are not freed before section exits.
+ * Readers never block.
+ */
+void epoch_read_lock(void)
+{
+        epoch_reader *r = epoch_reader_self();
+
+        if (r->nesting++)
+                return;
+
+        // Seq-cst store is ordered before loads of published pointers
+        atomic_store(&r->epoch, atomic_load(&epoch_global));
+}
+
+void epoch_read_unlock(void)
+{
+        epoch_reader *r = epoch_reader_self();
+
+        if (--r->nesting)
+                return;
+
+        atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+/**
+ * epoch_retire() - free object once readers which may see it are gone
+ *
+ * Object must be unpublished already, readers entering from now on can
+ * not reach it.
+ *
+ * @param h: epoch head embedded in object
+ * @param free_func: called to free object
+ */
+void epoch_retire(epoch_head *h, epoch_free_func free_func)
+{
+        size_t nr_retired;
+
+        if (!h || !free_func)
+                return;
+
+        h->free = free_func;
+        h->epoch = atomic_load(&epoch_global);
+
+        pthread_mutex_lock(&epoch_lock);
+
+        h->next = epoch_retired;
+        epoch_retired = h;
+        nr_retired = ++epoch_nr_retired;
+
+        pthread_mutex_unlock(&epoch_lock);
+
+        if (nr_retired >= EPOCH_RECLAIM_BATCH)
+                epoch_reclaim();
+}
+
+/**
+ * epoch_reclaim() - free retired objects no reader can access
+ *
+ * @return freed objects count
+ */
+int epoch_reclaim(void)
+{
+        epoch_head *list, *keep = NULL, *keep_tail = NULL;
+        uint64_t oldest = UINT64_MAX;
+        size_t nr_keep = 0;
+        int ret = 0;
+
+        pthread_mutex_lock(&epoch_lock);
+
+        list = epoch_retired;
+        epoch_retired = NULL;
+        epoch_nr_retired = 0;
+
+        pthread_mutex_unlock(&epoch_lock);
+
+        if (!list)
+                return 0;
+
+        // Readers entering from now on are newer than anything taken
+        atomic_fetch_add(&epoch_global, 1);
+
+        // Must scan after taking list, objects retired later are kept
+        for (int i = 0; i < EPOCH_READERS_MAX; ++i) {
+                uint64_t e = atomic_load(&epoch_readers[i].epoch);
+
+                if (e && e < oldest)
+                        oldest = e;
+        }
+
+        while (list) {
+                epoch_head *next = list->next;
+
+                if (list->epoch < oldest) {
+                        list->free(list);
+                        ret++;
+                } else {
+                        list->next = keep;
+                        keep = list;
+                        nr_keep++;
+
+                        if (!keep_tail)
+                                keep_tail = list;
+                }
+
+                list = next;
+        }
+
+        if (keep) {
+                pthread_mutex_lock(&epoch_lock);
+
+                keep_tail->next = epoch_retired;
+                epoch_retired = keep;
+                epoch_nr_retired += nr_keep;
+
+                pthread_mutex_unlock(&epoch_lock);
+        }
+
+        return ret;
+}
+
+/**
+ * epoch_synchronize() - wait until every retired object is freed
+ *
+ * Must not be called inside read section.
+ */
+void epoch_synchronize(void)
+{
+        while (1) {
+                pthread_mutex_lock(&epoch_lock);
+
+                if (!epoch_retired) {
+                        pthread_mutex_unlock(&epoch_lock);
+                        break;
+                }
+
+                pthread_mutex_unlock(&epoch_lock);
+
+                if (!epoch_reclaim())
+                        sched_yield();
+        }
+}
+
+/**
+ * thread_scratch_arena() - get scratch arena owned by calling thread
+ *
+ * Caller is expected to reset arena at beginning of each job.
+ *
+ * @return pointer to arena, NULL on failure
+ */
+mem_arena *thread_scratch_arena(void)
+{
+        mem_arena *arena;
+
+        arena = pthread_getspecific(scratch_key);
+        if (arena)
+                return arena;
+
+        pthread_spin_lock(&scratch_spin);
+
+        if (scratch_cached > 0)
+                arena = scratch_cache[--scratch_cached];
+
+        pthread_spin_unlock(&scratch_spin);
+
+        if (!arena) {
+                arena = memalloc(sizeof(mem_arena));
+                if (!arena) {
+                        pr_err_alloc();
+                        return NULL;
+                }
+
+                if (mem_arena_init(arena, SCRATCH_ARENA_SIZE)) {
+                        memfree((void **)&arena);
+                        return NULL;
+                }
+        }
+
+        pthread_setspecific(scratch_key, arena);
+
+        return arena;
+}
+
 void thread_helper_init(void)
 {
         pthread_attr_init(&thread_attr_join);
@@ -47,11 +1544,32 @@ void thread_helper_init(void)
 
         pthread_attr_setdetachstate(&thread_attr_join, PTHREAD_CREATE_JOINABLE);
         pthread_attr_setdetachstate(&thread_attr_detach, PTHREAD_CREATE_DETACHED);
+
+        pthread_spin_init(&scratch_spin, PTHREAD_PROCESS_PRIVATE);
+        pthread_key_create(&scratch_key, scratch_arena_release);
+        pthread_key_create(&epoch_key, epoch_reader_release);
 }
 
 void thread_helper_deinit(void)
 {
         pthread_attr_destroy(&thread_attr_join);
         pthread_attr_destroy(&thread_attr_detach);
+
+        // Destructor is not called for the calling thread
+        scratch_arena_release(pthread_getspecific(scratch_key));
+        pthread_setspecific(scratch_key, NULL);
+        pthread_key_delete(scratch_key);
+
+        epoch_synchronize();
+
+        epoch_reader_release(pthread_getspecific(epoch_key));
+        pthread_setspecific(epoch_key, NULL);
+        pthread_key_delete(epoch_key);
+
+        for (int i = 0; i < scratch_cached; ++i)
+                scratch_arena_free(&scratch_cache[i]);
+
+        scratch_cached = 0;
+        pthread_spin_destroy(&scratch_spin);
 }
 
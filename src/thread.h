@@ -1,12 +1,234 @@
 #ifndef MYCRAFT_DEMO_THREAD_H
 #define MYCRAFT_DEMO_THREAD_H
 
+#include <stddef.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "utils.h"
+
+#define SCRATCH_ARENA_SIZE              (256 * 1024)
+#define SCRATCH_ARENA_CACHED            (64)
+
+#define THREAD_POOL_WORKERS_AUTO        (0)
+#define THREAD_POOL_WORKERS_INLINE      (-1)    // no worker, jobs run on caller
+#define THREAD_POOL_WORKERS_MAX         (64)
+
+typedef void (*thread_job_func)(void *ctx, void *arg);
+
+/**
+ * Counts outstanding jobs, waiter sleeps until it drops to zero
+ */
+typedef struct wait_group {
+        int                     count;
+        pthread_mutex_t         lock;
+        pthread_cond_t          cond;
+} wait_group;
+
+typedef struct thread_job {
+        thread_job_func         func;
+        void                    *ctx;
+        void                    *arg;
+        wait_group              *wg;
+
+        struct thread_job       *next;
+} thread_job;
+
+typedef struct thread_pool {
+        pthread_t               *workers;
+        int                     nr_workers;
+
+        // FIFO of pending jobs, and recycled job nodes
+        thread_job              *head;
+        thread_job              *tail;
+        thread_job              *free;
+
+        int                     shutdown;
+        pthread_mutex_t         lock;
+        pthread_cond_t          cond;
+} thread_pool;
+
+#define WS_DEQUE_SIZE                   (1024)  // power of 2
+#define WS_IDLE_SPINS                   (64)
+#define WS_CACHELINE                    (64)
+
+typedef void (*parallel_for_func)(void *ctx, size_t begin, size_t end);
+
+typedef struct ws_join {
+        atomic_size_t           remaining;      // items not finished yet
+        int                     done;
+        pthread_mutex_t         lock;
+        pthread_cond_t          cond;
+} ws_join;
+
+typedef struct ws_task {
+        parallel_for_func       func;
+        void                    *ctx;
+        size_t                  begin;
+        size_t                  end;
+        size_t                  grain;
+        ws_join                 *join;
+
+        struct ws_task          *next;
+} ws_task;
+
+/**
+ * Chase-Lev deque: owner pushes and pops at bottom, thieves steal at top
+ */
+typedef struct ws_deque {
+        atomic_llong            top;
+        char                    __pad0[WS_CACHELINE - sizeof(atomic_llong)];
+        atomic_llong            bottom;
+        char                    __pad1[WS_CACHELINE - sizeof(atomic_llong)];
+        _Atomic(ws_task *)      tasks[WS_DEQUE_SIZE];
+} ws_deque;
+
+typedef struct ws_worker {
+        ws_deque                deque;
+
+        struct work_sched       *sched;
+        pthread_t               thread;
+        uint32_t                seed;
+
+        // Recycled tasks, owned by worker
+        ws_task                 *free;
+} ws_worker;
+
+typedef struct work_sched {
+        ws_worker               *workers;
+        int                     nr_workers;
+
+        // Root tasks from threads which are not workers
+        ws_task                 *inject;
+        atomic_int              nr_inject;
+        pthread_mutex_t         inject_lock;
+
+        atomic_uint             epoch;
+        atomic_int              nr_sleeping;
+        atomic_int              shutdown;
+        pthread_mutex_t         sleep_lock;
+        pthread_cond_t          sleep_cond;
+} work_sched;
+
+#define JOB_GRAPH_STAGES_MAX            (8)
+
+// Node is not run by scheduler, func hands it to another thread
+#define JOB_NODE_DEFER                  (1U << 0)
+
+typedef void (*job_node_func)(void *ctx, void *arg);
+
+typedef struct job_stage_stats {
+        uint64_t                count;
+        double                  wait;           // sum of ready to start, sec
+        double                  run;            // sum of run time, sec
+        double                  latency_max;    // worst ready to finish, sec
+} job_stage_stats;
+
+typedef struct job_node {
+        job_node_func           func;           // NULL for barrier
+        void                    *arg;
+        uint32_t                stage;
+        uint32_t                flags;
+
+        atomic_uint             deps;           // unfinished predecessors
+        uint32_t                nr_deps;
+        uint32_t                succ_first;
+        uint32_t                nr_succ;
+        double                  t_ready;
+} job_node;
+
+/**
+ * Job graph: nodes run once all their predecessors finished
+ */
+typedef struct job_graph {
+        work_sched              *sched;
+        void                    *ctx;           // first argument of node funcs
+
+        job_node                *nodes;
+        uint32_t                nr_nodes;
+        uint32_t                cap_nodes;
+
+        uint32_t                *edges;         // before, after pairs
+        uint32_t                nr_edges;
+        uint32_t                cap_edges;
+        uint32_t                *succ;          // successors, by node
+
+        uint32_t                *inline_ready;  // ready stack without workers
+        uint32_t                nr_inline_ready;
+
+        ws_join                 join;
+
+        job_stage_stats         stats[JOB_GRAPH_STAGES_MAX];
+        pthread_mutex_t         stats_lock;
+} job_graph;
+
+#define EPOCH_READERS_MAX               (THREAD_POOL_WORKERS_MAX + 16)
+#define EPOCH_RECLAIM_BATCH             (16)    // retired objects to try reclaim
+
+typedef struct epoch_head epoch_head;
+typedef void (*epoch_free_func)(epoch_head *h);
+
+/**
+ * Retired object, embedded into object which readers may still access
+ */
+struct epoch_head {
+        epoch_head              *next;
+        uint64_t                epoch;          // global epoch at retire
+        epoch_free_func         free;
+};
+
+/**
+ * Reader slot of one thread, epoch is zero while not reading
+ */
+typedef struct epoch_reader {
+        atomic_ullong           epoch;
+        atomic_int              used;
+        int                     nesting;        // owner thread only
+        char                    __pad[WS_CACHELINE - sizeof(atomic_ullong) -
+                                      sizeof(atomic_int) - sizeof(int)];
+} epoch_reader;
+
 pthread_t pthread_create_joinable(void *(*func)(void *), void *arg);
 pthread_t pthread_create_detached(void *(*func)(void *), void *arg);
 
+int wait_group_init(wait_group *wg);
+int wait_group_deinit(wait_group *wg);
+void wait_group_add(wait_group *wg, int n);
+void wait_group_done(wait_group *wg);
+void wait_group_wait(wait_group *wg);
+
+int thread_pool_init(thread_pool *pool, int nr_workers);
+int thread_pool_submit(thread_pool *pool, thread_job_func func,
+                       void *ctx, void *arg, wait_group *wg);
+int thread_pool_shutdown(thread_pool *pool);
+
+int work_sched_init(work_sched *s, int nr_workers);
+int work_sched_shutdown(work_sched *s);
+int parallel_for(work_sched *s, size_t begin, size_t end, size_t grain,
+                 parallel_for_func func, void *ctx);
+
+int job_graph_init(job_graph *g, work_sched *s, void *ctx);
+int job_graph_deinit(job_graph *g);
+void job_graph_reset(job_graph *g);
+int job_graph_add(job_graph *g, job_node_func func, void *arg,
+                  uint32_t stage, uint32_t flags);
+int job_graph_depend(job_graph *g, int before, int after);
+int job_graph_run(job_graph *g);
+
+void job_stage_stats_add(job_stage_stats *st, double wait, double run);
+void job_stage_stats_merge(job_stage_stats *dst, const job_stage_stats *src, int n);
+
+int thread_sched_benchmark(int nr_workers);
+
+void epoch_read_lock(void);
+void epoch_read_unlock(void);
+void epoch_retire(epoch_head *h, epoch_free_func free_func);
+int epoch_reclaim(void);
+void epoch_synchronize(void);
+
+mem_arena *thread_scratch_arena(void);
+
 void thread_helper_init(void);
 void thread_helper_deinit(void);
 
@@ -658,6 +658,153 @@ int seqlist_is_empty(seqlist *list)
         return ret;
 }
 
+/**
+ * Bump Arena Implementation
+ */
+
+static arena_block *arena_block_alloc(size_t size)
+{
+        arena_block *blk;
+
+        blk = malloc(sizeof(arena_block) + size);
+        if (!blk) {
+                pr_err_alloc();
+                return NULL;
+        }
+
+        blk->next = NULL;
+        blk->size = size;
+        blk->used = 0;
+
+        return blk;
+}
+
+static void arena_block_chain_free(arena_block *blk)
+{
+        arena_block *next;
+
+        while (blk) {
+                next = blk->next;
+                free(blk);
+                blk = next;
+        }
+}
+
+static inline size_t arena_align(size_t size)
+{
+        return (size + (MEM_ARENA_ALIGN - 1)) & ~((size_t)MEM_ARENA_ALIGN - 1);
+}
+
+int mem_arena_init(mem_arena *arena, size_t size)
+{
+        if (!arena)
+                return -EINVAL;
+
+        memzero(arena, sizeof(mem_arena));
+
+        arena->head = arena_block_alloc(arena_align(size));
+        if (!arena->head)
+                return -ENOMEM;
+
+        arena->nr_malloc++;
+
+        return 0;
+}
+
+int mem_arena_deinit(mem_arena *arena)
+{
+        if (!arena)
+                return -EINVAL;
+
+        arena_block_chain_free(arena->head);
+
+        memzero(arena, sizeof(mem_arena));
+
+        return 0;
+}
+
+/**
+ * mem_arena_alloc() - bump allocate from arena
+ *
+ * Memory is not cleared, and is only valid until next mem_arena_reset().
+ * If current block runs out, an overflow block is chained in, so pointers
+ * handed out earlier stay valid.
+ *
+ * @param arena: pointer to arena
+ * @param size: bytes to allocate
+ * @return pointer to memory, aligned to MEM_ARENA_ALIGN, NULL on failure
+ */
+void *mem_arena_alloc(mem_arena *arena, size_t size)
+{
+        arena_block *blk;
+        void *ret;
+
+        if (!arena)
+                return NULL;
+
+        size = arena_align(size);
+        blk = arena->head;
+
+        if (!blk || (blk->size - blk->used) < size) {
+                size_t blk_size = blk ? blk->size * 2 : 0;
+
+                if (blk_size < size)
+                        blk_size = size;
+
+                blk = arena_block_alloc(blk_size);
+                if (!blk)
+                        return NULL;
+
+                blk->next = arena->head;
+                arena->head = blk;
+                arena->nr_malloc++;
+        }
+
+        ret = &blk->data[blk->used];
+        blk->used += size;
+
+        arena->used += size;
+        if (arena->used > arena->peak)
+                arena->peak = arena->used;
+
+        return ret;
+}
+
+/**
+ * mem_arena_reset() - release all allocations of arena
+ *
+ * If arena overflowed since last reset, blocks are merged into a single
+ * block which fits the peak usage, so later jobs of similar size do not
+ * touch heap at all.
+ *
+ * @param arena: pointer to arena
+ */
+void mem_arena_reset(mem_arena *arena)
+{
+        arena_block *blk;
+
+        if (!arena || !arena->head)
+                return;
+
+        blk = arena->head;
+
+        if (blk->next) {
+                arena_block *merged = arena_block_alloc(arena_align(arena->peak));
+
+                if (merged) {
+                        arena_block_chain_free(blk);
+                        arena->head = merged;
+                        arena->nr_malloc++;
+                        blk = merged;
+                }
+        }
+
+        for (arena_block *pos = blk; pos != NULL; pos = pos->next)
+                pos->used = 0;
+
+        arena->used = 0;
+}
+
 /**
  * Linked List Implementation
  */
@@ -25,6 +25,7 @@
  * Simple Time Profiler
  */
 #define SEC_TO_MS(s)                    ((s) * 1000)
+#define SEC_TO_US(s)                    ((s) * 1000000)
 
 // XXX: Be careful with variable scope
 
@@ -223,6 +224,33 @@ int seqlist_shrink(seqlist *list);
 int seqlist_append(seqlist *list, void *element);
 int seqlist_is_empty(seqlist *list);
 
+/**
+ * Bump Arena Implementation
+ */
+
+#define MEM_ARENA_ALIGN                 (16)
+
+typedef struct arena_block {
+        struct arena_block      *next;
+        size_t                  size;
+        size_t                  used;
+        _Alignas(MEM_ARENA_ALIGN) uint8_t data[];
+} arena_block;
+
+typedef struct mem_arena {
+        arena_block             *head;
+
+        size_t                  used;           // bytes handed out since reset
+        size_t                  peak;           // max bytes used between resets
+
+        uint64_t                nr_malloc;      // heap allocations, for stats
+} mem_arena;
+
+int mem_arena_init(mem_arena *arena, size_t size);
+int mem_arena_deinit(mem_arena *arena);
+void *mem_arena_alloc(mem_arena *arena, size_t size);
+void mem_arena_reset(mem_arena *arena);
+
 /**
  * Linked List Implementation
  */
@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <memory.h>
 #include <errno.h>
+#include <time.h>
 
 #include <GL/glew.h>
 
@@ -10,6 +12,7 @@
 #include "block.h"
 #include "model.h"
 #include "utils.h"
+#include "thread.h"
 #include "world.h"
 
 static world_hierarchy super_flat_default[] = {
@@ -47,11 +50,36 @@ world_preset *super_flat_preset_get(super_flat_preset_idx idx)
         return &super_flat_presets[idx];
 }
 
+typedef struct super_flat_ctx {
+        world_preset    *preset;
+        int32_t         heights[WORLD_HIERARCHY_MAX];
+        int             width;
+        int             length;
+} super_flat_ctx;
+
+static void super_flat_chunk_generate(world *w, chunk *c, void *data)
+{
+        super_flat_ctx *ctx = data;
+
+        for (int i = 0; i < ctx->preset->hierarchy_count; ++i) {
+                int32_t h = ctx->heights[i];
+                ivec3 min = { [X] = 0, [Y] = h, [Z] = 0 };
+                ivec3 max = {
+                        [X] = ctx->width - 1,
+                        [Y] = h + ctx->preset->hierarchy[i].thickness - 1,
+                        [Z] = ctx->length - 1,
+                };
+
+                chunk_fill_blocks(w, c, min, max, ctx->preset->hierarchy[i].type);
+        }
+}
+
 /**
  * super_flat_generate() - fill a fixed size super flat world chunks
  *
  * limited world size during generation,
- * can not be extended by discovering world
+ * can not be extended by discovering world.
+ * Chunks are generated and meshed by world job graph.
  *
  * @param w: pointer to world
  * @param idx: preset index
@@ -61,44 +89,427 @@ world_preset *super_flat_preset_get(super_flat_preset_idx idx)
  */
 int super_flat_generate(world *w, super_flat_preset_idx idx, int width, int length)
 {
-        block *b;
         world_preset *preset = super_flat_preset_get(idx);
         int32_t last_height = WORLD_HEIGHT_AUTO;
+        super_flat_ctx ctx = { 0 };
+        ivec3 chunk_min, chunk_max;
 
         if (!w || !preset)
                 return 0;
 
-        b = memalloc(sizeof(block));
-        if (!b)
-                return -ENOMEM;
+        if (width <= 0 || length <= 0 ||
+            preset->hierarchy_count > WORLD_HIERARCHY_MAX)
+                return -EINVAL;
+
+        ctx.preset = preset;
+        ctx.width = width;
+        ctx.length = length;
 
         for (int i = 0; i < preset->hierarchy_count; ++i) {
-                block_attr *type = block_attr_get(preset->hierarchy[i].type);
                 int32_t h = preset->hierarchy[i].height;
 
                 if (h == WORLD_HEIGHT_AUTO) {
                         h = last_height + 1; // if (h = -1 && i = 0), then (-1 + 1 = 0)
                 }
 
-                for (int j = h; j < (preset->hierarchy[i].thickness + h); ++j) {
-                        for (int k = 0; k < width; ++k) {
-                                for (int l = 0; l < length; ++l) {
-                                        ivec3 origin_l = {
-                                                [X] = k,
-                                                [Y] = j,
-                                                [Z] = l,
-                                        };
-
-                                        block_init(b, type, origin_l);
-                                        world_add_block(w, b, 0);
-                                }
-                        }
-
-                        last_height = j;
+                ctx.heights[i] = h;
+                last_height = h + preset->hierarchy[i].thickness - 1;
+        }
+
+        block_in_chunk((ivec3){ 0, ctx.heights[0], 0 }, w->chunk_length, chunk_min);
+        block_in_chunk((ivec3){ width - 1, last_height, length - 1 },
+                       w->chunk_length, chunk_max);
+
+        return world_generate_chunks(w, chunk_min, chunk_max,
+                                     super_flat_chunk_generate, &ctx);
+}
+
+/**
+ * Mode Checks
+ */
+
+// Edited blocks, all inside the check world
+#define WORLD_CHECK_SIZE                (48)
+#define WORLD_CHECK_EDITS               (256)
+#define WORLD_CHECK_TIMEOUT_MS          (10000)
+
+typedef struct world_check_result {
+        size_t          chunks;
+        size_t          pending;        // chunks with a mesh waiting for flush
+        size_t          flushed;        // chunks with a mesh to draw
+        size_t          bytes;          // staged, or in GPU once flushed
+        uint64_t        hash;           // chunks and their meshes in chunk order
+
+        // Upload thread also uploads results a later rebuild replaced,
+        // counts depend on timing, printed but not compared
+        size_t          uploaded;
+} world_check_result;
+
+static inline uint64_t world_check_hash(uint64_t hash, uint64_t v)
+{
+        // FNV-1a over 64-bit words
+        return (hash ^ v) * 0x100000001b3ULL;
+}
+
+static uint64_t world_check_hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+        const uint8_t *p = data;
+
+        for (size_t i = 0; i < size; ++i)
+                hash = world_check_hash(hash, p[i]);
+
+        return hash;
+}
+
+static void world_check_mesh(world_check_result *res, chunk_mesh *m)
+{
+        size_t vsize = m->glvbo.vertex_count * sizeof(vertex_attr);
+        size_t isize = m->glvbo.index_count * sizeof(uint32_t);
+
+        res->bytes += vsize + isize;
+
+        res->hash = world_check_hash(res->hash, m->glvbo.vertex_count);
+        res->hash = world_check_hash(res->hash, m->glvbo.index_count);
+
+        if (m->glvbo.staging) {
+                res->hash = world_check_hash_bytes(res->hash, gl_vbo_vertices(&m->glvbo), vsize);
+                res->hash = world_check_hash_bytes(res->hash, gl_vbo_indices(&m->glvbo), isize);
+        }
+
+        for (int i = 0; i < MESH_LODS - 1; ++i) {
+                if (m->lods[i])
+                        world_check_mesh(res, m->lods[i]);
+        }
+}
+
+/**
+ * world_check_hash_buffer() - fold GPU buffer range into check hash
+ *
+ * @param hash: hash so far
+ * @param buffer: GL buffer
+ * @param offset: range offset in bytes
+ * @param size: range size in bytes, 0 for whole buffer
+ * @return new hash
+ */
+static uint64_t world_check_hash_buffer(uint64_t hash, GLuint buffer,
+                                        size_t offset, size_t size,
+                                        size_t *bytes)
+{
+        uint8_t *data;
+
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+
+        if (!size) {
+                GLint len = 0;
+
+                glGetBufferParameteriv(GL_COPY_READ_BUFFER, GL_BUFFER_SIZE, &len);
+                size = (size_t)len;
+        }
+
+        data = memalloc(size ? size : 1);
+        if (!data) {
+                pr_err_alloc();
+                glBindBuffer(GL_COPY_READ_BUFFER, GL_BUFFER_NONE);
+                return world_check_hash(hash, (uint64_t)-ENOMEM);
+        }
+
+        glGetBufferSubData(GL_COPY_READ_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
+        glBindBuffer(GL_COPY_READ_BUFFER, GL_BUFFER_NONE);
+
+        *bytes += size;
+
+        hash = world_check_hash(hash, size);
+        hash = world_check_hash_bytes(hash, data, size);
+
+        memfree((void **)&data);
+
+        return hash;
+}
+
+// Arena offsets depend on upload order, only contents are compared
+static void world_check_uploaded(world_check_result *res, chunk_mesh *m)
+{
+        if (!atomic_load(&m->uploaded))
+                return;
+
+        res->hash = world_check_hash(res->hash, (uint64_t)m->glattr.vertex_count);
+
+        if (m->arena) {
+                gl_arena *v = &m->arena->vertices;
+                gl_arena *i = &m->arena->indices;
+
+                res->hash = world_check_hash_buffer(res->hash, v->buffer,
+                                                    m->vertex_range.first * v->unit,
+                                                    m->vertex_range.count * v->unit,
+                                                    &res->bytes);
+                res->hash = world_check_hash_buffer(res->hash, i->buffer,
+                                                    m->index_range.first * i->unit,
+                                                    m->index_range.count * i->unit,
+                                                    &res->bytes);
+        } else if (m->glattr.vertex) {
+                res->hash = world_check_hash_buffer(res->hash, m->glattr.vertex,
+                                                    0, 0, &res->bytes);
+                res->hash = world_check_hash_buffer(res->hash, m->glattr.vbo_index,
+                                                    0, 0, &res->bytes);
+        }
+
+        for (int i = 0; i < MESH_LODS - 1; ++i) {
+                if (m->lods[i])
+                        world_check_uploaded(res, m->lods[i]);
+        }
+}
+
+static int world_check_busy(world *w, int flush)
+{
+        linklist_node *pos;
+
+        if (atomic_load(&w->queues[CHUNK_QUEUE_DIRTY]))
+                return 1;
+
+        if (flush && (atomic_load(&w->queues[CHUNK_QUEUE_UPLOAD]) ||
+                      atomic_load(&w->queues[CHUNK_QUEUE_READY])))
+                return 1;
+
+        linklist_for_each_node(pos, w->chunks->head) {
+                chunk *c = pos->data;
+                int state = atomic_load(&c->state);
+
+                if (state == CHUNK_NEED_UPDATE || state == CHUNK_SCHED_UPDATE ||
+                    state == CHUNK_UPDATING)
+                        return 1;
+
+                if (flush && (state == CHUNK_NEED_FLUSH || state == CHUNK_FLUSHING))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * world_check_settle() - drive rebuilds, and flushes if asked, until idle
+ *
+ * @param w: pointer to world
+ * @param flush: also flush until nothing is left to upload
+ * @return 0 on success
+ */
+static int world_check_settle(world *w, int flush)
+{
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+        for (int t = 0; world_check_busy(w, flush); ++t) {
+                if (t >= WORLD_CHECK_TIMEOUT_MS) {
+                        pr_err_func("chunks still busy after %d ms\n", t);
+                        return -ETIMEDOUT;
+                }
+
+                world_update_chunks(w);
+
+                if (flush)
+                        world_flush_chunks(w);
+
+                nanosleep(&ts, NULL);
+        }
+
+        return 0;
+}
+
+/**
+ * world_check_run() - build and edit check world, collect chunk results
+ *
+ * Edits ask for rebuild like player does, rebuilds are driven from here
+ * until no chunk is left dirty, so inline mode needs no frame loop.
+ * Without flush meshes are left staged, flush would upload exactly
+ * those. With flush, ready chunks are flushed as frames would do until
+ * nothing is left to upload, and uploaded buffers are read back.
+ *
+ * @param nr_workers: workers count, THREAD_POOL_WORKERS_INLINE for inline
+ * @param upload: hidden shared window for upload thread, NULL for none
+ * @param flush: flush meshes, results cover uploaded meshes
+ * @param res: output results
+ * @return 0 on success
+ */
+static int world_check_run(int nr_workers, GLFWwindow *upload, int flush,
+                           world_check_result *res)
+{
+        linklist_node *pos;
+        world *w;
+        int ret;
+
+        memzero(res, sizeof(world_check_result));
+        res->hash = 0xcbf29ce484222325ULL;
+
+        w = memalloc(sizeof(world));
+        if (!w) {
+                pr_err_alloc();
+                return -ENOMEM;
+        }
+
+        ret = world_init(w);
+        if (ret)
+                goto out_free;
+
+        // No frame budget, each flush takes all ready chunks
+        world_upload_budget_set(w, 0, 0);
+
+        ret = world_worker_create(w, nr_workers);
+        if (ret)
+                goto out;
+
+        if (upload) {
+                ret = world_upload_thread_create(w, upload);
+                if (ret)
+                        goto out;
+        }
+
+        ret = super_flat_generate(w, SUPER_FLAT_GRASS, WORLD_CHECK_SIZE, WORLD_CHECK_SIZE);
+        if (ret)
+                goto out;
+
+        // Upload thread takes meshes as built, so edits start on a settled
+        // world, else it uploads generated meshes flush drops as stale
+        ret = world_check_settle(w, flush);
+        if (ret)
+                goto out;
+
+        // Stone on grass and holes in it, some spots edited twice
+        for (int i = 0; i < WORLD_CHECK_EDITS; ++i) {
+                ivec3 o = {
+                        [X] = (i * 7) % WORLD_CHECK_SIZE,
+                        [Y] = 6 + (i / WORLD_CHECK_SIZE) % 3,
+                        [Z] = (i * 13) % WORLD_CHECK_SIZE,
+                };
+                block b;
+
+                if (world_get_block(w, o)) {
+                        world_del_block(w, o);
+                        continue;
+                }
+
+                block_init(&b, block_attr_get(BLOCK_STONE), o);
+                world_add_block(w, &b, 1);
+        }
+
+        ret = world_check_settle(w, flush);
+        if (ret)
+                goto out;
+
+        linklist_for_each_node(pos, w->chunks->head) {
+                chunk *c = pos->data;
+                chunk_mesh *m = atomic_load(&c->mesh_pending);
+
+                res->chunks++;
+                res->hash = world_check_hash_bytes(res->hash, c->origin_l, sizeof(c->origin_l));
+                res->hash = world_check_hash(res->hash, (uint64_t)atomic_load(&c->state));
+
+                if (m) {
+                        res->pending++;
+                        world_check_mesh(res, m);
+                }
+
+                if (c->mesh) {
+                        res->flushed++;
+                        world_check_uploaded(res, c->mesh);
                 }
         }
 
-        memfree((void **)&b);
+        // Upload thread hands meshes over already uploaded
+        if (flush) {
+                pthread_mutex_lock(&w->upload_mutex);
+                res->uploaded = (size_t)(w->upload_stats.bytes + w->async_stats.bytes);
+                pthread_mutex_unlock(&w->upload_mutex);
+        }
+
+out:
+        world_deinit(w);
+
+out_free:
+        memfree((void **)&w);
+
+        return ret;
+}
+
+static int world_check_compare(world_check_result res[2], const char *name[2])
+{
+        for (int i = 0; i < 2; ++i) {
+                pr_info("check %-14s: %zu chunks %zu to flush %zu flushed %zu bytes"
+                        " hash %016" PRIx64 ", %zu bytes uploaded\n", name[i],
+                        res[i].chunks, res[i].pending, res[i].flushed, res[i].bytes,
+                        res[i].hash, res[i].uploaded);
+        }
+
+        if (res[0].chunks != res[1].chunks || res[0].pending != res[1].pending ||
+            res[0].flushed != res[1].flushed || res[0].bytes != res[1].bytes ||
+            res[0].hash != res[1].hash) {
+                pr_err_func("%s differs from %s\n", name[1], name[0]);
+                return -EFAULT;
+        }
+
+        pr_info("check: results equal\n");
 
         return 0;
 }
+
+/**
+ * world_inline_check() - check inline mode builds same world as workers
+ *
+ * Same world is generated and edited with worker threads and with all
+ * jobs run inline, chunks to flush, mesh bytes and chunk states must be
+ * equal. Needs GL context for world init, nothing is drawn.
+ *
+ * @param nr_workers: workers count of threaded run
+ * @return 0 if both runs agree
+ */
+int world_inline_check(int nr_workers)
+{
+        const char *name[2] = { "workers", "inline" };
+        world_check_result res[2];
+        int ret;
+
+        // Inline against inline would always agree
+        if (nr_workers == THREAD_POOL_WORKERS_INLINE) {
+                pr_err_func("threaded run needs workers\n");
+                return -EINVAL;
+        }
+
+        ret = world_check_run(nr_workers, NULL, 0, &res[0]);
+        if (ret)
+                return ret;
+
+        ret = world_check_run(THREAD_POOL_WORKERS_INLINE, NULL, 0, &res[1]);
+        if (ret)
+                return ret;
+
+        return world_check_compare(res, name);
+}
+
+/**
+ * world_upload_check() - check upload thread uploads what render thread does
+ *
+ * Same world is built and flushed once with upload thread and once with
+ * uploads on calling thread. Flushed chunks, bytes of their meshes in
+ * GPU buffers and contents read back must be equal. Nothing is drawn, so it
+ * runs headless, e.g. under a software rasterizer.
+ *
+ * @param nr_workers: workers count of both runs, inline is not allowed
+ * @param shared: hidden window sharing objects with current context
+ * @return 0 if both runs agree
+ */
+int world_upload_check(int nr_workers, GLFWwindow *shared)
+{
+        const char *name[2] = { "upload thread", "render thread" };
+        world_check_result res[2];
+        int ret;
+
+        if (!shared)
+                return -EINVAL;
+
+        ret = world_check_run(nr_workers, shared, 1, &res[0]);
+        if (ret)
+                return ret;
+
+        ret = world_check_run(nr_workers, NULL, 1, &res[1]);
+        if (ret)
+                return ret;
+
+        return world_check_compare(res, name);
+}
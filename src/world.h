@@ -7,6 +7,8 @@
 #include "chunks.h"
 #include "utils.h"
 
+#define WORLD_HIERARCHY_MAX             (16)
+
 typedef struct world_hierarchy {
         int32_t         height;
         int32_t         thickness;
@@ -28,4 +30,7 @@ typedef enum super_flat_preset_idx {
 world_preset *super_flat_preset_get(super_flat_preset_idx idx);
 int super_flat_generate(world *w, super_flat_preset_idx idx, int width, int length);
 
+int world_inline_check(int nr_workers);
+int world_upload_check(int nr_workers, GLFWwindow *shared);
+
 #endif //MYCRAFT_DEMO_CHUNK_H